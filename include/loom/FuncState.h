@@ -0,0 +1,22 @@
+/* This file will be included in C and C++ files. */
+
+#ifndef __LOOM_FUNC_STATE_H
+#define __LOOM_FUNC_STATE_H
+
+/*
+ * Bits of LoomFuncStates[FuncID]. The instrumented code loads the state word
+ * of the current function at every back edge, and calls LoomBackEdge only if
+ * the word is non-zero. The function entry only tests LoomPatched, and
+ * LoomGated if activations are counted.
+ */
+/* The function should run in the slow path. */
+#define LoomPatched (1)
+/* An update is evacuating threads, so back edges should be checked. */
+#define LoomPending (2)
+/*
+ * An update is waiting for the running activations of the function to finish.
+ * New activations wait at the entry. Only used with -loom-track-activations.
+ */
+#define LoomGated (4)
+
+#endif
@@ -6,22 +6,50 @@
 #include "llvm/Module.h"
 #include "llvm/Pass.h"
 #include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/ADT/StringSet.h"
 
 using namespace llvm;
 
 namespace loom {
+// Identifies call sites that may block, and assigns each of them an ID.
+// A call site blocks if it calls an external function in the blocking list
+// (-blocking-funcs), or a blocking wrapper. A blocking wrapper is a function
+// that always calls a blocking function before returning, and does nothing
+// Loom needs to instrument; its call sites are instrumented instead of the
+// blocking call sites inside it.
+//
+// Consecutive blocking calls in a basic block, separated only by instructions
+// that are not calls, form one blocking region, which is identified by its
+// first call. Threads release LoomUpdateLock once around the whole region, so
+// instructions inside it have no slots.
 struct IdentifyBlockingCS: public ModulePass {
   static char ID;
 
-  static bool IsBlockingExternal(const Function &F);
-
   IdentifyBlockingCS(): ModulePass(ID) {}
   virtual bool runOnModule(Module &M);
   virtual void getAnalysisUsage(AnalysisUsage &AU) const;
   unsigned getID(const Instruction *I) const;
+  // Returns the last blocking call of the region starting at <I>.
+  Instruction *getRegionEnd(Instruction *I) const;
+  // Returns whether <I> is in a blocking region, but not the first call.
+  bool isInsideRegion(const Instruction *I) const;
+  bool isBlockingWrapper(const Function &F) const;
 
  private:
+  void loadBlockingFuncs();
+  bool isBlockingExternal(const Function &F) const;
+  bool isBlockingCall(const Instruction *I) const;
+  bool isWrapperCandidate(const Function &F) const;
+  bool alwaysBlocks(Function &F);
+  void identifyBlockingWrappers(Module &M);
+  Instruction *extendRegion(Instruction *Start) const;
+
+  StringSet<> BlockingFuncs;
+  DenseSet<const Function *> BlockingWrappers;
   DenseMap<const Instruction *, unsigned> CallSite2ID;
+  DenseMap<const Instruction *, Instruction *> RegionEnds;
+  DenseSet<const Instruction *> InsideRegions;
 };
 }
 
@@ -0,0 +1,50 @@
+#ifndef __LOOM_INSTRUMENT_REPORT_H
+#define __LOOM_INSTRUMENT_REPORT_H
+
+#include "llvm/Function.h"
+#include "llvm/ADT/StringRef.h"
+
+using namespace llvm;
+
+namespace loom {
+// What the instrumentation costs one function, reported with -loom-report.
+// CheckInserter and BBCloner fill in the numbers of the functions they
+// instrument.
+struct FunctionCost {
+  FunctionCost(): NumInstsBefore(0), NumInstsAfter(0), NumSlots(0),
+                  NumSwitches(0), NumCycleChecks(0), NumBlockingChecks(0),
+                  NumClonedBlocks(0) {}
+
+  // IR instructions before CheckInserter, and when the report is written
+  unsigned NumInstsBefore, NumInstsAfter;
+  unsigned NumSlots;
+  // branches between the slow path and the fast path
+  unsigned NumSwitches;
+  unsigned NumCycleChecks;
+  unsigned NumBlockingChecks;
+  // blocks cloned into the fast path
+  unsigned NumClonedBlocks;
+};
+
+// Returns whether -loom-report is given. The passes only collect costs if so.
+bool IsReporting();
+FunctionCost &GetFunctionCost(const Function &F);
+unsigned CountInstructions(const Function &F);
+// Writes the report to the file given by -loom-report. BBCloner, the last
+// pass, writes it when it finishes.
+void WriteReport(const Module &M);
+
+// Adds the wall time from its construction to its destruction to the runtime
+// of pass <PassName>.
+class PassTimer {
+ public:
+  explicit PassTimer(StringRef PassName);
+  ~PassTimer();
+
+ private:
+  StringRef PassName;
+  double Start;
+};
+}
+
+#endif
@@ -0,0 +1,36 @@
+/* This file will be included in C and C++ files. */
+
+#ifndef __LOOM_LOC_INDEX_H
+#define __LOOM_LOC_INDEX_H
+
+#include <stdint.h>
+
+/*
+ * A source location index maps file:line to slot IDs. It is built once per
+ * program by -build-loc-index, and is mmap'ed by the filter compiler. Layout:
+ *   struct LocIndexHeader Header;
+ *   struct LocIndexEntry Entries[NumEntries]; sorted by FileID, Line, SlotID
+ *   uint32_t FileNames[NumFiles];             offsets into Strings
+ *   char Strings[StringsSize];                NUL-terminated file names
+ * File IDs follow the lexical order of file names. All integers are in host
+ * byte order.
+ */
+#define LocIndexMagic (0x58494d4c) /* "LMIX" */
+#define LocIndexVersion (1)
+
+struct LocIndexHeader {
+  uint32_t Magic;
+  uint32_t Version;
+  uint32_t NumEntries;
+  uint32_t NumFiles;
+  uint32_t StringsSize;
+};
+
+struct LocIndexEntry {
+  uint32_t FileID;
+  uint32_t Line;
+  uint32_t SlotID;
+  uint32_t FuncID;
+};
+
+#endif
@@ -0,0 +1,19 @@
+#ifndef __LOOM_PARTITION_H
+#define __LOOM_PARTITION_H
+
+#include "llvm/Function.h"
+
+using namespace llvm;
+
+namespace loom {
+/*
+ * A large program can be instrumented by multiple processes in parallel. Each
+ * process loads the whole module, so that all processes assign the same IDs
+ * (StableIDs) to new functions, but only instruments and emits the functions
+ * in its own partition.
+ */
+bool IsInPartition(const Function &F);
+bool IsFirstPartition();
+}
+
+#endif
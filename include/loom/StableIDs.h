@@ -0,0 +1,85 @@
+#ifndef __LOOM_STABLE_IDS_H
+#define __LOOM_STABLE_IDS_H
+
+#include <utility>
+#include <vector>
+
+#include "llvm/Module.h"
+#include "llvm/Pass.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/StringMap.h"
+
+using namespace llvm;
+
+namespace loom {
+// Assigns the IDs that instrumented code and filters refer to: function IDs,
+// slot IDs, back edge IDs and blocking call site IDs. IDAssigner,
+// IdentifyBackEdges and IdentifyBlockingCS number these over the whole
+// program, so an edit early in the module would shift every later ID.
+// Instead, each function owns a range of each kind of ID, and numbers its own
+// slots, back edges and call sites relative to the bases of its ranges.
+//
+// The ranges are kept in an ID map across builds (-loom-id-map). Ranges leave
+// room for a function to grow. A function keeps its ranges as long as its IDs
+// fit in them, so its instrumented code and the filters that refer to it stay
+// the same; otherwise it moves to new ranges at the end. Functions new to the
+// map get ranges at the end in module order, and functions that are gone keep
+// theirs, so their IDs are never reused.
+//
+// An edit inside a function shifts the IDs of its later slots. The ID map and
+// compiled filters record a hash of the slots of each function, and the
+// runtime refuses a filter if the hash of a function it patches has changed.
+struct StableIDs: public ModulePass {
+  static char ID;
+  static const unsigned InvalidID = (unsigned)-1;
+
+  StableIDs(): ModulePass(ID) {}
+  virtual bool runOnModule(Module &M);
+  virtual void getAnalysisUsage(AnalysisUsage &AU) const;
+  unsigned getFunctionID(const Function *F) const;
+  unsigned getInstructionID(const Instruction *I) const;
+  Instruction *getInstruction(unsigned InsID) const;
+  unsigned getBackEdgeID(const BasicBlock *B1, const BasicBlock *B2) const;
+  unsigned getCallSiteID(const Instruction *I) const;
+  // Hash of what the slot IDs of <F> refer to.
+  unsigned getFunctionHash(const Function *F) const;
+  // One past the largest ID of each kind, counting the IDs reserved in the ID
+  // map. The runtime sizes its tables accordingly.
+  unsigned getNumFunctions() const { return NumFuncs; }
+  unsigned getNumInstructions() const { return NumInsts; }
+  unsigned getNumBackEdges() const { return NumBackEdges; }
+  unsigned getNumCallSites() const { return NumCallSites; }
+
+ private:
+  typedef std::pair<const BasicBlock *, const BasicBlock *> Edge;
+
+  // the IDs a function owns
+  struct Ranges {
+    unsigned FuncID;
+    unsigned SlotBase, NumSlots;
+    unsigned BackEdgeBase, NumBackEdges;
+    unsigned CallSiteBase, NumCallSites;
+    unsigned Hash;
+  };
+
+  static unsigned Reserve(unsigned Needed);
+  static unsigned HashSlots(const std::vector<const Instruction *> &Slots);
+
+  void loadIDMap();
+  void saveIDMap() const;
+  void assignIDs(Function &F);
+
+  // function name -> ranges
+  StringMap<Ranges> IDMap;
+  unsigned NumFuncs, NumInsts, NumBackEdges, NumCallSites;
+  DenseMap<const Function *, unsigned> FuncIDs;
+  DenseMap<const Function *, unsigned> FuncHashes;
+  DenseMap<const Instruction *, unsigned> InsIDs;
+  DenseMap<Edge, unsigned> BackEdgeIDs;
+  DenseMap<const Instruction *, unsigned> CallSiteIDs;
+  // slot ID -> instruction, NULL for reserved IDs
+  std::vector<Instruction *> Insts;
+};
+}
+
+#endif
@@ -9,10 +9,17 @@
 extern "C" {
 #endif
 
-#define MaxBufferSize (1024)
+#define MaxBufferSize (4096)
 
 int SendMessage(int Sock, const char *M);
 int ReceiveMessage(int Sock, char *M);
+/*
+ * A tagged message carries a tag besides its text. The controller tags its
+ * requests, and the responses carry the tags of the requests they answer.
+ * Tag 0 is for messages nobody asked for, e.g. rollbacks by the watchdog.
+ */
+int SendTaggedMessage(int Sock, unsigned Tag, const char *M);
+int ReceiveTaggedMessage(int Sock, unsigned *Tag, char *M);
 int SendExactly(int Sock, const void *Buffer, size_t L);
 int ReceiveExactly(int Sock, void *Buffer, size_t L);
 
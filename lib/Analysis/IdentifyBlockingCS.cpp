@@ -1,11 +1,18 @@
 #define DEBUG_TYPE "loom"
 
+#include <fstream>
 #include <string>
 
+#include "llvm/IntrinsicInst.h"
 #include "llvm/ADT/Statistic.h"
+#include "llvm/Analysis/Dominators.h"
 #include "llvm/Support/CallSite.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/ErrorHandling.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
 
 #include "loom/IdentifyBlockingCS.h"
+#include "loom/InstrumentReport.h"
 
 using namespace std;
 using namespace loom;
@@ -16,54 +23,254 @@ static RegisterPass<IdentifyBlockingCS> X(
     false,
     true);
 
+static cl::opt<string> BlockingFuncsFileName(
+    "blocking-funcs",
+    cl::desc("A file listing the external functions that may block, one per "
+             "line. Replaces the built-in list. The instrumenter and the "
+             "compiler must use the same list"));
+static cl::opt<bool> IdentifyWrappers(
+    "blocking-wrappers",
+    cl::desc("Instrument calls to functions that always block instead of the "
+             "blocking calls inside them"),
+    cl::init(true));
+static cl::opt<bool> CoalesceBlockingCS(
+    "coalesce-blocking-cs",
+    cl::desc("Release LoomUpdateLock once around consecutive blocking calls "
+             "in a basic block"),
+    cl::init(true));
+
 STATISTIC(NumBlockingCallSites, "Number of blocking external call sites");
+STATISTIC(NumCoalescedCallSites,
+          "Number of blocking calls merged into the region of a previous one");
+STATISTIC(NumBlockingWrappers, "Number of blocking wrappers");
 
 char IdentifyBlockingCS::ID = 0;
 
-bool IdentifyBlockingCS::IsBlockingExternal(const Function &F) {
-  string Name = F.getName();
-  return (Name == "_ZNSi6ignoreEv" ||
-          Name == "abort" ||
-          Name == "accept" ||
-          Name == "connect" ||
-          Name == "fork" ||
-          Name == "fprintf" ||
-          Name == "fputc" ||
-          Name == "fputs" ||
-          Name == "fwrite" ||
-          Name == "open" ||
-          Name == "printf" ||
-          Name == "pthread_join" ||
-          Name == "pthread_mutex_lock" ||
-          Name == "pthread_cond_wait" ||
-          Name == "pthread_cond_timedwait" ||
-          Name == "puts" ||
-          Name == "read" ||
-          Name == "recvfrom" ||
-          Name == "scanf" ||
-          Name == "select" ||
-          Name == "semop" ||
-          Name == "sendto" ||
-          Name == "sigwait" ||
-          Name == "write");
+static const char *DefaultBlockingFuncs[] = {
+  "_ZNSi6ignoreEv",
+  "abort",
+  "accept",
+  "accept4",
+  "clock_nanosleep",
+  "connect",
+  "epoll_pwait",
+  "epoll_wait",
+  "fgets",
+  "flock",
+  "fork",
+  "fprintf",
+  "fputc",
+  "fputs",
+  "fread",
+  "futex",
+  "fwrite",
+  "io_getevents",
+  "msgrcv",
+  "nanosleep",
+  "open",
+  "poll",
+  "ppoll",
+  "pread",
+  "printf",
+  "pselect",
+  "pthread_barrier_wait",
+  "pthread_cond_timedwait",
+  "pthread_cond_wait",
+  "pthread_join",
+  "pthread_mutex_lock",
+  "pthread_rwlock_rdlock",
+  "pthread_rwlock_wrlock",
+  "puts",
+  "pwrite",
+  "read",
+  "readv",
+  "recv",
+  "recvfrom",
+  "recvmsg",
+  "scanf",
+  "select",
+  "sem_timedwait",
+  "sem_wait",
+  "semop",
+  "send",
+  "sendmsg",
+  "sendto",
+  "sigwait",
+  "sleep",
+  "usleep",
+  "wait",
+  "waitpid",
+  "write",
+  "writev"
+};
+
+void IdentifyBlockingCS::loadBlockingFuncs() {
+  BlockingFuncs.clear();
+  if (BlockingFuncsFileName == "") {
+    for (size_t i = 0;
+         i < sizeof(DefaultBlockingFuncs) / sizeof(DefaultBlockingFuncs[0]);
+         ++i) {
+      BlockingFuncs.insert(DefaultBlockingFuncs[i]);
+    }
+    return;
+  }
+
+  ifstream BlockingFuncsFile(BlockingFuncsFileName.c_str());
+  if (!BlockingFuncsFile) {
+    report_fatal_error("cannot open " + BlockingFuncsFileName);
+  }
+  // Skip empty lines and comments starting with #.
+  string Line;
+  while (getline(BlockingFuncsFile, Line)) {
+    StringRef Name = StringRef(Line).split('#').first.trim();
+    if (!Name.empty())
+      BlockingFuncs.insert(Name);
+  }
+}
+
+bool IdentifyBlockingCS::isBlockingExternal(const Function &F) const {
+  return BlockingFuncs.count(F.getName());
+}
+
+bool IdentifyBlockingCS::isBlockingCall(const Instruction *I) const {
+  ImmutableCallSite CS(I);
+  if (!CS)
+    return false;
+  // FIXME: we assume function pointers do not point to external blocking
+  // functions, which is not always true.
+  const Function *Callee = CS.getCalledFunction();
+  if (Callee == NULL)
+    return false;
+  return isBlockingExternal(*Callee) || isBlockingWrapper(*Callee);
+}
+
+bool IdentifyBlockingCS::isBlockingWrapper(const Function &F) const {
+  return BlockingWrappers.count(&F);
+}
+
+// Code inside a blocking wrapper runs without LoomUpdateLock, so it must not
+// contain anything Loom instruments: loops, calls to instrumented functions,
+// thread entries and exits. It is never cloned, and has no slots.
+bool IdentifyBlockingCS::isWrapperCandidate(const Function &F) const {
+  if (F.isDeclaration() || F.getName() == "main")
+    return false;
+  // All callers must be direct calls, which we can instrument.
+  if (F.hasAddressTaken())
+    return false;
+
+  SmallVector<pair<const BasicBlock *, const BasicBlock *>, 8> BackEdges;
+  FindFunctionBackedges(F, BackEdges);
+  if (!BackEdges.empty())
+    return false;
+
+  for (Function::const_iterator B = F.begin(); B != F.end(); ++B) {
+    for (BasicBlock::const_iterator I = B->begin(); I != B->end(); ++I) {
+      ImmutableCallSite CS(I);
+      if (!CS)
+        continue;
+      const Function *Callee = CS.getCalledFunction();
+      if (Callee == NULL || Callee->getName() == "pthread_exit")
+        return false;
+      if (!Callee->isDeclaration() && !isBlockingWrapper(*Callee))
+        return false;
+      // An external function may call back into the program, e.g. qsort
+      // with a comparator, or pthread_once.
+      for (unsigned i = 0; i < CS.arg_size(); ++i) {
+        const Value *Arg = CS.getArgument(i);
+        if (PointerType *PT = dyn_cast<PointerType>(Arg->getType())) {
+          if (isa<FunctionType>(PT->getElementType()))
+            return false;
+        }
+        const Function *Fn = dyn_cast<Function>(Arg->stripPointerCasts());
+        if (Fn && !Fn->isDeclaration())
+          return false;
+      }
+    }
+  }
+  return true;
+}
+
+// Returns whether a blocking call dominates all returns of <F>.
+bool IdentifyBlockingCS::alwaysBlocks(Function &F) {
+  DominatorTree &DT = getAnalysis<DominatorTree>(F);
+  vector<Instruction *> BlockingCalls, Returns;
+  for (Function::iterator B = F.begin(); B != F.end(); ++B) {
+    if (isa<ReturnInst>(B->getTerminator()))
+      Returns.push_back(B->getTerminator());
+    for (BasicBlock::iterator I = B->begin(); I != B->end(); ++I) {
+      if (isBlockingCall(I))
+        BlockingCalls.push_back(I);
+    }
+  }
+  if (Returns.empty())
+    return false;
+  for (size_t i = 0; i < BlockingCalls.size(); ++i) {
+    bool DominatesAll = true;
+    for (size_t j = 0; j < Returns.size(); ++j) {
+      if (!DT.dominates(BlockingCalls[i], Returns[j])) {
+        DominatesAll = false;
+        break;
+      }
+    }
+    if (DominatesAll)
+      return true;
+  }
+  return false;
+}
+
+void IdentifyBlockingCS::identifyBlockingWrappers(Module &M) {
+  // Grow the set of wrappers until it reaches a fixpoint, so that wrappers of
+  // wrappers are found as well. Starting from the empty set never admits a
+  // recursive function.
+  bool Changed;
+  do {
+    Changed = false;
+    for (Module::iterator F = M.begin(); F != M.end(); ++F) {
+      if (!isBlockingWrapper(*F) && isWrapperCandidate(*F) &&
+          alwaysBlocks(*F)) {
+        BlockingWrappers.insert(F);
+        Changed = true;
+      }
+    }
+  } while (Changed);
+  NumBlockingWrappers = BlockingWrappers.size();
 }
 
 void IdentifyBlockingCS::getAnalysisUsage(AnalysisUsage &AU) const {
   AU.setPreservesAll();
+  AU.addRequired<DominatorTree>();
 }
 
 bool IdentifyBlockingCS::runOnModule(Module &M) {
+  PassTimer Timer("identify-blocking-cs");
+  loadBlockingFuncs();
+  BlockingWrappers.clear();
+  CallSite2ID.clear();
+  RegionEnds.clear();
+  InsideRegions.clear();
+  if (IdentifyWrappers)
+    identifyBlockingWrappers(M);
+
   for (Module::iterator F = M.begin(); F != M.end(); ++F) {
+    // Call sites inside wrappers are covered by the call sites of wrappers.
+    if (isBlockingWrapper(*F))
+      continue;
     for (Function::iterator B = F->begin(); B != F->end(); ++B) {
       for (BasicBlock::iterator I = B->begin(); I != B->end(); ++I) {
-        CallSite CS(I);
-        if (CS) {
-          // FIXME: we assume function pointers do not point to external blocking
-          // functions, which is not always true.
-          if (Function *Callee = CS.getCalledFunction()) {
-            if (IsBlockingExternal(*Callee)) {
-              unsigned CallSiteID = CallSite2ID.size();
-              CallSite2ID[I] = CallSiteID;
+        if (isBlockingCall(I)) {
+          unsigned CallSiteID = CallSite2ID.size();
+          CallSite2ID[I] = CallSiteID;
+          if (CoalesceBlockingCS) {
+            Instruction *End = extendRegion(I);
+            if (End != I) {
+              RegionEnds[I] = End;
+              // Continue after the region.
+              while (I != End) {
+                ++I;
+                InsideRegions.insert(I);
+                if (isBlockingCall(I))
+                  ++NumCoalescedCallSites;
+              }
             }
           }
         }
@@ -74,6 +281,35 @@ bool IdentifyBlockingCS::runOnModule(Module &M) {
   return false;
 }
 
+// Only instructions that are not calls may separate blocking calls in a region.
+// They run without LoomUpdateLock, but never block or run Loom's code.
+Instruction *IdentifyBlockingCS::extendRegion(Instruction *Start) const {
+  // Invokes terminate their basic blocks.
+  if (!isa<CallInst>(Start))
+    return Start;
+  Instruction *End = Start;
+  BasicBlock::iterator I = Start;
+  for (++I; !isa<TerminatorInst>(I); ++I) {
+    if (isBlockingCall(I))
+      End = I;
+    else if (isa<CallInst>(I) && !isa<IntrinsicInst>(I))
+      break;
+  }
+  return End;
+}
+
+Instruction *IdentifyBlockingCS::getRegionEnd(Instruction *I) const {
+  DenseMap<const Instruction *, Instruction *>::const_iterator IT;
+  IT = RegionEnds.find(I);
+  if (IT == RegionEnds.end())
+    return I;
+  return IT->second;
+}
+
+bool IdentifyBlockingCS::isInsideRegion(const Instruction *I) const {
+  return InsideRegions.count(I);
+}
+
 unsigned IdentifyBlockingCS::getID(const Instruction *I) const {
   DenseMap<const Instruction *, unsigned>::const_iterator IT;
   IT = CallSite2ID.find(I);
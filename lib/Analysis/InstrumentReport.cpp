@@ -0,0 +1,128 @@
+// The instrumenter passes live in several plugins. The report lives in
+// LoomAnalysis, which all of them load.
+
+#include <map>
+#include <string>
+
+#include "llvm/Module.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/Timer.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "loom/InstrumentReport.h"
+
+using namespace std;
+using namespace llvm;
+using namespace loom;
+
+static cl::opt<string> ReportFileName(
+    "loom-report",
+    cl::desc("Write what the instrumentation costs each function, and the "
+             "runtime of each pass, to <file> in JSON"));
+
+// function name -> cost, sorted by names so that reports diff well
+static map<string, FunctionCost> Costs;
+// pass name -> seconds
+static map<string, double> PassTimes;
+
+bool loom::IsReporting() {
+  return ReportFileName != "";
+}
+
+FunctionCost &loom::GetFunctionCost(const Function &F) {
+  return Costs[F.getName().str()];
+}
+
+unsigned loom::CountInstructions(const Function &F) {
+  unsigned NumInsts = 0;
+  for (Function::const_iterator B = F.begin(); B != F.end(); ++B)
+    NumInsts += B->size();
+  return NumInsts;
+}
+
+PassTimer::PassTimer(StringRef PassName): PassName(PassName) {
+  Start = TimeRecord::getCurrentTime(true).getWallTime();
+}
+
+PassTimer::~PassTimer() {
+  if (IsReporting()) {
+    double End = TimeRecord::getCurrentTime(false).getWallTime();
+    PassTimes[PassName.str()] += End - Start;
+  }
+}
+
+// Function names are mangled, but may still contain any character.
+static void PrintString(raw_ostream &O, StringRef S) {
+  O << '"';
+  for (size_t i = 0; i < S.size(); ++i) {
+    unsigned char C = S[i];
+    if (C == '"' || C == '\\')
+      O << '\\' << C;
+    else if (C < 0x20)
+      O << "\\u00" << hexdigit(C >> 4, true) << hexdigit(C & 0xf, true);
+    else
+      O << C;
+  }
+  O << '"';
+}
+
+static void PrintCost(raw_ostream &O, const FunctionCost &C) {
+  O << "\"insts_before\": " << C.NumInstsBefore
+      << ", \"insts_after\": " << C.NumInstsAfter
+      << ", \"slots\": " << C.NumSlots
+      << ", \"switches\": " << C.NumSwitches
+      << ", \"cycle_checks\": " << C.NumCycleChecks
+      << ", \"blocking_checks\": " << C.NumBlockingChecks
+      << ", \"cloned_blocks\": " << C.NumClonedBlocks;
+}
+
+void loom::WriteReport(const Module &M) {
+  if (!IsReporting())
+    return;
+  string ErrorInfo;
+  raw_fd_ostream ReportFile(ReportFileName.c_str(), ErrorInfo);
+  if (!ErrorInfo.empty()) {
+    errs() << "cannot write " << ReportFileName << ": " << ErrorInfo << "\n";
+    return;
+  }
+
+  FunctionCost Total;
+  for (map<string, FunctionCost>::iterator I = Costs.begin();
+       I != Costs.end(); ++I) {
+    FunctionCost &C = I->second;
+    if (const Function *F = M.getFunction(I->first))
+      C.NumInstsAfter = CountInstructions(*F);
+    Total.NumInstsBefore += C.NumInstsBefore;
+    Total.NumInstsAfter += C.NumInstsAfter;
+    Total.NumSlots += C.NumSlots;
+    Total.NumSwitches += C.NumSwitches;
+    Total.NumCycleChecks += C.NumCycleChecks;
+    Total.NumBlockingChecks += C.NumBlockingChecks;
+    Total.NumClonedBlocks += C.NumClonedBlocks;
+  }
+
+  ReportFile << "{\"module\": ";
+  PrintString(ReportFile, M.getModuleIdentifier());
+  ReportFile << ",\n\"total\": {\"functions\": " << Costs.size() << ", ";
+  PrintCost(ReportFile, Total);
+  ReportFile << "},\n\"pass_seconds\": {";
+  for (map<string, double>::iterator I = PassTimes.begin();
+       I != PassTimes.end(); ++I) {
+    if (I != PassTimes.begin())
+      ReportFile << ", ";
+    PrintString(ReportFile, I->first);
+    ReportFile << ": " << format("%.6f", I->second);
+  }
+  ReportFile << "},\n\"functions\": [";
+  for (map<string, FunctionCost>::iterator I = Costs.begin();
+       I != Costs.end(); ++I) {
+    ReportFile << (I == Costs.begin() ? "\n" : ",\n") << "{\"name\": ";
+    PrintString(ReportFile, I->first);
+    ReportFile << ", ";
+    PrintCost(ReportFile, I->second);
+    ReportFile << "}";
+  }
+  ReportFile << "\n]}\n";
+}
@@ -0,0 +1,272 @@
+#include <algorithm>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "llvm/Instructions.h"
+#include "llvm/ADT/StringSet.h"
+#include "llvm/Support/CallSite.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "rcs/IDAssigner.h"
+#include "rcs/IdentifyBackEdges.h"
+
+#include "loom/IdentifyBlockingCS.h"
+#include "loom/StableIDs.h"
+
+using namespace std;
+using namespace llvm;
+using namespace rcs;
+using namespace loom;
+
+static RegisterPass<StableIDs> X(
+    "stable-ids",
+    "Assign IDs that stay the same across builds",
+    false,
+    true);
+
+static cl::opt<string> IDMapFileName(
+    "loom-id-map",
+    cl::desc("The ID map of the previous build. The instrumenter and the "
+             "compiler must use the same map"));
+static cl::opt<string> OutputIDMapFileName(
+    "loom-output-id-map",
+    cl::desc("Where to write the ID map of this build"));
+
+char StableIDs::ID = 0;
+
+// Functions already reported as changed. The instrumenter runs StableIDs more
+// than once.
+static StringSet<> ReportedChanges;
+
+void StableIDs::getAnalysisUsage(AnalysisUsage &AU) const {
+  AU.setPreservesAll();
+  AU.addRequired<IDAssigner>();
+  AU.addRequired<IdentifyBackEdges>();
+  AU.addRequired<IdentifyBlockingCS>();
+}
+
+// Leave room for a function to grow, so that small edits keep its IDs.
+unsigned StableIDs::Reserve(unsigned Needed) {
+  return Needed + Needed / 4 + 2;
+}
+
+static void HashWord(unsigned &Hash, unsigned Word) {
+  for (unsigned i = 0; i < 4; ++i) {
+    Hash ^= (Word >> (i * 8)) & 0xff;
+    Hash *= 16777619U;
+  }
+}
+
+// FNV-1a over the opcode and the number of operands of each slot, and the
+// callee of each direct call. Adding, removing or reordering slots changes
+// the hash. Names, constants and debug info do not.
+unsigned StableIDs::HashSlots(const vector<const Instruction *> &Slots) {
+  unsigned Hash = 2166136261U;
+  for (size_t i = 0; i < Slots.size(); ++i) {
+    HashWord(Hash, Slots[i]->getOpcode());
+    HashWord(Hash, Slots[i]->getNumOperands());
+    ImmutableCallSite CS(Slots[i]);
+    if (CS && CS.getCalledFunction()) {
+      StringRef Name = CS.getCalledFunction()->getName();
+      for (size_t j = 0; j < Name.size(); ++j)
+        HashWord(Hash, (unsigned char)Name[j]);
+    }
+  }
+  return Hash;
+}
+
+bool StableIDs::runOnModule(Module &M) {
+  IDMap.clear();
+  NumFuncs = NumInsts = NumBackEdges = NumCallSites = 0;
+  FuncIDs.clear();
+  FuncHashes.clear();
+  InsIDs.clear();
+  BackEdgeIDs.clear();
+  CallSiteIDs.clear();
+  Insts.clear();
+
+  if (IDMapFileName != "")
+    loadIDMap();
+  // Visit functions in module order, so that the instrumenter, all its
+  // partitions and the compiler give new functions the same IDs.
+  for (Module::iterator F = M.begin(); F != M.end(); ++F) {
+    if (!F->isDeclaration())
+      assignIDs(*F);
+  }
+  Insts.resize(NumInsts, NULL);
+  for (DenseMap<const Instruction *, unsigned>::iterator I = InsIDs.begin();
+       I != InsIDs.end();
+       ++I) {
+    Insts[I->second] = const_cast<Instruction *>(I->first);
+  }
+
+  if (OutputIDMapFileName != "")
+    saveIDMap();
+  return false;
+}
+
+void StableIDs::assignIDs(Function &F) {
+  IDAssigner &IDA = getAnalysis<IDAssigner>();
+  IdentifyBackEdges &IBE = getAnalysis<IdentifyBackEdges>();
+  IdentifyBlockingCS &IBCS = getAnalysis<IdentifyBlockingCS>();
+
+  // Number the IDs of <F> in the order of its instructions and edges.
+  vector<const Instruction *> Slots, CallSites;
+  vector<Edge> BackEdges;
+  for (Function::iterator B = F.begin(); B != F.end(); ++B) {
+    TerminatorInst *TI = B->getTerminator();
+    for (unsigned j = 0; j < TI->getNumSuccessors(); ++j) {
+      BasicBlock *Succ = TI->getSuccessor(j);
+      // B may reach Succ via multiple successor slots.
+      bool Visited = false;
+      for (unsigned k = 0; k < j; ++k) {
+        if (TI->getSuccessor(k) == Succ)
+          Visited = true;
+      }
+      if (!Visited && IBE.getID(B, Succ) != (unsigned)-1)
+        BackEdges.push_back(Edge(B, Succ));
+    }
+    for (BasicBlock::iterator I = B->begin(); I != B->end(); ++I) {
+      if (IDA.getInstructionID(I) != IDAssigner::InvalidID)
+        Slots.push_back(I);
+      if (IBCS.getID(I) != (unsigned)-1)
+        CallSites.push_back(I);
+    }
+  }
+
+  // Keep the ranges of <F> if its IDs still fit in them.
+  StringMap<Ranges>::iterator Pos = IDMap.find(F.getName());
+  bool IsNew = (Pos == IDMap.end());
+  Ranges &R = IDMap[F.getName()];
+  if (IsNew)
+    R.FuncID = NumFuncs++;
+  unsigned Hash = HashSlots(Slots);
+  // Report once, when writing the new map.
+  if (!IsNew && R.Hash != Hash && OutputIDMapFileName != "" &&
+      ReportedChanges.insert(F.getName())) {
+    errs() << "the slots of " << F.getName() << " changed. Filters compiled "
+        << "against the previous build that patch it are rejected\n";
+  }
+  R.Hash = Hash;
+  if (IsNew || Slots.size() > R.NumSlots) {
+    R.SlotBase = NumInsts;
+    R.NumSlots = Reserve(Slots.size());
+    NumInsts += R.NumSlots;
+  }
+  if (IsNew || BackEdges.size() > R.NumBackEdges) {
+    R.BackEdgeBase = NumBackEdges;
+    R.NumBackEdges = Reserve(BackEdges.size());
+    NumBackEdges += R.NumBackEdges;
+  }
+  if (IsNew || CallSites.size() > R.NumCallSites) {
+    R.CallSiteBase = NumCallSites;
+    R.NumCallSites = Reserve(CallSites.size());
+    NumCallSites += R.NumCallSites;
+  }
+
+  FuncIDs[&F] = R.FuncID;
+  FuncHashes[&F] = Hash;
+  for (size_t i = 0; i < Slots.size(); ++i)
+    InsIDs[Slots[i]] = R.SlotBase + i;
+  for (size_t i = 0; i < BackEdges.size(); ++i)
+    BackEdgeIDs[BackEdges[i]] = R.BackEdgeBase + i;
+  for (size_t i = 0; i < CallSites.size(); ++i)
+    CallSiteIDs[CallSites[i]] = R.CallSiteBase + i;
+}
+
+// Each line of the ID map is
+//   <func ID> <slot base> <# of slots> <back edge base> <# of back edges>
+//   <call site base> <# of call sites> <hash of slots> <function name>
+// The name goes last because it may contain spaces.
+void StableIDs::loadIDMap() {
+  ifstream IDMapFile(IDMapFileName.c_str());
+  // The first build has no ID map.
+  if (!IDMapFile)
+    return;
+  Ranges R;
+  while (IDMapFile >> R.FuncID >> R.SlotBase >> R.NumSlots
+         >> R.BackEdgeBase >> R.NumBackEdges
+         >> R.CallSiteBase >> R.NumCallSites >> R.Hash) {
+    string Name;
+    IDMapFile.get();
+    if (!getline(IDMapFile, Name) || IDMap.count(Name))
+      break;
+    IDMap[Name] = R;
+    NumFuncs = max(NumFuncs, R.FuncID + 1);
+    NumInsts = max(NumInsts, R.SlotBase + R.NumSlots);
+    NumBackEdges = max(NumBackEdges, R.BackEdgeBase + R.NumBackEdges);
+    NumCallSites = max(NumCallSites, R.CallSiteBase + R.NumCallSites);
+  }
+  if (!IDMapFile.eof()) {
+    // Starting over is safe, but changes every ID.
+    errs() << IDMapFileName << ": wrong format. Assigning new IDs\n";
+    IDMap.clear();
+    NumFuncs = NumInsts = NumBackEdges = NumCallSites = 0;
+  }
+}
+
+static bool CompareFuncIDs(const pair<unsigned, string> &A,
+                           const pair<unsigned, string> &B) {
+  return A.first < B.first;
+}
+
+void StableIDs::saveIDMap() const {
+  string ErrorInfo;
+  raw_fd_ostream IDMapFile(OutputIDMapFileName.c_str(), ErrorInfo);
+  if (!ErrorInfo.empty()) {
+    errs() << "cannot write " << OutputIDMapFileName << ": " << ErrorInfo
+        << "\n";
+    return;
+  }
+  // Sort by function IDs, so that saving the same map gives the same file.
+  vector<pair<unsigned, string> > Funcs;
+  for (StringMap<Ranges>::const_iterator I = IDMap.begin();
+       I != IDMap.end();
+       ++I) {
+    Funcs.push_back(make_pair(I->getValue().FuncID, I->getKey().str()));
+  }
+  sort(Funcs.begin(), Funcs.end(), CompareFuncIDs);
+  for (size_t i = 0; i < Funcs.size(); ++i) {
+    const Ranges &R = IDMap.find(Funcs[i].second)->getValue();
+    IDMapFile << R.FuncID << " " << R.SlotBase << " " << R.NumSlots << " "
+        << R.BackEdgeBase << " " << R.NumBackEdges << " "
+        << R.CallSiteBase << " " << R.NumCallSites << " " << R.Hash << " "
+        << Funcs[i].second << "\n";
+  }
+}
+
+unsigned StableIDs::getFunctionID(const Function *F) const {
+  DenseMap<const Function *, unsigned>::const_iterator I = FuncIDs.find(F);
+  return I == FuncIDs.end() ? InvalidID : I->second;
+}
+
+// Instructions inserted after StableIDs runs, e.g. the checks, have no IDs.
+unsigned StableIDs::getInstructionID(const Instruction *I) const {
+  DenseMap<const Instruction *, unsigned>::const_iterator Pos =
+      InsIDs.find(I);
+  return Pos == InsIDs.end() ? InvalidID : Pos->second;
+}
+
+Instruction *StableIDs::getInstruction(unsigned InsID) const {
+  return InsID < Insts.size() ? Insts[InsID] : NULL;
+}
+
+unsigned StableIDs::getBackEdgeID(const BasicBlock *B1,
+                                  const BasicBlock *B2) const {
+  DenseMap<Edge, unsigned>::const_iterator I =
+      BackEdgeIDs.find(make_pair(B1, B2));
+  return I == BackEdgeIDs.end() ? InvalidID : I->second;
+}
+
+unsigned StableIDs::getFunctionHash(const Function *F) const {
+  DenseMap<const Function *, unsigned>::const_iterator I = FuncHashes.find(F);
+  return I == FuncHashes.end() ? 0 : I->second;
+}
+
+unsigned StableIDs::getCallSiteID(const Instruction *I) const {
+  DenseMap<const Instruction *, unsigned>::const_iterator Pos =
+      CallSiteIDs.find(I);
+  return Pos == CallSiteIDs.end() ? InvalidID : Pos->second;
+}
@@ -1,14 +1,25 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <cstdlib>
 #include <fstream>
 #include <string>
+#include <vector>
 
 #include "llvm/Module.h"
 #include "llvm/Pass.h"
 #include "llvm/Support/CommandLine.h"
 #include "llvm/Support/raw_ostream.h"
 
-#include "rcs/IDAssigner.h"
 #include "rcs/typedefs.h"
 
+#include "loom/IdentifyBlockingCS.h"
+#include "loom/LocIndex.h"
+#include "loom/StableIDs.h"
+
 using namespace std;
 using namespace llvm;
 using namespace rcs;
@@ -17,16 +28,36 @@ namespace loom {
 struct Compiler: public ModulePass {
   static char ID;
 
-  Compiler(): ModulePass(ID) {}
+  Compiler(): ModulePass(ID), LocIndex(NULL), LocIndexSize(0) {}
   virtual void getAnalysisUsage(AnalysisUsage &AU) const;
   virtual bool runOnModule(Module &M);
   virtual void print(raw_ostream &O, const Module *M) const;
 
  private:
-  bool Error; // indicate there is any error in compiling the .lm file
-  int FilterType;
-  InstList StartOps, EndOps;
-  FuncSet FuncsToPatch;
+  // The low-level execution filter compiled from one .lm file.
+  struct Filter {
+    Filter(): Error(false), FilterType(0) {}
+    bool Error; // indicate there is any error in compiling the .lm file
+    int FilterType;
+    InstList StartOps, EndOps;
+    FuncSet FuncsToPatch;
+  };
+
+  static string getFilterFileName(const string &LoomFileName);
+  static bool CompareEntries(const LocIndexEntry &A, const LocIndexEntry &B);
+
+  bool mapLocIndex();
+  void unmapLocIndex();
+  unsigned lookUpLocation(const string &FileName, unsigned Line) const;
+  unsigned resolveSlot(const string &LoomFileName, const string &Slot) const;
+  void compile(const string &LoomFileName, Filter &F);
+  void writeFilter(const string &LoomFileName, const Filter &F) const;
+  void printFilter(raw_ostream &O, const Filter &F) const;
+
+  vector<Filter> Filters;
+  // the source location index mapped from -loc-index
+  const char *LocIndex;
+  size_t LocIndexSize;
 };
 }
 using namespace loom;
@@ -37,73 +68,268 @@ static RegisterPass<Compiler> X(
     false,
     true);
 
-static cl::opt<string> LoomFileName("lm", cl::desc("Loom file name"));
+// Loading the module and assigning IDs dominates the compilation time.
+// Therefore, we accept multiple .lm files so that they share one run.
+static cl::list<string> LoomFileNames("lm",
+                                      cl::desc("Loom file name"),
+                                      cl::ZeroOrMore);
+static cl::opt<bool> WriteFilters(
+    "write-filters",
+    cl::desc("Write each compiled filter to <name>.filter next to its "
+             "<name>.lm instead of printing it"));
+static cl::opt<string> LocIndexFileName(
+    "loc-index",
+    cl::desc("The source location index built by -build-loc-index. "
+             "Required by operations written as <file>:<line>"));
 
 char Compiler::ID = 0;
 
 void Compiler::getAnalysisUsage(AnalysisUsage &AU) const {
   AU.setPreservesAll();
-  AU.addRequired<IDAssigner>();
+  AU.addRequired<StableIDs>();
+  AU.addRequired<IdentifyBlockingCS>();
 }
 
 bool Compiler::runOnModule(Module &M) {
-  IDAssigner &IDA = getAnalysis<IDAssigner>();
+  if (LocIndexFileName != "" && !mapLocIndex())
+    return false;
 
-  Error = false;
+  Filters.clear();
+  Filters.resize(LoomFileNames.size());
+  for (size_t i = 0; i < LoomFileNames.size(); ++i) {
+    compile(LoomFileNames[i], Filters[i]);
+    if (WriteFilters && !Filters[i].Error)
+      writeFilter(LoomFileNames[i], Filters[i]);
+  }
+
+  unmapLocIndex();
+  return false;
+}
+
+bool Compiler::mapLocIndex() {
+  int FD = open(LocIndexFileName.c_str(), O_RDONLY);
+  if (FD == -1) {
+    errs() << "cannot open " << LocIndexFileName << "\n";
+    return false;
+  }
+  struct stat St;
+  if (fstat(FD, &St) == -1 || (size_t)St.st_size < sizeof(LocIndexHeader)) {
+    errs() << LocIndexFileName << " is not a location index\n";
+    close(FD);
+    return false;
+  }
+  void *Addr = mmap(NULL, St.st_size, PROT_READ, MAP_SHARED, FD, 0);
+  close(FD);
+  if (Addr == MAP_FAILED) {
+    errs() << "cannot mmap " << LocIndexFileName << "\n";
+    return false;
+  }
+  LocIndex = (const char *)Addr;
+  LocIndexSize = St.st_size;
+
+  const LocIndexHeader *Header = (const LocIndexHeader *)LocIndex;
+  size_t ExpectedSize = sizeof(LocIndexHeader) +
+      (size_t)Header->NumEntries * sizeof(LocIndexEntry) +
+      (size_t)Header->NumFiles * sizeof(uint32_t) +
+      Header->StringsSize;
+  if (Header->Magic != LocIndexMagic ||
+      Header->Version != LocIndexVersion ||
+      ExpectedSize != LocIndexSize) {
+    errs() << LocIndexFileName << " is not a location index "
+        << "or is built by another version of Loom\n";
+    unmapLocIndex();
+    return false;
+  }
+  return true;
+}
+
+void Compiler::unmapLocIndex() {
+  if (LocIndex) {
+    munmap((void *)LocIndex, LocIndexSize);
+    LocIndex = NULL;
+    LocIndexSize = 0;
+  }
+}
+
+bool Compiler::CompareEntries(const LocIndexEntry &A, const LocIndexEntry &B) {
+  if (A.FileID != B.FileID)
+    return A.FileID < B.FileID;
+  return A.Line < B.Line;
+}
+
+unsigned Compiler::lookUpLocation(const string &FileName, unsigned Line) const {
+  const LocIndexHeader *Header = (const LocIndexHeader *)LocIndex;
+  const LocIndexEntry *Entries = (const LocIndexEntry *)(Header + 1);
+  const uint32_t *FileNames = (const uint32_t *)(Entries + Header->NumEntries);
+  const char *Strings = (const char *)(FileNames + Header->NumFiles);
+
+  // <FileName> may be a suffix of the full path, e.g. sql_parse.cc matches
+  // /home/user/mysql/sql/sql_parse.cc.
+  unsigned FileID = (unsigned)-1;
+  for (unsigned i = 0; i < Header->NumFiles; ++i) {
+    string FullPath = Strings + FileNames[i];
+    if (FullPath.size() < FileName.size())
+      continue;
+    size_t Start = FullPath.size() - FileName.size();
+    if (FullPath.compare(Start, FileName.size(), FileName) != 0)
+      continue;
+    if (Start > 0 && FullPath[Start - 1] != '/')
+      continue;
+    if (FileID != (unsigned)-1) {
+      errs() << FileName << " is ambiguous: "
+          << Strings + FileNames[FileID] << " and " << FullPath << "\n";
+      return StableIDs::InvalidID;
+    }
+    FileID = i;
+  }
+  if (FileID == (unsigned)-1) {
+    errs() << "no code from " << FileName << "\n";
+    return StableIDs::InvalidID;
+  }
+
+  // Entries of the same line are ordered by slot IDs. Return the first one.
+  LocIndexEntry Key;
+  Key.FileID = FileID;
+  Key.Line = Line;
+  const LocIndexEntry *Pos = lower_bound(Entries,
+                                         Entries + Header->NumEntries,
+                                         Key,
+                                         CompareEntries);
+  if (Pos == Entries + Header->NumEntries ||
+      Pos->FileID != FileID || Pos->Line != Line) {
+    errs() << "no code at " << FileName << ":" << Line << "\n";
+    return StableIDs::InvalidID;
+  }
+  return Pos->SlotID;
+}
+
+unsigned Compiler::resolveSlot(const string &LoomFileName,
+                               const string &Slot) const {
+  size_t Colon = Slot.rfind(':');
+  if (Colon == string::npos) {
+    char *End;
+    unsigned long SlotID = strtoul(Slot.c_str(), &End, 10);
+    if (Slot.empty() || *End != '\0') {
+      errs() << LoomFileName << ": wrong format\n";
+      return StableIDs::InvalidID;
+    }
+    return SlotID;
+  }
+
+  // <file>:<line>
+  if (!LocIndex) {
+    errs() << LoomFileName << ": " << Slot << " requires -loc-index\n";
+    return StableIDs::InvalidID;
+  }
+  char *End;
+  unsigned long Line = strtoul(Slot.c_str() + Colon + 1, &End, 10);
+  if (Colon + 1 == Slot.size() || *End != '\0') {
+    errs() << LoomFileName << ": wrong format\n";
+    return StableIDs::InvalidID;
+  }
+  return lookUpLocation(Slot.substr(0, Colon), Line);
+}
+
+void Compiler::compile(const string &LoomFileName, Filter &F) {
+  StableIDs &SIDs = getAnalysis<StableIDs>();
+  IdentifyBlockingCS &IBCS = getAnalysis<IdentifyBlockingCS>();
 
   ifstream LoomFile(LoomFileName.c_str());
   if (!LoomFile) {
     errs() << LoomFileName << " does not exist.\n";
-    Error = true;
-    return false;
+    F.Error = true;
+    return;
   }
 
   unsigned NumOps;
-  if (!(LoomFile >> FilterType >> NumOps)) {
-    errs() << "wrong format\n";
-    Error = true;
-    return false;
+  if (!(LoomFile >> F.FilterType >> NumOps)) {
+    errs() << LoomFileName << ": wrong format\n";
+    F.Error = true;
+    return;
   }
 
-  FuncsToPatch.clear();
   for (unsigned i = 0; i < NumOps; ++i) {
-    int StartEnd, SlotID;
-    if (!(LoomFile >> StartEnd >> SlotID)) {
-      errs() << "wrong format\n";
-      Error = true;
-      return false;
+    int StartEnd;
+    string Slot;
+    if (!(LoomFile >> StartEnd >> Slot)) {
+      errs() << LoomFileName << ": wrong format\n";
+      F.Error = true;
+      return;
+    }
+    unsigned SlotID = resolveSlot(LoomFileName, Slot);
+    if (SlotID == StableIDs::InvalidID) {
+      F.Error = true;
+      return;
     }
-    Instruction *I = IDA.getInstruction(SlotID);
+    Instruction *I = SIDs.getInstruction(SlotID);
     if (I == NULL) {
-      errs() << "slot " << SlotID << " does not exist.\n";
-      Error = true;
-      return false;
+      errs() << LoomFileName << ": slot " << SlotID << " does not exist.\n";
+      F.Error = true;
+      return;
     }
-    (StartEnd ? EndOps : StartOps).push_back(I);
-    FuncsToPatch.insert(I->getParent()->getParent());
+    if (IBCS.isInsideRegion(I)) {
+      errs() << LoomFileName << ": slot " << SlotID << " is inside a region "
+          << "of blocking calls, which has no slots. Instrument with "
+          << "--no-coalesce-blocking-cs to put slots in it.\n";
+      F.Error = true;
+      return;
+    }
+    if (IBCS.isBlockingWrapper(*I->getParent()->getParent())) {
+      errs() << LoomFileName << ": slot " << SlotID << " is in blocking "
+          << "wrapper " << I->getParent()->getParent()->getName()
+          << ", which has no slots. "
+          << "Instrument with --no-blocking-wrappers to put slots in it.\n";
+      F.Error = true;
+      return;
+    }
+    (StartEnd ? F.EndOps : F.StartOps).push_back(I);
+    F.FuncsToPatch.insert(I->getParent()->getParent());
   }
+}
 
-  return false;
+string Compiler::getFilterFileName(const string &LoomFileName) {
+  size_t Dot = LoomFileName.rfind('.');
+  if (Dot == string::npos || LoomFileName.find('/', Dot) != string::npos)
+    return LoomFileName + ".filter";
+  return LoomFileName.substr(0, Dot) + ".filter";
+}
+
+void Compiler::writeFilter(const string &LoomFileName, const Filter &F) const {
+  string FilterFileName = getFilterFileName(LoomFileName);
+  string ErrorInfo;
+  raw_fd_ostream FilterFile(FilterFileName.c_str(), ErrorInfo);
+  if (!ErrorInfo.empty()) {
+    errs() << "cannot write " << FilterFileName << ": " << ErrorInfo << "\n";
+    return;
+  }
+  printFilter(FilterFile, F);
 }
 
 void Compiler::print(raw_ostream &O, const Module *M) const {
-  if (Error)
+  if (WriteFilters)
     return;
+  for (size_t i = 0; i < Filters.size(); ++i) {
+    if (!Filters[i].Error)
+      printFilter(O, Filters[i]);
+  }
+}
 
-  IDAssigner &IDA = getAnalysis<IDAssigner>();
+void Compiler::printFilter(raw_ostream &O, const Filter &F) const {
+  StableIDs &SIDs = getAnalysis<StableIDs>();
 
-  O << FilterType << "\n\n";
-  O << StartOps.size() + EndOps.size() << "\n";
-  for (size_t i = 0; i < StartOps.size(); ++i)
-    O << "0 " << IDA.getInstructionID(StartOps[i]) << "\n";
-  for (size_t i = 0; i < EndOps.size(); ++i)
-    O << "1 " << IDA.getInstructionID(EndOps[i]) << "\n";
+  O << F.FilterType << "\n\n";
+  O << F.StartOps.size() + F.EndOps.size() << "\n";
+  for (size_t i = 0; i < F.StartOps.size(); ++i)
+    O << "0 " << SIDs.getInstructionID(F.StartOps[i]) << "\n";
+  for (size_t i = 0; i < F.EndOps.size(); ++i)
+    O << "1 " << SIDs.getInstructionID(F.EndOps[i]) << "\n";
 
-  O << "\n" << FuncsToPatch.size() << "\n";
-  for (FuncSet::const_iterator I = FuncsToPatch.begin();
-       I != FuncsToPatch.end();
+  O << "\n" << F.FuncsToPatch.size() << "\n";
+  for (FuncSet::const_iterator I = F.FuncsToPatch.begin();
+       I != F.FuncsToPatch.end();
        ++I) {
-    O << IDA.getFunctionID(*I) << "\n";
+    // The runtime checks the hash against the program's.
+    O << SIDs.getFunctionID(*I) << " " << SIDs.getFunctionHash(*I) << "\n";
   }
 
   O << "\n0\n\n0\n";
@@ -1,20 +1,25 @@
 #include "llvm/Constants.h"
 #include "llvm/DerivedTypes.h"
 #include "llvm/Instructions.h"
+#include "llvm/IntrinsicInst.h"
 #include "llvm/Module.h"
 #include "llvm/Pass.h"
 #include "llvm/Analysis/Dominators.h"
 #include "llvm/Support/CallSite.h"
 #include "llvm/Support/CFG.h"
 #include "llvm/Support/IRBuilder.h"
+#include "llvm/Support/InstIterator.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Transforms/Utils/Cloning.h"
 #include "llvm/Transforms/Utils/SSAUpdater.h"
 
-#include "rcs/IDAssigner.h"
 #include "rcs/typedefs.h"
 
-#include "loom/config.h"
+#include "loom/FuncState.h"
+#include "loom/IdentifyBlockingCS.h"
+#include "loom/InstrumentReport.h"
+#include "loom/Partition.h"
+#include "loom/StableIDs.h"
 
 using namespace std;
 using namespace llvm;
@@ -28,6 +33,7 @@ struct BBCloner: public FunctionPass {
   virtual void getAnalysisUsage(AnalysisUsage &AU) const;
   virtual bool doInitialization(Module &M);
   virtual bool runOnFunction(Function &F);
+  virtual bool doFinalization(Module &M);
 
  private:
   static bool IsBackEdgeBlock(const BasicBlock &B);
@@ -38,11 +44,20 @@ struct BBCloner: public FunctionPass {
   void UpdateSSA(Function &F);
   void InsertSlots(Function &F);
   void InsertSlots(BasicBlock &B);
+  void InsertActivationExits(Function &F);
+  void InsertActivationCleanup(Function &F);
   void verifyLoomSlots(BasicBlock &B);
 
   // scalar types
   Type *VoidType, *IntType;
-  Function *Slot, *Switch;
+  Function *Slot;
+  GlobalVariable *FuncStates;
+  // NULL unless the instrumenter counts activations
+  GlobalVariable *Activations;
+  Function *GatedEntry;
+  // The personality function of the landing pads in the module. NULL if the
+  // module never catches or cleans up an exception.
+  Value *Personality;
   ValueToValueMapTy CloneMap;
 };
 }
@@ -57,8 +72,9 @@ static RegisterPass<BBCloner> X("clone-bbs",
                                 false);
 
 void BBCloner::getAnalysisUsage(AnalysisUsage &AU) const {
-  AU.addRequired<IDAssigner>();
+  AU.addRequired<StableIDs>();
   AU.addRequired<DominatorTree>();
+  AU.addRequired<IdentifyBlockingCS>();
 }
 
 bool BBCloner::doInitialization(Module &M) {
@@ -71,36 +87,49 @@ bool BBCloner::doInitialization(Module &M) {
                           "LoomSlot",
                           &M);
 
-  FunctionType *SwitchType = FunctionType::get(IntType, IntType, false);
-  Switch = Function::Create(SwitchType,
-                            GlobalValue::ExternalLinkage,
-                            "LoomSwitch",
-                            &M);
+  Personality = NULL;
+  for (Module::iterator F = M.begin(); F != M.end(); ++F) {
+    for (inst_iterator I = inst_begin(F); I != inst_end(F); ++I) {
+      if (LandingPadInst *LPI = dyn_cast<LandingPadInst>(&*I)) {
+        Personality = LPI->getPersonalityFn();
+        return true;
+      }
+    }
+  }
 
   return true;
 }
 
 bool BBCloner::runOnFunction(Function &F) {
+  PassTimer Timer("clone-bbs");
+  if (!IsInPartition(F))
+    return false;
+  // Blocking wrappers run without LoomUpdateLock, so they must not run any
+  // operation.
+  if (getAnalysis<IdentifyBlockingCS>().isBlockingWrapper(F))
+    return false;
+  Activations = F.getParent()->getNamedGlobal("LoomActivations");
   CloneBBs(F);
   InsertSlots(F);
+  if (Activations)
+    InsertActivationExits(F);
   return true;
 }
 
-bool BBCloner::IsBackEdgeBlock(const BasicBlock &B) {
-  for (BasicBlock::const_iterator I = B.begin(); I != B.end(); ++I) {
-    ImmutableCallSite CS(I);
-    if (CS) {
-      if (const Function *Callee = CS.getCalledFunction()) {
-        if (Callee->getName() == "LoomCycleCheck")
-          return true;
-      }
-    }
-  }
+bool BBCloner::doFinalization(Module &M) {
+  // BBCloner is the last pass of the instrumenter.
+  WriteReport(M);
   return false;
 }
 
+bool BBCloner::IsBackEdgeBlock(const BasicBlock &B) {
+  // CheckInserter tags the terminators of the blocks it inserts on back edges.
+  return B.getTerminator()->getMetadata("loom.backedge") != NULL;
+}
+
 void BBCloner::CreateFastPath(Function &F) {
   CloneMap.clear();
+  unsigned NumClonedBlocks = 0;
 
   for (Function::arg_iterator AI = F.arg_begin(); AI != F.arg_end(); ++AI)
     CloneMap[AI] = AI;
@@ -117,6 +146,7 @@ void BBCloner::CreateFastPath(Function &F) {
       continue;
     }
     BasicBlock *B2 = CloneBasicBlock(B, CloneMap, ".fast", &F, NULL);
+    ++NumClonedBlocks;
     // Strip DebugLoc from all cloned instructions; otherwise, the code
     // generator would assert fail. TODO: Figure out why it would fail.
     for (BasicBlock::iterator Ins = B2->begin(); Ins != B2->end(); ++Ins) {
@@ -132,26 +162,53 @@ void BBCloner::CreateFastPath(Function &F) {
     for (BasicBlock::iterator I = B2->begin(); I != B2->end(); ++I)
       RemapInstruction(I, CloneMap);
   }
+
+  if (IsReporting())
+    GetFunctionCost(F).NumClonedBlocks = NumClonedBlocks;
 }
 
 void BBCloner::InsertSwitches(Function &F) {
-  // Insert LoomSwitch at each back edge.
-  IDAssigner &IDA = getAnalysis<IDAssigner>();
-  unsigned FuncID = IDA.getFunctionID(&F);
-  assert(FuncID < MaxNumFuncs);
+  // Each back edge goes through two blocks inserted by CheckInserter. The
+  // first one loads the state word of F, and the second one calls
+  // LoomBackEdge. Switch to the fast path when the state word is zero or
+  // LoomBackEdge says F is not patched.
+  unsigned FuncID = getAnalysis<StableIDs>().getFunctionID(&F);
+  // CheckInserter defines LoomFuncStates before instrumenting any function.
+  FuncStates = F.getParent()->getNamedGlobal("LoomFuncStates");
+  assert(FuncStates && "LoomFuncStates is not defined");
+  // one at each back edge, and one at the entry
+  unsigned NumSwitches = 1;
   for (Function::iterator B = F.begin(); B != F.end(); ++B) {
-    if (IsBackEdgeBlock(*B)) {
-      BasicBlock *OldTarget = *succ_begin(B);
+    if (!IsBackEdgeBlock(*B))
+      continue;
+    BranchInst *BI = cast<BranchInst>(B->getTerminator());
+    if (BI->isConditional()) {
+      BasicBlock *OldTarget = BI->getSuccessor(1);
+      BasicBlock *NewTarget = cast<BasicBlock>(CloneMap.lookup(OldTarget));
+      // The cloned PHINodes in NewTarget already have incoming values from B.
+      OldTarget->removePredecessor(B, true);
+      BI->setSuccessor(1, NewTarget);
+    } else {
+      BasicBlock *OldTarget = BI->getSuccessor(0);
       BasicBlock *NewTarget = cast<BasicBlock>(CloneMap.lookup(OldTarget));
-      B->getTerminator()->eraseFromParent();
+      // Both blocks of a back edge switch, but count the back edge once.
+      ++NumSwitches;
+      BasicBlock::iterator I = BI; --I;
+      CallInst *Call = cast<CallInst>(I);
+      assert(Call->getCalledFunction()->getName() == "LoomBackEdge");
+      MDNode *Tag = BI->getMetadata("loom.backedge");
+      BI->eraseFromParent();
       IRBuilder<> Builder(B);
-      Value *Slow = Builder.CreateCall(Switch,
-                                       ConstantInt::get(IntType, FuncID));
-      Builder.CreateCondBr(Builder.CreateIsNotNull(Slow), OldTarget, NewTarget);
+      Builder.CreateCondBr(Builder.CreateIsNotNull(Call),
+                           OldTarget,
+                           NewTarget)->setMetadata("loom.backedge", Tag);
     }
   }
 
-  // Insert LoomSwitch at the function entry.
+  if (IsReporting())
+    GetFunctionCost(F).NumSwitches = NumSwitches;
+
+  // Test the patched bit at the function entry.
   {
     BasicBlock *OldEntry = F.begin();
     BasicBlock *NewEntry = cast<BasicBlock>(CloneMap.lookup(OldEntry));
@@ -160,7 +217,46 @@ void BBCloner::InsertSwitches(Function &F) {
                                            &F,
                                            OldEntry);
     IRBuilder<> Builder(Entry);
-    Value *Slow = Builder.CreateCall(Switch, ConstantInt::get(IntType, FuncID));
+    // Count the activation before loading the state word. An update sets
+    // LoomGated before reading the count, so either the update sees this
+    // activation, or this activation sees the gate.
+    if (Activations) {
+      Builder.CreateAtomicRMW(
+          AtomicRMWInst::Add,
+          Builder.CreateConstInBoundsGEP2_32(Activations, 0, FuncID),
+          ConstantInt::get(IntType, 1),
+          SequentiallyConsistent);
+    }
+    Value *State = Builder.CreateLoad(
+        Builder.CreateConstInBoundsGEP2_32(FuncStates, 0, FuncID),
+        true); // volatile
+    // Wait in LoomGatedEntry while an update is patching F.
+    if (Activations) {
+      GatedEntry = cast<Function>(F.getParent()->getOrInsertFunction(
+          "LoomGatedEntry", IntType, IntType, NULL));
+      BasicBlock *Gated = BasicBlock::Create(F.getContext(),
+                                             "entry.loom.gated",
+                                             &F,
+                                             OldEntry);
+      BasicBlock *Test = BasicBlock::Create(F.getContext(),
+                                            "entry.loom.test",
+                                            &F,
+                                            OldEntry);
+      Value *IsGated = Builder.CreateAnd(State,
+                                         ConstantInt::get(IntType, LoomGated));
+      Builder.CreateCondBr(Builder.CreateIsNotNull(IsGated), Gated, Test);
+      Builder.SetInsertPoint(Gated);
+      Value *NewState = Builder.CreateCall(GatedEntry,
+                                           ConstantInt::get(IntType, FuncID));
+      Builder.CreateBr(Test);
+      Builder.SetInsertPoint(Test);
+      PHINode *PN = Builder.CreatePHI(IntType, 2);
+      PN->addIncoming(State, Entry);
+      PN->addIncoming(NewState, Gated);
+      State = PN;
+    }
+    Value *Slow = Builder.CreateAnd(State,
+                                    ConstantInt::get(IntType, LoomPatched));
     Builder.CreateCondBr(Builder.CreateIsNotNull(Slow), OldEntry, NewEntry);
   }
 }
@@ -221,19 +317,21 @@ void BBCloner::CloneBBs(Function &F) {
 }
 
 void BBCloner::InsertSlots(BasicBlock &B) {
-  IDAssigner &IDA = getAnalysis<IDAssigner>();
+  StableIDs &SIDs = getAnalysis<StableIDs>();
+  IdentifyBlockingCS &IBCS = getAnalysis<IdentifyBlockingCS>();
   // PHINodes and landingpad should be groupted at top of BB. We use
   // <Insertable> to indicate whether <I> already passes the first insertion
   // position. If so, insert LoomSlot before <I>; otherwise insert LoomSlot at
   // the first insertion position.
   Instruction *FirstInsertPos = B.getFirstInsertionPt();
   bool Insertable = false;
+  unsigned NumSlots = 0;
   for (BasicBlock::iterator I = B.begin(); I != B.end(); ++I) {
     if (FirstInsertPos == I)
       Insertable = true;
-    unsigned InsID = IDA.getInstructionID(I);
-    if (InsID != IDAssigner::InvalidID) {
-      assert(InsID < MaxNumInsts);
+    unsigned InsID = SIDs.getInstructionID(I);
+    // Instructions inside a blocking region run without LoomUpdateLock.
+    if (InsID != StableIDs::InvalidID && !IBCS.isInsideRegion(I)) {
       // <I> exists in the original program.
       BasicBlock::iterator InsertPos;
       if (!Insertable) {
@@ -271,8 +369,11 @@ void BBCloner::InsertSlots(BasicBlock &B) {
         }
       }
       CallInst::Create(Slot, ConstantInt::get(IntType, InsID), "", InsertPos);
+      ++NumSlots;
     }
   }
+  if (IsReporting())
+    GetFunctionCost(*B.getParent()).NumSlots += NumSlots;
 
   // Verify LoomSlots are in a correct order.
   verifyLoomSlots(B);
@@ -286,6 +387,84 @@ void BBCloner::InsertSlots(Function &F) {
   }
 }
 
+// Run after InsertSlots, so that the slots of a return instruction run inside
+// the activation. An activation left by longjmp, or by unwinding through code
+// without landing pads, is never uncounted; the daemon reports the stuck
+// count and falls back to evacuating all threads.
+void BBCloner::InsertActivationExits(Function &F) {
+  unsigned FuncID = getAnalysis<StableIDs>().getFunctionID(&F);
+  for (Function::iterator B = F.begin(); B != F.end(); ++B) {
+    TerminatorInst *TI = B->getTerminator();
+    if (!isa<ReturnInst>(TI) && !isa<ResumeInst>(TI))
+      continue;
+    IRBuilder<> Builder(TI);
+    Builder.CreateAtomicRMW(
+        AtomicRMWInst::Sub,
+        Builder.CreateConstInBoundsGEP2_32(Activations, 0, FuncID),
+        ConstantInt::get(IntType, 1),
+        SequentiallyConsistent);
+  }
+  InsertActivationCleanup(F);
+}
+
+// An exception thrown by a plain call unwinds past the decrements before
+// ret and resume. Turn each such call into an invoke whose cleanup landing
+// pad decrements the count and resumes unwinding; pthread_exit's forced
+// unwinding runs the same pad.
+void BBCloner::InsertActivationCleanup(Function &F) {
+  if (Personality == NULL || F.doesNotThrow())
+    return;
+
+  vector<CallInst *> Calls;
+  for (inst_iterator I = inst_begin(F); I != inst_end(F); ++I) {
+    CallInst *CI = dyn_cast<CallInst>(&*I);
+    if (CI == NULL || CI->doesNotThrow() || isa<IntrinsicInst>(CI) ||
+        CI->isInlineAsm())
+      continue;
+    // Loom's runtime never throws.
+    Function *Callee = CI->getCalledFunction();
+    if (Callee && Callee->getName().startswith("Loom"))
+      continue;
+    Calls.push_back(CI);
+  }
+  if (Calls.empty())
+    return;
+
+  unsigned FuncID = getAnalysis<StableIDs>().getFunctionID(&F);
+  LLVMContext &Ctx = F.getContext();
+  BasicBlock *Cleanup = BasicBlock::Create(Ctx, "loom.cleanup", &F);
+  IRBuilder<> Builder(Cleanup);
+  Type *ExnType = StructType::get(Type::getInt8PtrTy(Ctx), IntType, NULL);
+  LandingPadInst *LPI = Builder.CreateLandingPad(ExnType, Personality, 0);
+  LPI->setCleanup(true);
+  Builder.CreateAtomicRMW(
+      AtomicRMWInst::Sub,
+      Builder.CreateConstInBoundsGEP2_32(Activations, 0, FuncID),
+      ConstantInt::get(IntType, 1),
+      SequentiallyConsistent);
+  Builder.CreateResume(LPI);
+
+  for (size_t i = 0; i < Calls.size(); ++i) {
+    CallInst *CI = Calls[i];
+    BasicBlock *B = CI->getParent();
+    BasicBlock::iterator Next = CI;
+    ++Next;
+    BasicBlock *Cont = B->splitBasicBlock(Next, B->getName() + ".cont");
+    // Replace the branch splitBasicBlock adds with an invoke.
+    B->getTerminator()->eraseFromParent();
+    CallSite CS(CI);
+    vector<Value *> Args(CS.arg_begin(), CS.arg_end());
+    InvokeInst *II = InvokeInst::Create(CS.getCalledValue(), Cont, Cleanup,
+                                        Args, "", B);
+    II->setCallingConv(CI->getCallingConv());
+    II->setAttributes(CI->getAttributes());
+    II->setDebugLoc(CI->getDebugLoc());
+    II->takeName(CI);
+    CI->replaceAllUsesWith(II);
+    CI->eraseFromParent();
+  }
+}
+
 void BBCloner::verifyLoomSlots(BasicBlock &B) {
   unsigned Last = -1;
   for (BasicBlock::iterator I = B.begin(); I != B.end(); ++I) {
@@ -293,7 +472,8 @@ void BBCloner::verifyLoomSlots(BasicBlock &B) {
     if (CS && CS.getCalledFunction() == Slot) {
       assert(CS.arg_size() == 1);
       unsigned SlotID = cast<ConstantInt>(CS.getArgument(0))->getZExtValue();
-      assert(Last == (unsigned)-1 || Last + 1 == SlotID);
+      // Slots inside blocking regions are skipped.
+      assert(Last == (unsigned)-1 || Last < SlotID);
       Last = SlotID;
     }
   }
@@ -4,6 +4,8 @@
 
 #include "rcs/IDAssigner.h"
 
+#include "loom/Partition.h"
+
 using namespace llvm;
 using namespace rcs;
 
@@ -28,11 +30,15 @@ static RegisterPass<BreakCriticalInvokes> X(
     false); // is analysis
 
 void BreakCriticalInvokes::getAnalysisUsage(AnalysisUsage &AU) const {
+  // Run IDAssigner first, so that the branches we add have no IDs, as in the
+  // bitcode the compiler reads. StableIDs only numbers instructions with IDs.
   AU.addRequired<IDAssigner>();
   AU.addPreserved<IDAssigner>();
 }
 
 bool BreakCriticalInvokes::runOnFunction(Function &F) {
+  if (!IsInPartition(F))
+    return false;
   for (Function::iterator B = F.begin(); B != F.end(); ++B) {
     if (InvokeInst *II = dyn_cast<InvokeInst>(B->getTerminator())) {
       assert(II->getNormalDest() != II->getUnwindDest());
@@ -1,16 +1,31 @@
+#define DEBUG_TYPE "loom"
+
+#include <algorithm>
+#include <string>
 #include <vector>
 
+#include "llvm/IntrinsicInst.h"
+#include "llvm/Metadata.h"
 #include "llvm/Module.h"
 #include "llvm/Pass.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/ScalarEvolution.h"
+#include "llvm/Analysis/ScalarEvolutionExpressions.h"
 #include "llvm/Support/CallSite.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/IRBuilder.h"
 #include "llvm/Support/raw_ostream.h"
 
 #include "rcs/IDAssigner.h"
-#include "rcs/IdentifyBackEdges.h"
 #include "rcs/IdentifyThreadFuncs.h"
 
-#include "loom/config.h"
+#include "loom/FuncState.h"
 #include "loom/IdentifyBlockingCS.h"
+#include "loom/InstrumentReport.h"
+#include "loom/Partition.h"
+#include "loom/StableIDs.h"
 
 using namespace std;
 using namespace llvm;
@@ -31,6 +46,15 @@ struct CheckInserter: public FunctionPass {
   static void InsertAfter(Instruction *I, Instruction *Pos);
 
   void checkFeatures(Module &M);
+  void countIDs(Module &M);
+  void createFuncStates(Module &M);
+  void createTableSize(Module &M, const string &Name, unsigned Size);
+  void createSlotRuns(Module &M);
+  void createFuncHashes(Module &M);
+  bool isBoundedLoop(const Loop *L);
+  bool needsCycleCheck(BasicBlock *B1, BasicBlock *B2, unsigned BackEdgeID);
+  void addExitChecks(const Loop *L, unsigned BackEdgeID);
+  void insertCycleCheck(BasicBlock *B1, BasicBlock *B2, unsigned BackEdgeID);
   void insertCycleChecks(Function &F);
   void insertBlockingChecks(Function &F);
   void instrumentThread(Function &F);
@@ -39,8 +63,34 @@ struct CheckInserter: public FunctionPass {
   Type *VoidType, *IntType;
   FunctionType *InitFiniType;
 
+  // sizes of the runtime's tables
+  unsigned NumBackEdges, NumBlockingCS, NumFuncs, NumInsts;
+  // whether some function is placed in its own section, out of loom_text
+  bool HasOwnSections;
+  // the function of each slot, or -1 if the instruction has no slot
+  vector<unsigned> SlotFuncs;
+  // the hash of the slots of each function, or 0 for IDs without functions
+  vector<unsigned> FuncHashes;
+
+  // per-function state words
+  GlobalVariable *FuncStates;
+  // per-function activation counts, if -loom-track-activations
+  GlobalVariable *Activations;
+
+  // An edge of the current function to check, and the back edge ID its check
+  // uses.
+  struct CheckedEdge {
+    CheckedEdge(BasicBlock *F, BasicBlock *T, unsigned ID):
+        From(F), To(T), BackEdgeID(ID) {}
+    BasicBlock *From, *To;
+    unsigned BackEdgeID;
+  };
+  vector<CheckedEdge> EdgesToCheck;
+  // top-level loops whose cycle checks are moved to their exits
+  SmallPtrSet<const Loop *, 8> LoopsCheckedAtExits;
+
   // checks
-  Function *CycleCheck;
+  Function *BackEdge;
   Function *BeforeBlocking, *AfterBlocking;
   Function *EnterThread, *ExitThread;
   Function *EnterProcess;
@@ -54,6 +104,33 @@ static RegisterPass<CheckInserter> X("insert-checks",
                                      false,
                                      false);
 
+static cl::opt<bool> ElideBoundedLoops(
+    "loom-elide-bounded-loops",
+    cl::desc("Move the cycle checks of innermost loops without calls and "
+             "with small constant trip counts to their exits or enclosing "
+             "loops"),
+    cl::init(true));
+static cl::opt<unsigned> MaxElidedTripCount(
+    "loom-max-elided-trip-count",
+    cl::desc("Loops running up to this many iterations are bounded"),
+    cl::init(1024));
+static cl::opt<bool> TrackActivations(
+    "loom-track-activations",
+    cl::desc("Count the running activations of each function, so that an "
+             "update only waits for the threads running the functions it "
+             "patches"));
+static cl::opt<bool> Preemptible(
+    "loom-preemptible",
+    cl::desc("Place instrumented functions in section loom_text, so that the "
+             "runtime can tell whether a thread is in uninstrumented code, and "
+             "preempt it there"));
+static cl::opt<bool> ReportElidedLoops(
+    "loom-report-elided-loops",
+    cl::desc("Print the back edges whose cycle checks are elided"));
+
+STATISTIC(NumCycleChecks, "Number of cycle checks");
+STATISTIC(NumElidedCycleChecks, "Number of elided cycle checks");
+
 void CheckInserter::InsertAfter(Instruction *I, Instruction *Pos) {
   if (InvokeInst *II = dyn_cast<InvokeInst>(Pos)) {
     // FIXME: we should instrument the unwind BB as well, but it looks hard. The
@@ -70,12 +147,14 @@ void CheckInserter::InsertAfter(Instruction *I, Instruction *Pos) {
 }
 
 void CheckInserter::getAnalysisUsage(AnalysisUsage &AU) const {
-  // make sure IDAssigner is run before CheckInserter
-  AU.addRequired<IDAssigner>();
-  AU.addRequired<IdentifyBackEdges>();
+  // make sure StableIDs is run before CheckInserter
+  AU.addRequired<StableIDs>();
   AU.addRequired<IdentifyBlockingCS>();
   AU.addRequired<IdentifyThreadFuncs>();
+  AU.addRequired<LoopInfo>();
+  AU.addRequired<ScalarEvolution>();
   AU.addPreserved<IDAssigner>();
+  AU.addPreserved<StableIDs>();
 }
 
 bool CheckInserter::doInitialization(Module &M) {
@@ -89,10 +168,23 @@ bool CheckInserter::doInitialization(Module &M) {
   FunctionType *CheckType = FunctionType::get(VoidType, IntType, false);
   InitFiniType = FunctionType::get(VoidType, false);
 
-  CycleCheck = Function::Create(CheckType,
-                                GlobalValue::ExternalLinkage,
-                                "LoomCycleCheck",
-                                &M);
+  // Created on the first runOnFunction, when the number of functions is
+  // known.
+  FuncStates = NULL;
+  Activations = NULL;
+  NumBackEdges = NumBlockingCS = NumFuncs = NumInsts = 0;
+  HasOwnSections = false;
+  SlotFuncs.clear();
+  FuncHashes.clear();
+
+  Type *BackEdgeArgTypes[] = {IntType, IntType};
+  FunctionType *BackEdgeType = FunctionType::get(IntType,
+                                                 BackEdgeArgTypes,
+                                                 false);
+  BackEdge = Function::Create(BackEdgeType,
+                              GlobalValue::ExternalLinkage,
+                              "LoomBackEdge",
+                              &M);
 
   BeforeBlocking = Function::Create(CheckType,
                                     GlobalValue::ExternalLinkage,
@@ -148,7 +240,123 @@ void CheckInserter::checkFeatures(Module &M) {
   assert(M.getFunction("pthread_cancel") == NULL);
 }
 
+// Count the IDs in the whole module before we instrument any function. Every
+// partition counts the same IDs.
+void CheckInserter::countIDs(Module &M) {
+  StableIDs &SIDs = getAnalysis<StableIDs>();
+  IdentifyBlockingCS &IBCS = getAnalysis<IdentifyBlockingCS>();
+
+  NumBackEdges = SIDs.getNumBackEdges();
+  NumBlockingCS = SIDs.getNumCallSites();
+  NumFuncs = SIDs.getNumFunctions();
+  NumInsts = SIDs.getNumInstructions();
+  // IDs reserved for functions to grow into have no slots.
+  SlotFuncs.assign(NumInsts, -1);
+  FuncHashes.assign(NumFuncs, 0);
+  for (Module::iterator F = M.begin(); F != M.end(); ++F) {
+    if (!F->isDeclaration() && F->hasSection())
+      HasOwnSections = true;
+    if (!F->isDeclaration())
+      FuncHashes[SIDs.getFunctionID(F)] = SIDs.getFunctionHash(F);
+    // Blocking wrappers have no slots. See Compiler::parseLoomFile.
+    if (IBCS.isBlockingWrapper(*F))
+      continue;
+    unsigned FuncID = SIDs.getFunctionID(F);
+    for (Function::iterator B = F->begin(); B != F->end(); ++B) {
+      for (BasicBlock::iterator I = B->begin(); I != B->end(); ++I) {
+        unsigned InsID = SIDs.getInstructionID(I);
+        if (InsID != StableIDs::InvalidID && !IBCS.isInsideRegion(I))
+          SlotFuncs[InsID] = FuncID;
+      }
+    }
+  }
+}
+
+// LoomFuncStates is defined in the instrumented program, so that the checks
+// load a state word at a constant address.
+void CheckInserter::createFuncStates(Module &M) {
+  ArrayType *FuncStatesType = ArrayType::get(IntType, NumFuncs);
+  FuncStates = new GlobalVariable(M,
+                                  FuncStatesType,
+                                  false,
+                                  GlobalValue::ExternalLinkage,
+                                  ConstantAggregateZero::get(FuncStatesType),
+                                  "LoomFuncStates");
+  // BBCloner counts activations if LoomActivations is defined.
+  if (TrackActivations) {
+    Activations = new GlobalVariable(
+        M,
+        FuncStatesType,
+        false,
+        GlobalValue::ExternalLinkage,
+        ConstantAggregateZero::get(FuncStatesType),
+        "LoomActivations");
+  }
+}
+
+void CheckInserter::createTableSize(Module &M,
+                                    const string &Name,
+                                    unsigned Size) {
+  new GlobalVariable(M,
+                     IntType,
+                     true,
+                     GlobalValue::ExternalLinkage,
+                     ConstantInt::get(IntType, Size),
+                     Name);
+}
+
+// LoomSlotRuns lets the daemon compile a .lm file without the bitcode.
+// Each function owns a range of instruction IDs, so the table only keeps the
+// runs of slots in the same function: LoomSlotRuns[2 * i] is the first slot
+// of run i, and LoomSlotRuns[2 * i + 1] is its function ID, or -1 if the
+// instructions of the run have no slots.
+void CheckInserter::createSlotRuns(Module &M) {
+  vector<Constant *> Runs;
+  for (size_t i = 0; i < SlotFuncs.size(); ++i) {
+    if (i == 0 || SlotFuncs[i] != SlotFuncs[i - 1]) {
+      Runs.push_back(ConstantInt::get(IntType, i));
+      Runs.push_back(ConstantInt::get(IntType, SlotFuncs[i]));
+    }
+  }
+  ArrayType *RunsType = ArrayType::get(IntType, Runs.size());
+  new GlobalVariable(M,
+                     RunsType,
+                     true,
+                     GlobalValue::ExternalLinkage,
+                     ConstantArray::get(RunsType, Runs),
+                     "LoomSlotRuns");
+  createTableSize(M, "LoomNumSlotRuns", Runs.size() / 2);
+}
+
+// LoomFuncHashes[i] is the hash of the slots of function i. The runtime
+// refuses a filter compiled against a build where a function it patches has
+// other slots.
+void CheckInserter::createFuncHashes(Module &M) {
+  vector<Constant *> Hashes;
+  for (size_t i = 0; i < FuncHashes.size(); ++i)
+    Hashes.push_back(ConstantInt::get(IntType, FuncHashes[i]));
+  ArrayType *HashesType = ArrayType::get(IntType, Hashes.size());
+  new GlobalVariable(M,
+                     HashesType,
+                     true,
+                     GlobalValue::ExternalLinkage,
+                     ConstantArray::get(HashesType, Hashes),
+                     "LoomFuncHashes");
+}
+
 bool CheckInserter::runOnFunction(Function &F) {
+  PassTimer Timer("insert-checks");
+  if (FuncStates == NULL) {
+    countIDs(*F.getParent());
+    createFuncStates(*F.getParent());
+  }
+  if (!IsInPartition(F))
+    return false;
+  if (IsReporting())
+    GetFunctionCost(F).NumInstsBefore = CountInstructions(F);
+  // The preemption handler never stops a thread in loom_text.
+  if (Preemptible && !F.hasSection())
+    F.setSection("loom_text");
   insertCycleChecks(F);
   insertBlockingChecks(F);
   instrumentThread(F);
@@ -156,6 +364,24 @@ bool CheckInserter::runOnFunction(Function &F) {
 }
 
 bool CheckInserter::doFinalization(Module &M) {
+  // The runtime sizes its tables according to these numbers.
+  if (FuncStates == NULL)
+    createFuncStates(M);
+  createTableSize(M, "LoomNumBackEdges", NumBackEdges);
+  createTableSize(M, "LoomNumBlockingCS", NumBlockingCS);
+  createTableSize(M, "LoomNumFuncs", NumFuncs);
+  createTableSize(M, "LoomNumInsts", NumInsts);
+  createSlotRuns(M);
+  createFuncHashes(M);
+  // Code outside loom_text is uninstrumented only if every function is in
+  // loom_text.
+  if (Preemptible) {
+    if (HasOwnSections)
+      errs() << "some functions have their own sections. "
+          << "preemption is disabled\n";
+    createTableSize(M, "LoomPreemptible", !HasOwnSections);
+  }
+
   // We couldn't directly add an element to a constant array, because doing so
   // changes the type of the constant array.
 
@@ -195,71 +421,207 @@ bool CheckInserter::doFinalization(Module &M) {
   return true;
 }
 
+// A loop is bounded if it is innermost, makes no calls, and ScalarEvolution
+// proves it runs at most MaxElidedTripCount iterations. Checking such a loop
+// only blocks vectorization and unrolling: a thread leaves it within a few
+// microseconds, and reaches the check of the enclosing loop, or the checks
+// moved to the exits of the loop.
+bool CheckInserter::isBoundedLoop(const Loop *L) {
+  if (!L->empty())
+    return false;
+  for (Loop::block_iterator B = L->block_begin(); B != L->block_end(); ++B) {
+    for (BasicBlock::iterator I = (*B)->begin(); I != (*B)->end(); ++I) {
+      Instruction *Ins = I;
+      if (CallSite(Ins) && !isa<IntrinsicInst>(Ins))
+        return false;
+    }
+  }
+  ScalarEvolution &SE = getAnalysis<ScalarEvolution>();
+  // A count that depends on the input, e.g. n in for (i = 0; i < n; ++i), may
+  // be as large as the type allows.
+  const SCEVConstant *MaxCount = dyn_cast<SCEVConstant>(
+      SE.getMaxBackedgeTakenCount(const_cast<Loop *>(L)));
+  return MaxCount && MaxCount->getValue()->getValue().ult(MaxElidedTripCount);
+}
+
+bool CheckInserter::needsCycleCheck(BasicBlock *B1,
+                                    BasicBlock *B2,
+                                    unsigned BackEdgeID) {
+  if (!ElideBoundedLoops)
+    return true;
+  LoopInfo &LI = getAnalysis<LoopInfo>();
+  // IdentifyBackEdges may find back edges of irreducible loops, which
+  // LoopInfo does not recognize.
+  Loop *L = LI.getLoopFor(B2);
+  if (!L || L->getHeader() != B2 || !L->contains(B1) || !isBoundedLoop(L))
+    return true;
+  ++NumElidedCycleChecks;
+  if (ReportElidedLoops) {
+    errs() << "elided cycle check " << BackEdgeID << " in "
+        << B1->getParent()->getName() << ": "
+        << B1->getName() << " -> " << B2->getName() << "\n";
+  }
+  // The back edges of the enclosing loop, which is not innermost, are checked.
+  if (L->getParentLoop() == NULL)
+    addExitChecks(L, BackEdgeID);
+  return false;
+}
+
+// Moves the cycle check of a top-level bounded loop to its exits, so that a
+// thread running the loop still reaches a check right after it. The checks
+// use the ID of a back edge of the loop.
+void CheckInserter::addExitChecks(const Loop *L, unsigned BackEdgeID) {
+  // A loop with several back edges is moved once.
+  if (!LoopsCheckedAtExits.insert(L))
+    return;
+  StableIDs &SIDs = getAnalysis<StableIDs>();
+  for (Loop::block_iterator B = L->block_begin(); B != L->block_end(); ++B) {
+    TerminatorInst *TI = (*B)->getTerminator();
+    for (unsigned j = 0; j < TI->getNumSuccessors(); ++j) {
+      BasicBlock *Succ = TI->getSuccessor(j);
+      bool Visited = false;
+      for (unsigned k = 0; k < j; ++k) {
+        if (TI->getSuccessor(k) == Succ)
+          Visited = true;
+      }
+      // An exit that is a back edge of an irreducible loop has its own check.
+      if (Visited || L->contains(Succ) ||
+          SIDs.getBackEdgeID(*B, Succ) != StableIDs::InvalidID)
+        continue;
+      EdgesToCheck.push_back(CheckedEdge(*B, Succ, BackEdgeID));
+      if (ReportElidedLoops) {
+        errs() << "  checked at exit " << (*B)->getName() << " -> "
+            << Succ->getName() << "\n";
+      }
+    }
+  }
+}
+
+// Inserts a cycle check on edge B1 -> B2, which is a back edge or the exit of
+// a bounded loop.
+void CheckInserter::insertCycleCheck(BasicBlock *B1,
+                                     BasicBlock *B2,
+                                     unsigned BackEdgeID) {
+  Function &F = *B1->getParent();
+  unsigned FuncID = getAnalysis<StableIDs>().getFunctionID(&F);
+  assert(FuncID < NumFuncs);
+  TerminatorInst *TI = B1->getTerminator();
+  assert(BackEdgeID < NumBackEdges);
+  ++NumCycleChecks;
+  // Every block we insert on a back edge is tagged with loom.backedge, so
+  // that BBCloner recognizes them.
+  Value *BackEdgeIDs[] = {ConstantInt::get(IntType, BackEdgeID)};
+  MDNode *Tag = MDNode::get(F.getContext(), BackEdgeIDs);
+
+  // Load the state word of F once, and take the back edge right away if it
+  // is zero:
+  //   backedge:        if (LoomFuncStates[FuncID] != 0)
+  //   backedge.call:     LoomBackEdge(FuncID, BackEdgeID);
+  //                    goto B2;
+  // BBCloner later redirects successor 1 of backedge to the fast path, and
+  // branches from backedge.call on the result of LoomBackEdge.
+  BasicBlock *BackEdgeBlock = BasicBlock::Create(
+      F.getContext(),
+      "backedge_" + B1->getName() + "_" + B2->getName(),
+      &F);
+  BasicBlock *CallBlock = BasicBlock::Create(
+      F.getContext(), BackEdgeBlock->getName() + ".call", &F);
+  IRBuilder<> Builder(BackEdgeBlock);
+  Value *State = Builder.CreateLoad(
+      Builder.CreateConstInBoundsGEP2_32(FuncStates, 0, FuncID),
+      true); // volatile
+  Builder.CreateCondBr(Builder.CreateIsNotNull(State),
+                       CallBlock,
+                       B2)->setMetadata("loom.backedge", Tag);
+  Builder.SetInsertPoint(CallBlock);
+  Builder.CreateCall2(BackEdge,
+                      ConstantInt::get(IntType, FuncID),
+                      ConstantInt::get(IntType, BackEdgeID));
+  Builder.CreateBr(B2)->setMetadata("loom.backedge", Tag);
+
+  // Fix the PHINodes in B2.
+  for (BasicBlock::iterator I = B2->begin();
+       B2->getFirstNonPHI() != I;
+       ++I) {
+    PHINode *PHI = cast<PHINode>(I);
+    // Note: If B2 has multiple incoming edges from B1 (e.g. B1 terminates
+    // with a SelectInst), its PHINodes must also have multiple incoming
+    // edges from B1. However, after adding the back edge blocks and
+    // essentially merging the multiple incoming edges from B1, there will be
+    // only one edge from each of BackEdgeBlock and CallBlock to B2.
+    // Therefore, we need to remove the redundant incoming edges from B2's
+    // PHINodes.
+    Value *IncomingFromB1 = NULL;
+    for (unsigned k = 0; k < PHI->getNumIncomingValues(); ++k) {
+      if (PHI->getIncomingBlock(k) == B1) {
+        if (IncomingFromB1 == NULL) {
+          IncomingFromB1 = PHI->getIncomingValue(k);
+          PHI->setIncomingBlock(k, BackEdgeBlock);
+        } else {
+          PHI->removeIncomingValue(k, false);
+          --k;
+        }
+      }
+    }
+    assert(IncomingFromB1);
+    PHI->addIncoming(IncomingFromB1, CallBlock);
+  }
+  // B1 -> BackEdgeBlock
+  // There might be multiple back edges from B1 to B2. Need to replace
+  // them all.
+  for (unsigned j = 0; j < TI->getNumSuccessors(); ++j) {
+    if (TI->getSuccessor(j) == B2) {
+      TI->setSuccessor(j, BackEdgeBlock);
+    }
+  }
+}
+
 void CheckInserter::insertCycleChecks(Function &F) {
-  IdentifyBackEdges &IBE = getAnalysis<IdentifyBackEdges>();
+  StableIDs &SIDs = getAnalysis<StableIDs>();
 
+  // Decide which edges to check before modifying the CFG, which invalidates
+  // LoopInfo and ScalarEvolution.
+  EdgesToCheck.clear();
+  LoopsCheckedAtExits.clear();
   for (Function::iterator B1 = F.begin(); B1 != F.end(); ++B1) {
     TerminatorInst *TI = B1->getTerminator();
     for (unsigned j = 0; j < TI->getNumSuccessors(); ++j) {
       BasicBlock *B2 = TI->getSuccessor(j);
-      unsigned BackEdgeID = IBE.getID(B1, B2);
-      if (BackEdgeID != (unsigned)-1) {
-        assert(BackEdgeID < MaxNumBackEdges);
-        BasicBlock *BackEdgeBlock = BasicBlock::Create(
-            F.getContext(),
-            "backedge_" + B1->getName() + "_" + B2->getName(),
-            &F);
-        CallInst::Create(CycleCheck,
-                         ConstantInt::get(IntType, BackEdgeID),
-                         "",
-                         BackEdgeBlock);
-        // BackEdgeBlock -> B2
-        // Fix the PHINodes in B2.
-        BranchInst::Create(B2, BackEdgeBlock);
-        for (BasicBlock::iterator I = B2->begin();
-             B2->getFirstNonPHI() != I;
-             ++I) {
-          PHINode *PHI = cast<PHINode>(I);
-          // Note: If B2 has multiple incoming edges from B1 (e.g. B1 terminates
-          // with a SelectInst), its PHINodes must also have multiple incoming
-          // edges from B1. However, after adding BackEdgeBlock and essentially
-          // merging the multiple incoming edges from B1, there will be only one
-          // edge from BackEdgeBlock to B2. Therefore, we need to remove the
-          // redundant incoming edges from B2's PHINodes.
-          bool FirstIncomingFromB1 = true;
-          for (unsigned k = 0; k < PHI->getNumIncomingValues(); ++k) {
-            if (PHI->getIncomingBlock(k) == B1) {
-              if (FirstIncomingFromB1) {
-                FirstIncomingFromB1 = false;
-                PHI->setIncomingBlock(k, BackEdgeBlock);
-              } else {
-                PHI->removeIncomingValue(k, false);
-                --k;
-              }
-            }
-          }
-        }
-        // B1 -> BackEdgeBlock
-        // There might be multiple back edges from B1 to B2. Need to replace
-        // them all.
-        for (unsigned j2 = j; j2 < TI->getNumSuccessors(); ++j2) {
-          if (TI->getSuccessor(j2) == B2) {
-            TI->setSuccessor(j2, BackEdgeBlock);
-          }
-        }
+      // B1 may reach B2 via multiple successor slots.
+      bool Visited = false;
+      for (unsigned k = 0; k < j; ++k) {
+        if (TI->getSuccessor(k) == B2)
+          Visited = true;
       }
+      if (Visited)
+        continue;
+      unsigned BackEdgeID = SIDs.getBackEdgeID(B1, B2);
+      if (BackEdgeID != StableIDs::InvalidID &&
+          needsCycleCheck(B1, B2, BackEdgeID))
+        EdgesToCheck.push_back(CheckedEdge(B1, B2, BackEdgeID));
     }
   }
+
+  if (IsReporting())
+    GetFunctionCost(F).NumCycleChecks = EdgesToCheck.size();
+
+  for (size_t i = 0; i < EdgesToCheck.size(); ++i) {
+    const CheckedEdge &E = EdgesToCheck[i];
+    insertCycleCheck(E.From, E.To, E.BackEdgeID);
+  }
 }
 
 void CheckInserter::insertBlockingChecks(Function &F) {
+  StableIDs &SIDs = getAnalysis<StableIDs>();
   IdentifyBlockingCS &IBCS = getAnalysis<IdentifyBlockingCS>();
 
+  unsigned NumChecks = 0;
   for (Function::iterator B = F.begin(); B != F.end(); ++B) {
     for (BasicBlock::iterator I = B->begin(); I != B->end(); ++I) {
-      unsigned CallSiteID = IBCS.getID(I);
-      if (CallSiteID != (unsigned)-1) {
-        assert(CallSiteID < MaxNumBlockingCS);
+      unsigned CallSiteID = SIDs.getCallSiteID(I);
+      if (CallSiteID != StableIDs::InvalidID) {
+        assert(CallSiteID < NumBlockingCS);
+        ++NumChecks;
         CallInst::Create(BeforeBlocking,
                          ConstantInt::get(IntType, CallSiteID),
                          "",
@@ -267,10 +629,13 @@ void CheckInserter::insertBlockingChecks(Function &F) {
         CallInst *CallAfterBlocking = CallInst::Create(
             AfterBlocking,
             ConstantInt::get(IntType, CallSiteID));
-        InsertAfter(CallAfterBlocking, I);
+        // <I> may start a region of several blocking calls.
+        InsertAfter(CallAfterBlocking, IBCS.getRegionEnd(I));
       }
     }
   }
+  if (IsReporting())
+    GetFunctionCost(F).NumBlockingChecks = NumChecks;
 }
 
 void CheckInserter::instrumentThread(Function &F) {
@@ -0,0 +1,460 @@
+#include <cstdio>
+#include <string>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "llvm/Constants.h"
+#include "llvm/DerivedTypes.h"
+#include "llvm/GlobalAlias.h"
+#include "llvm/GlobalVariable.h"
+#include "llvm/Instructions.h"
+#include "llvm/IntrinsicInst.h"
+#include "llvm/Module.h"
+#include "llvm/Pass.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/Bitcode/ReaderWriter.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+
+#include "loom/Partition.h"
+
+using namespace std;
+using namespace llvm;
+
+namespace loom {
+// Split the instrumented module into one module per function plus one module
+// holding all global variables. Each module is written as <hash>.bc, where
+// <hash> is computed from its textual IR. The IR of an instrumented function
+// embeds its slot, function, back edge and call site IDs, which StableIDs
+// keeps across builds as long as the function does not grow out of its
+// ranges. An unchanged hash means the function can reuse the object code
+// compiled in a previous build.
+//
+// With -split-partitions, all functions in the partition go to one module
+// instead, so that the code generator can still inline them into each other.
+struct FunctionSplitter: public ModulePass {
+  static char ID;
+
+  FunctionSplitter(): ModulePass(ID) {}
+  virtual bool runOnModule(Module &M);
+
+ private:
+  static uint64_t HashString(StringRef S);
+  static uint64_t HashModule(const Module &M);
+  static void StripDebugInfo(Module &M);
+  static void Externalize(Module &M);
+  static void KeepDefinition(GlobalValue &GV);
+  static GlobalValue *Declare(const GlobalValue *GV, Module &NM);
+  static const Function *GetAliasedFunction(const GlobalAlias &GA);
+  static void ReplaceWithDeclaration(GlobalAlias *GA, Module &M);
+  static void CollectGlobals(const Value *V,
+                             SmallPtrSet<const GlobalValue *, 16> &Globals,
+                             SmallPtrSet<const Value *, 16> &Visited);
+
+  Module *extractFunction(Function &F, Module &M);
+  Module *extractGlobals(Module &M);
+  Module *extractPartition(Module &M);
+  // Write <NM> to the split directory unless it is already there, and return
+  // its hash.
+  string writeModule(const Module &NM);
+};
+}
+
+using namespace loom;
+
+char FunctionSplitter::ID = 0;
+
+static RegisterPass<FunctionSplitter> X(
+    "split-functions",
+    "Split the module into per-function modules named by their hashes",
+    false,
+    false);
+
+static cl::opt<string> SplitDir(
+    "split-dir",
+    cl::desc("Where to write the per-function modules"),
+    cl::init("."));
+static cl::opt<string> SplitManifest(
+    "split-manifest",
+    cl::desc("The list of modules the program consists of"),
+    cl::init("loom.manifest"));
+static cl::opt<bool> SplitPartitions(
+    "split-partitions",
+    cl::desc("Emit one module for all functions in the partition instead of "
+             "one per function"));
+
+bool FunctionSplitter::runOnModule(Module &M) {
+  // Debug info links every function to the whole compile unit, which would
+  // make a per-function module drag in the entire program.
+  if (!SplitPartitions)
+    StripDebugInfo(M);
+  // Functions and variables will be referenced across modules.
+  Externalize(M);
+
+  string ErrorInfo;
+  raw_fd_ostream Manifest(SplitManifest.c_str(), ErrorInfo);
+  if (!ErrorInfo.empty()) {
+    errs() << "cannot write " << SplitManifest << ": " << ErrorInfo << "\n";
+    return true;
+  }
+
+  if (IsFirstPartition()) {
+    Module *GM = extractGlobals(M);
+    Manifest << writeModule(*GM) << " <globals>\n";
+    delete GM;
+  }
+
+  if (SplitPartitions) {
+    Module *PM = extractPartition(M);
+    Manifest << writeModule(*PM) << " <partition>\n";
+    delete PM;
+    return true;
+  }
+
+  for (Module::iterator F = M.begin(); F != M.end(); ++F) {
+    // available_externally functions are only for inlining.
+    if (F->isDeclaration() || F->hasAvailableExternallyLinkage())
+      continue;
+    if (!IsInPartition(*F))
+      continue;
+    Module *FM = extractFunction(*F, M);
+    Manifest << writeModule(*FM) << " " << F->getName() << "\n";
+    delete FM;
+  }
+
+  return true;
+}
+
+uint64_t FunctionSplitter::HashString(StringRef S) {
+  // 64-bit FNV-1a
+  uint64_t Hash = 14695981039346656037ULL;
+  for (size_t i = 0; i < S.size(); ++i) {
+    Hash ^= (unsigned char)S[i];
+    Hash *= 1099511628211ULL;
+  }
+  return Hash;
+}
+
+uint64_t FunctionSplitter::HashModule(const Module &M) {
+  string IR;
+  raw_string_ostream OS(IR);
+  M.print(OS, NULL);
+  OS.flush();
+  return HashString(IR);
+}
+
+void FunctionSplitter::StripDebugInfo(Module &M) {
+  for (Module::iterator F = M.begin(); F != M.end(); ++F) {
+    for (Function::iterator B = F->begin(); B != F->end(); ++B) {
+      for (BasicBlock::iterator I = B->begin(); I != B->end(); ) {
+        Instruction *Ins = I++;
+        if (isa<DbgInfoIntrinsic>(Ins)) {
+          Ins->eraseFromParent();
+          continue;
+        }
+        Ins->setDebugLoc(DebugLoc());
+      }
+    }
+  }
+  for (Module::named_metadata_iterator NMD = M.named_metadata_begin();
+       NMD != M.named_metadata_end(); ) {
+    NamedMDNode *Node = NMD++;
+    if (Node->getName().startswith("llvm.dbg."))
+      Node->eraseFromParent();
+  }
+  for (Module::iterator F = M.begin(); F != M.end(); ) {
+    Function *Fn = F++;
+    if (Fn->getName().startswith("llvm.dbg.") && Fn->use_empty())
+      Fn->eraseFromParent();
+  }
+}
+
+// Code generation drops linkonce definitions nothing in their own module
+// refers to, e.g. inline functions, template instances, vtables and typeinfo,
+// which other modules do refer to. Weak definitions are kept, and still merge
+// with the copies in other objects.
+void FunctionSplitter::KeepDefinition(GlobalValue &GV) {
+  if (GV.getLinkage() == GlobalValue::LinkOnceAnyLinkage)
+    GV.setLinkage(GlobalValue::WeakAnyLinkage);
+  else if (GV.getLinkage() == GlobalValue::LinkOnceODRLinkage)
+    GV.setLinkage(GlobalValue::WeakODRLinkage);
+}
+
+void FunctionSplitter::Externalize(Module &M) {
+  // Names of local values are unique within the module. Suffix them anyway,
+  // so that they do not clash with symbols from the libraries we link with.
+  for (Module::iterator F = M.begin(); F != M.end(); ++F) {
+    KeepDefinition(*F);
+    if (F->hasLocalLinkage()) {
+      F->setName(F->getName() + ".loom");
+      F->setLinkage(GlobalValue::ExternalLinkage);
+      F->setVisibility(GlobalValue::HiddenVisibility);
+    }
+  }
+  for (Module::global_iterator G = M.global_begin();
+       G != M.global_end();
+       ++G) {
+    KeepDefinition(*G);
+    if (G->hasLocalLinkage()) {
+      if (G->isConstant() && G->hasUnnamedAddr() && G->hasInitializer()) {
+        // Linking the program numbers its string literals, e.g. .str123, so
+        // adding one would rename all later ones and change the functions
+        // using them. Name such constants after their contents instead.
+        // setName appends a number if two have the same contents.
+        string Contents;
+        raw_string_ostream OS(Contents);
+        G->getInitializer()->print(OS);
+        OS.flush();
+        char Name[32];
+        sprintf(Name, "loom.const.%016llx",
+                (unsigned long long)HashString(Contents));
+        G->setName(Name);
+      } else {
+        G->setName(G->getName() + ".loom");
+      }
+      G->setLinkage(GlobalValue::ExternalLinkage);
+      G->setVisibility(GlobalValue::HiddenVisibility);
+    }
+  }
+  for (Module::alias_iterator A = M.alias_begin(); A != M.alias_end(); ++A) {
+    KeepDefinition(*A);
+    if (A->hasLocalLinkage()) {
+      A->setName(A->getName() + ".loom");
+      A->setLinkage(GlobalValue::ExternalLinkage);
+      A->setVisibility(GlobalValue::HiddenVisibility);
+    }
+  }
+}
+
+GlobalValue *FunctionSplitter::Declare(const GlobalValue *GV, Module &NM) {
+  if (GlobalValue *Existing = NM.getNamedValue(GV->getName()))
+    return Existing;
+
+  Type *ValueType = cast<PointerType>(GV->getType())->getElementType();
+  GlobalValue *Decl;
+  if (FunctionType *FT = dyn_cast<FunctionType>(ValueType)) {
+    Function *NF = Function::Create(FT,
+                                    GlobalValue::ExternalLinkage,
+                                    GV->getName(),
+                                    &NM);
+    if (const Function *F = dyn_cast<Function>(GV)) {
+      NF->setCallingConv(F->getCallingConv());
+      NF->setAttributes(F->getAttributes());
+    }
+    Decl = NF;
+  } else {
+    const GlobalVariable *G = dyn_cast<GlobalVariable>(GV);
+    // Declare arrays without their sizes, which do not affect the code, so
+    // that e.g. the size of LoomFuncStates, which grows with the number of
+    // functions, does not change the hash of every function.
+    if (ArrayType *AT = dyn_cast<ArrayType>(ValueType))
+      ValueType = ArrayType::get(AT->getElementType(), 0);
+    Decl = new GlobalVariable(NM,
+                              ValueType,
+                              G && G->isConstant(),
+                              GlobalValue::ExternalLinkage,
+                              NULL,
+                              GV->getName(),
+                              NULL,
+                              G && G->isThreadLocal(),
+                              GV->getType()->getAddressSpace());
+  }
+  Decl->setVisibility(GV->getVisibility());
+  return Decl;
+}
+
+const Function *FunctionSplitter::GetAliasedFunction(const GlobalAlias &GA) {
+  return dyn_cast<Function>(GA.getAliasedGlobal());
+}
+
+void FunctionSplitter::CollectGlobals(
+    const Value *V,
+    SmallPtrSet<const GlobalValue *, 16> &Globals,
+    SmallPtrSet<const Value *, 16> &Visited) {
+  if (const GlobalValue *GV = dyn_cast<GlobalValue>(V)) {
+    Globals.insert(GV);
+    return;
+  }
+  const Constant *C = dyn_cast<Constant>(V);
+  if (!C || !Visited.insert(C))
+    return;
+  for (unsigned i = 0; i < C->getNumOperands(); ++i)
+    CollectGlobals(C->getOperand(i), Globals, Visited);
+}
+
+Module *FunctionSplitter::extractFunction(Function &F, Module &M) {
+  Module *NM = new Module("loom", M.getContext());
+  NM->setDataLayout(M.getDataLayout());
+  NM->setTargetTriple(M.getTargetTriple());
+
+  // Declare everything <F> refers to.
+  SmallPtrSet<const GlobalValue *, 16> Globals;
+  SmallPtrSet<const Value *, 16> Visited;
+  for (Function::iterator B = F.begin(); B != F.end(); ++B) {
+    for (BasicBlock::iterator I = B->begin(); I != B->end(); ++I) {
+      for (unsigned i = 0; i < I->getNumOperands(); ++i)
+        CollectGlobals(I->getOperand(i), Globals, Visited);
+    }
+  }
+  ValueToValueMapTy VMap;
+  for (SmallPtrSet<const GlobalValue *, 16>::iterator I = Globals.begin();
+       I != Globals.end();
+       ++I) {
+    // Constant folding drops the casts from constant GEPs into arrays.
+    if (*I != &F)
+      VMap[*I] = ConstantExpr::getBitCast(Declare(*I, *NM), (*I)->getType());
+  }
+
+  Function *NF = Function::Create(F.getFunctionType(),
+                                  F.getLinkage(),
+                                  F.getName(),
+                                  NM);
+  NF->copyAttributesFrom(&F);
+  VMap[&F] = NF;
+  Function::arg_iterator NewArg = NF->arg_begin();
+  for (Function::arg_iterator Arg = F.arg_begin();
+       Arg != F.arg_end();
+       ++Arg, ++NewArg) {
+    NewArg->setName(Arg->getName());
+    VMap[Arg] = NewArg;
+  }
+  SmallVector<ReturnInst *, 8> Returns;
+  CloneFunctionInto(NF, &F, VMap, true, Returns);
+
+  // Aliases of <F> go with <F>, because an alias has to be defined in the
+  // same object as what it aliases.
+  for (Module::alias_iterator A = M.alias_begin(); A != M.alias_end(); ++A) {
+    if (GetAliasedFunction(*A) != &F)
+      continue;
+    GlobalValue *Existing = NM->getNamedValue(A->getName());
+    GlobalAlias *NA = new GlobalAlias(A->getType(),
+                                      A->getLinkage(),
+                                      "",
+                                      cast<Constant>(MapValue(A->getAliasee(),
+                                                              VMap)),
+                                      NM);
+    NA->copyAttributesFrom(A);
+    if (Existing) {
+      Existing->replaceAllUsesWith(
+          ConstantExpr::getBitCast(NA, Existing->getType()));
+      Existing->eraseFromParent();
+    }
+    NA->setName(A->getName());
+  }
+
+  return NM;
+}
+
+Module *FunctionSplitter::extractGlobals(Module &M) {
+  Module *GM = CloneModule(&M);
+  GM->setModuleIdentifier("loom");
+
+  // Aliases of functions live with the functions. Replace them with
+  // declarations.
+  for (Module::alias_iterator A = GM->alias_begin(); A != GM->alias_end(); ) {
+    GlobalAlias *GA = A++;
+    if (GetAliasedFunction(*GA) != NULL)
+      ReplaceWithDeclaration(GA, *GM);
+  }
+
+  for (Module::iterator F = GM->begin(); F != GM->end(); ++F) {
+    if (!F->isDeclaration()) {
+      GlobalValue::VisibilityTypes Visibility = F->getVisibility();
+      F->deleteBody();
+      F->setVisibility(Visibility);
+    }
+  }
+
+  return GM;
+}
+
+Module *FunctionSplitter::extractPartition(Module &M) {
+  Module *PM = CloneModule(&M);
+  PM->setModuleIdentifier("loom");
+
+  // The clone shares names with <M>, whose functions IsInPartition knows.
+  // Aliases live with the functions they alias, and aliases of variables
+  // live in the globals module.
+  for (Module::alias_iterator A = PM->alias_begin(); A != PM->alias_end(); ) {
+    GlobalAlias *GA = A++;
+    const Function *F = GetAliasedFunction(*GA);
+    if (F == NULL || !IsInPartition(*M.getFunction(F->getName())))
+      ReplaceWithDeclaration(GA, *PM);
+  }
+
+  // The globals module defines all variables, including the static
+  // constructor list.
+  for (Module::global_iterator G = PM->global_begin();
+       G != PM->global_end(); ) {
+    GlobalVariable *GV = G++;
+    if (GV->isDeclaration())
+      continue;
+    if (GV->hasAppendingLinkage()) {
+      GV->eraseFromParent();
+      continue;
+    }
+    GV->setInitializer(NULL);
+    GV->setLinkage(GlobalValue::ExternalLinkage);
+  }
+
+  for (Module::iterator F = PM->begin(); F != PM->end(); ++F) {
+    if (!F->isDeclaration() && !IsInPartition(*M.getFunction(F->getName()))) {
+      GlobalValue::VisibilityTypes Visibility = F->getVisibility();
+      F->deleteBody();
+      F->setVisibility(Visibility);
+    }
+  }
+
+  return PM;
+}
+
+void FunctionSplitter::ReplaceWithDeclaration(GlobalAlias *GA, Module &M) {
+  string Name = GA->getName();
+  GA->setName("");
+  Type *ValueType = GA->getType()->getElementType();
+  GlobalValue *Decl;
+  if (FunctionType *FT = dyn_cast<FunctionType>(ValueType)) {
+    Decl = Function::Create(FT, GlobalValue::ExternalLinkage, Name, &M);
+  } else {
+    Decl = new GlobalVariable(M,
+                              ValueType,
+                              false,
+                              GlobalValue::ExternalLinkage,
+                              NULL,
+                              Name);
+  }
+  Decl->setVisibility(GA->getVisibility());
+  GA->replaceAllUsesWith(ConstantExpr::getBitCast(Decl, GA->getType()));
+  GA->eraseFromParent();
+}
+
+string FunctionSplitter::writeModule(const Module &NM) {
+  char Hash[32];
+  sprintf(Hash, "%016llx", (unsigned long long)HashModule(NM));
+  string FileName = SplitDir + "/" + Hash + ".bc";
+
+  struct stat St;
+  if (stat(FileName.c_str(), &St) == 0)
+    return Hash;
+
+  // Write to a temporary file first, so that a concurrent or interrupted build
+  // never sees a partially written module.
+  char TempSuffix[32];
+  sprintf(TempSuffix, ".tmp.%d", getpid());
+  string TempFileName = FileName + TempSuffix;
+  string ErrorInfo;
+  {
+    raw_fd_ostream Out(TempFileName.c_str(),
+                       ErrorInfo,
+                       raw_fd_ostream::F_Binary);
+    if (!ErrorInfo.empty()) {
+      errs() << "cannot write " << TempFileName << ": " << ErrorInfo << "\n";
+      return Hash;
+    }
+    WriteBitcodeToFile(&NM, Out);
+  }
+  if (rename(TempFileName.c_str(), FileName.c_str()) == -1)
+    perror("rename");
+  return Hash;
+}
@@ -0,0 +1,162 @@
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "llvm/Module.h"
+#include "llvm/Pass.h"
+#include "llvm/Analysis/DebugInfo.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "loom/LocIndex.h"
+#include "loom/StableIDs.h"
+
+using namespace std;
+using namespace llvm;
+
+namespace loom {
+struct LocIndexBuilder: public ModulePass {
+  static char ID;
+
+  LocIndexBuilder(): ModulePass(ID) {}
+  virtual void getAnalysisUsage(AnalysisUsage &AU) const;
+  virtual bool runOnModule(Module &M);
+
+ private:
+  static bool CompareEntries(const LocIndexEntry &A, const LocIndexEntry &B);
+  static string GetFileName(const DILocation &Loc);
+
+  void writeIndex(const vector<LocIndexEntry> &Entries,
+                  const map<string, unsigned> &FileIDs);
+};
+}
+
+using namespace loom;
+
+char LocIndexBuilder::ID = 0;
+
+static RegisterPass<LocIndexBuilder> X(
+    "build-loc-index",
+    "Build the index from source locations to slot IDs",
+    false,
+    true);
+
+static cl::opt<string> LocIndexFileName(
+    "output-loc-index",
+    cl::desc("Where to write the source location index"),
+    cl::init("loom.idx"));
+
+void LocIndexBuilder::getAnalysisUsage(AnalysisUsage &AU) const {
+  AU.setPreservesAll();
+  AU.addRequired<StableIDs>();
+}
+
+bool LocIndexBuilder::CompareEntries(const LocIndexEntry &A,
+                                     const LocIndexEntry &B) {
+  if (A.FileID != B.FileID)
+    return A.FileID < B.FileID;
+  if (A.Line != B.Line)
+    return A.Line < B.Line;
+  return A.SlotID < B.SlotID;
+}
+
+string LocIndexBuilder::GetFileName(const DILocation &Loc) {
+  string FileName = Loc.getFilename();
+  if (FileName.empty() || FileName[0] == '/' || Loc.getDirectory().empty())
+    return FileName;
+  return Loc.getDirectory().str() + "/" + FileName;
+}
+
+bool LocIndexBuilder::runOnModule(Module &M) {
+  StableIDs &SIDs = getAnalysis<StableIDs>();
+
+  // Entries temporarily use file IDs in the order of appearance.
+  map<string, unsigned> FileIDs;
+  vector<LocIndexEntry> Entries;
+  for (Module::iterator F = M.begin(); F != M.end(); ++F) {
+    for (Function::iterator B = F->begin(); B != F->end(); ++B) {
+      for (BasicBlock::iterator I = B->begin(); I != B->end(); ++I) {
+        unsigned InsID = SIDs.getInstructionID(I);
+        if (InsID == StableIDs::InvalidID)
+          continue;
+        MDNode *Dbg = I->getMetadata("dbg");
+        if (!Dbg)
+          continue;
+        DILocation Loc(Dbg);
+        if (Loc.getLineNumber() == 0)
+          continue;
+        string FileName = GetFileName(Loc);
+        map<string, unsigned>::iterator Pos = FileIDs.find(FileName);
+        if (Pos == FileIDs.end()) {
+          unsigned FileID = FileIDs.size();
+          Pos = FileIDs.insert(make_pair(FileName, FileID)).first;
+        }
+        LocIndexEntry E;
+        E.FileID = Pos->second;
+        E.Line = Loc.getLineNumber();
+        E.SlotID = InsID;
+        E.FuncID = SIDs.getFunctionID(F);
+        Entries.push_back(E);
+      }
+    }
+  }
+
+  // Renumber files in the lexical order of their names, so that building the
+  // index twice for the same program gives the same file.
+  vector<unsigned> NewFileIDs(FileIDs.size());
+  unsigned NewFileID = 0;
+  for (map<string, unsigned>::iterator I = FileIDs.begin();
+       I != FileIDs.end();
+       ++I) {
+    NewFileIDs[I->second] = NewFileID;
+    I->second = NewFileID;
+    ++NewFileID;
+  }
+  for (size_t i = 0; i < Entries.size(); ++i)
+    Entries[i].FileID = NewFileIDs[Entries[i].FileID];
+  sort(Entries.begin(), Entries.end(), CompareEntries);
+
+  writeIndex(Entries, FileIDs);
+  return false;
+}
+
+void LocIndexBuilder::writeIndex(const vector<LocIndexEntry> &Entries,
+                                 const map<string, unsigned> &FileIDs) {
+  string ErrorInfo;
+  raw_fd_ostream IndexFile(LocIndexFileName.c_str(),
+                           ErrorInfo,
+                           raw_fd_ostream::F_Binary);
+  if (!ErrorInfo.empty()) {
+    errs() << "cannot write " << LocIndexFileName << ": " << ErrorInfo << "\n";
+    return;
+  }
+
+  // <FileIDs> is ordered by file names, i.e. by the new file IDs.
+  vector<uint32_t> FileNames;
+  string Strings;
+  for (map<string, unsigned>::const_iterator I = FileIDs.begin();
+       I != FileIDs.end();
+       ++I) {
+    FileNames.push_back(Strings.size());
+    Strings += I->first;
+    Strings += '\0';
+  }
+
+  LocIndexHeader Header;
+  Header.Magic = LocIndexMagic;
+  Header.Version = LocIndexVersion;
+  Header.NumEntries = Entries.size();
+  Header.NumFiles = FileNames.size();
+  Header.StringsSize = Strings.size();
+  IndexFile.write((const char *)&Header, sizeof Header);
+  if (!Entries.empty()) {
+    IndexFile.write((const char *)&Entries[0],
+                    Entries.size() * sizeof(LocIndexEntry));
+  }
+  if (!FileNames.empty()) {
+    IndexFile.write((const char *)&FileNames[0],
+                    FileNames.size() * sizeof(uint32_t));
+  }
+  IndexFile << Strings;
+}
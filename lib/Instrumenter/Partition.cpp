@@ -0,0 +1,71 @@
+#include <algorithm>
+#include <vector>
+
+#include "llvm/Module.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/Support/CommandLine.h"
+
+#include "loom/Partition.h"
+
+using namespace std;
+using namespace llvm;
+using namespace loom;
+
+static cl::opt<unsigned> NumPartitions(
+    "loom-num-partitions",
+    cl::desc("Number of processes instrumenting the module in parallel"),
+    cl::init(1));
+static cl::opt<unsigned> Partition(
+    "loom-partition",
+    cl::desc("Which partition this process instruments"),
+    cl::init(0));
+
+// function -> partition
+static DenseMap<const Function *, unsigned> Assignment;
+
+static bool CompareSizes(const pair<unsigned, const Function *> &A,
+                         const pair<unsigned, const Function *> &B) {
+  // Larger functions first. The sort is stable, so ties keep the module
+  // order, and all processes compute the same assignment.
+  return A.first > B.first;
+}
+
+// Balance partitions by instruction counts: assign the largest remaining
+// function to the lightest partition.
+static void AssignPartitions(const Module &M) {
+  vector<pair<unsigned, const Function *> > Sizes;
+  for (Module::const_iterator F = M.begin(); F != M.end(); ++F) {
+    unsigned Size = 0;
+    for (Function::const_iterator B = F->begin(); B != F->end(); ++B)
+      Size += B->size();
+    Sizes.push_back(make_pair(Size, (const Function *)F));
+  }
+  stable_sort(Sizes.begin(), Sizes.end(), CompareSizes);
+
+  vector<unsigned long> Loads(NumPartitions, 0);
+  for (size_t i = 0; i < Sizes.size(); ++i) {
+    unsigned Lightest = min_element(Loads.begin(), Loads.end()) -
+        Loads.begin();
+    Assignment[Sizes[i].second] = Lightest;
+    Loads[Lightest] += Sizes[i].first + 1;
+  }
+}
+
+bool loom::IsInPartition(const Function &F) {
+  if (NumPartitions <= 1)
+    return true;
+  // The first query comes before any function is instrumented, so that the
+  // sizes are the original ones.
+  if (Assignment.empty())
+    AssignPartitions(*F.getParent());
+  DenseMap<const Function *, unsigned>::const_iterator I = Assignment.find(&F);
+  // Functions created after the assignment, e.g. declarations of Loom's
+  // runtime, are not instrumented anyway.
+  if (I == Assignment.end())
+    return IsFirstPartition();
+  return I->second == Partition;
+}
+
+bool loom::IsFirstPartition() {
+  return NumPartitions <= 1 || Partition == 0;
+}
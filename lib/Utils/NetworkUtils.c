@@ -56,3 +56,32 @@ int ReceiveMessage(int Sock, char *M) {
   M[L] = '\0';
   return 0;
 }
+
+int SendTaggedMessage(int Sock, unsigned Tag, const char *M) {
+  uint32_t L = htonl(strlen(M));
+  uint32_t T = htonl(Tag);
+  if (SendExactly(Sock, &L, sizeof(uint32_t)) == -1)
+    return -1;
+  if (SendExactly(Sock, &T, sizeof(uint32_t)) == -1)
+    return -1;
+  return SendExactly(Sock, M, strlen(M));
+}
+
+int ReceiveTaggedMessage(int Sock, unsigned *Tag, char *M) {
+  uint32_t T;
+  uint32_t L;
+  if (ReceiveExactly(Sock, &L, sizeof(uint32_t)) == -1)
+    return -1;
+  L = ntohl(L);
+  if (L >= MaxBufferSize) {
+    fprintf(stderr, "message too long: length = %u\n", L);
+    return -1;
+  }
+  if (ReceiveExactly(Sock, &T, sizeof(uint32_t)) == -1)
+    return -1;
+  *Tag = ntohl(T);
+  if (ReceiveExactly(Sock, M, L) == -1)
+    return -1;
+  M[L] = '\0';
+  return 0;
+}
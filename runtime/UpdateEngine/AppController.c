@@ -1,16 +1,23 @@
 /* #define DEBUG_APP_CONTROLLER */
 
 #include <assert.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/mman.h>
 
+#include "Threads.h"
+#include "Trace.h"
 #include "UpdateEngine.h"
+#include "UpdateLock.h"
 
-volatile int LoomWait[MaxNumBackEdges];
-atomic_t LoomCounter[MaxNumBlockingCS];
-pthread_rwlock_t LoomUpdateLock;
+/* Huge pages are 2MB on x86-64. */
+#define HugePageSize (2 << 20)
+
+volatile int *LoomWait;
+atomic_t *LoomCounter;
 __thread int CallDepth = 0;
 
 void LoomEnterProcess();
@@ -19,38 +26,87 @@ void LoomExitProcess();
 void LoomEnterThread();
 void LoomExitThread(int Forced);
 void LoomCycleCheck(unsigned BackEdgeID);
+int LoomBackEdge(unsigned FuncID, unsigned BackEdgeID);
+int LoomGatedEntry(unsigned FuncID);
 void LoomBeforeBlocking(unsigned CallSiteID);
 void LoomAfterBlocking(unsigned CallSiteID);
 
+/*
+ * Allocates a zero-filled table. If LOOM_HUGE_PAGES is set, tries huge pages
+ * first to save TLB misses on large tables.
+ */
+static void *AllocTable(size_t Size) {
+  void *Table;
+  if (Size == 0)
+    return NULL;
+#ifdef MAP_HUGETLB
+  if (getenv("LOOM_HUGE_PAGES") != NULL) {
+    size_t HugeSize = (Size + HugePageSize - 1) / HugePageSize * HugePageSize;
+    Table = mmap(NULL, HugeSize, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (Table != MAP_FAILED)
+      return Table;
+    /* Not enough huge pages reserved. Fall back to normal pages. */
+  }
+#endif
+  Table = mmap(NULL, Size, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (Table == MAP_FAILED) {
+    perror("mmap");
+    exit(1);
+  }
+  return Table;
+}
+
 void LoomEnterProcess() {
+  const char *StateFileName;
   fprintf(stderr, "***** LoomEnterProcess *****\n");
   pthread_atfork(NULL, NULL, LoomEnterForkedProcess);
   atexit(LoomExitProcess);
-  pthread_rwlock_init(&LoomUpdateLock, NULL);
-  memset((void *)LoomWait, 0, sizeof(LoomWait));
-  memset((void *)LoomCounter, 0, sizeof(LoomCounter));
-  memset((void *)LoomOperations, 0, sizeof(LoomOperations));
-  memset((void *)LoomSwitches, 0, sizeof(LoomSwitches));
+  /*
+   * The instrumenter tells the sizes of the tables. Anonymous mappings are
+   * zero-filled, and only touched pages take memory. LoomFuncStates is
+   * defined in the instrumented program.
+   */
+  LoomWait = AllocTable(LoomNumBackEdges * sizeof(int));
+  LoomCounter = AllocTable(LoomNumBlockingCS * sizeof(atomic_t));
+  LoomOperations = AllocTable(LoomNumInsts * sizeof(struct Operation *));
   InitFilters();
-  if (StartDaemon() == -1) {
-    fprintf(stderr, "failed to start the loom daemon. abort...\n");
-    exit(1);
-  }
+  /*
+   * Re-apply the filters the controller installed before, so that the
+   * application starts already patched. No other thread runs yet.
+   */
+  StateFileName = getenv("LOOM_STATE_FILE");
+  if (StateFileName != NULL && access(StateFileName, F_OK) == 0)
+    LoadFilters(StateFileName);
+  /* LOOM_PREEMPT=<ms> preempts threads lagging an update for <ms>. */
+  if (getenv("LOOM_PREEMPT") != NULL)
+    InitPreemption(atoi(getenv("LOOM_PREEMPT")));
+  /* The application still runs without the daemon, but cannot be updated. */
+  if (StartDaemon(0) == -1)
+    fprintf(stderr, "failed to start the loom daemon\n");
   LoomEnterThread();
 }
 
 void LoomEnterForkedProcess() {
+  unsigned i;
   fprintf(stderr, "***** LoomEnterForkedProcess *****\n");
   /*
-   * Reinitialize LoomWait because the Loom daemon is not started yet for this
-   * process. Inherit other data structures from the parent process.
+   * Reinitialize LoomWait, the pending bits and the gates because the Loom
+   * daemon is not started yet for this process, and no daemon will open gates
+   * closed by the parent's. Inherit other data structures from the parent
+   * process. LoomActivations still counts the parent's threads, so StartDaemon
+   * never lets the child's updates wait for activations.
    */
-  memset((void *)LoomWait, 0, sizeof(LoomWait));
+  memset((void *)LoomWait, 0, LoomNumBackEdges * sizeof(int));
+  for (i = 0; i < LoomNumFuncs; ++i)
+    LoomFuncStates[i] &= ~(LoomPending | LoomGated);
+  /* Only the forking thread is copied to the child. */
+  ResetUpdateLock(HoldsUpdateLock);
+  ResetThreadRegistry();
   /* Start Loom daemon. */
-  if (StartDaemon() == -1) {
-    fprintf(stderr, "failed to start the loom daemon. abort...\n");
-    exit(1);
-  }
+  if (StartDaemon(1) == -1)
+    fprintf(stderr, "failed to start the loom daemon\n");
   /*
    * We do not call LoomEnterThread here, because we inherited parent's
    * LoomUpdateLock already.
@@ -64,7 +120,7 @@ void LoomExitProcess() {
     fprintf(stderr, "failed to stop the loom daemon\n");
   }
   ClearFilters();
-  for (i = 0; i < MaxNumInsts; ++i)
+  for (i = 0; i < LoomNumInsts; ++i)
     assert(LoomOperations[i] == NULL);
   fprintf(stderr, "***** LoomExitProcess *****\n");
 }
@@ -74,7 +130,11 @@ void LoomEnterThread() {
 #ifdef DEBUG_APP_CONTROLLER
     fprintf(stderr, "[%d] LoomEnterThread acquires LoomUpdatelock\n", getpid());
 #endif
-    pthread_rwlock_rdlock(&LoomUpdateLock);
+    AcquireUpdateLock();
+    HoldsUpdateLock = 1;
+    ++InLoomRuntime;
+    RegisterThread();
+    --InLoomRuntime;
   }
   ++CallDepth;
 }
@@ -85,30 +145,80 @@ void LoomExitThread(int Forced) {
 #ifdef DEBUG_APP_CONTROLLER
     fprintf(stderr, "[%d] LoomExitThread releases LoomUpdateLock\n", getpid());
 #endif
-    pthread_rwlock_unlock(&LoomUpdateLock);
+    ++InLoomRuntime;
+    UnregisterThread();
+    ReleaseTraceBuffer();
+    --InLoomRuntime;
+    HoldsUpdateLock = 0;
+    ReleaseUpdateLock();
   }
 }
 
 void LoomCycleCheck(unsigned BackEdgeID) {
   if (LoomWait[BackEdgeID]) {
-    pthread_rwlock_unlock(&LoomUpdateLock);
+    TraceEvent(TraceParkBegin, BackEdgeID);
+    SetThreadState(ThreadParked, BackEdgeID);
+    HoldsUpdateLock = 0;
+    ReleaseUpdateLock();
     while (LoomWait[BackEdgeID]);
-    pthread_rwlock_rdlock(&LoomUpdateLock);
+    AcquireUpdateLock();
+    HoldsUpdateLock = 1;
+    SetThreadState(ThreadRunning, 0);
+    TraceEvent(TraceParkEnd, BackEdgeID);
   }
 }
 
+/*
+ * Called at a back edge only if the state word of the function is non-zero.
+ * Returns whether the function should continue in the slow path.
+ */
+int LoomBackEdge(unsigned FuncID, unsigned BackEdgeID) {
+  if (LoomFuncStates[FuncID] & LoomPending)
+    LoomCycleCheck(BackEdgeID);
+  /* Reload the state word, because an update may have patched the function. */
+  if (LoomFuncStates[FuncID] & LoomPatched) {
+    TraceEvent(TraceSlowPath, FuncID);
+    SetThreadState(ThreadSlowPath, FuncID);
+    return 1;
+  }
+  return 0;
+}
+
+/*
+ * Called at the entry of a function that an update is patching, after the
+ * entry counted the activation. Leaves the count until the update opens the
+ * gate, and returns the new state word.
+ */
+int LoomGatedEntry(unsigned FuncID) {
+  int State;
+  do {
+    atomic_dec(&LoomActivations[FuncID]);
+    while (LoomFuncStates[FuncID] & LoomGated)
+      sched_yield();
+    atomic_inc(&LoomActivations[FuncID]);
+    State = LoomFuncStates[FuncID];
+  } while (State & LoomGated);
+  return State;
+}
+
 void LoomBeforeBlocking(unsigned CallSiteID) {
 #ifdef DEBUG_APP_CONTROLLER
   fprintf(stderr, "[%d] LoomBeforeBlocking(%u)\n", getpid(), CallSiteID);
 #endif
+  TraceEvent(TraceBlockingBegin, CallSiteID);
+  SetThreadState(ThreadBlocking, CallSiteID);
   atomic_inc(&LoomCounter[CallSiteID]);
-  pthread_rwlock_unlock(&LoomUpdateLock);
+  HoldsUpdateLock = 0;
+  ReleaseUpdateLock();
 }
 
 void LoomAfterBlocking(unsigned CallSiteID) {
 #ifdef DEBUG_APP_CONTROLLER
   fprintf(stderr, "[%d] LoomAfterBlocking(%u)\n", getpid(), CallSiteID);
 #endif
-  pthread_rwlock_rdlock(&LoomUpdateLock);
+  AcquireUpdateLock();
+  HoldsUpdateLock = 1;
   atomic_dec(&LoomCounter[CallSiteID]);
+  SetThreadState(ThreadRunning, 0);
+  TraceEvent(TraceBlockingEnd, CallSiteID);
 }
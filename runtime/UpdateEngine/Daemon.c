@@ -1,26 +1,42 @@
 #include <assert.h>
+#include <errno.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <signal.h>
 #include <stdint.h>
 #include <strings.h>
+#include <time.h>
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <sys/prctl.h>
 
 #include "loom/config.h"
 #include "loom/Utils.h"
+#include "Threads.h"
+#include "Trace.h"
 #include "UpdateEngine.h"
+#include "UpdateLock.h"
 
 struct Filter {
   enum Type {
     Unknown = 0,
-    CriticalRegion
+    CriticalRegion,
+    /* counts the hits of each slot it lists */
+    Probe,
+    /* measures the time from its start slots to its end slots */
+    LatencyProbe,
+    /* a critical region that only counts. Never read from a filter file. */
+    ShadowRegion
   } FilterType;
 
   unsigned NumOps;
   struct Operation *Ops;
+  /* the counters of operation i start at Counters[i * NumProbeCPUs] */
+  struct ProbeCounter *Counters;
+  /* the histograms of a latency probe */
+  struct IntervalProbe *Interval;
 
   unsigned NumFuncsToPatch;
   unsigned *FuncsToPatch;
@@ -30,11 +46,88 @@ struct Filter {
 
   unsigned NumUnsafeCallSites;
   unsigned *UnsafeCallSites;
+
+  /*
+   * The watchdog deletes the filter if its overhead exceeds Budget percent
+   * in the first Window milliseconds after it is installed. A budget of 0
+   * means the filter is not watched.
+   */
+  unsigned Budget;
+  unsigned Window;
+  /* progress per millisecond before the filter is installed */
+  double BaselineRate;
+  unsigned long ProgressAtInstall;
+  /* in nanoseconds, as returned by MonotonicTime */
+  uint64_t InstalledAt;
 };
 
 static struct Filter Filters[MaxNumFilters];
-// StopDaemon also uses it.
+/* The serial of the last latency probe installed. */
+static uint64_t LastIntervalSerial = 0;
+// StopDaemon also uses it. -1 while the daemon is not connected.
 static int CtrlSock = -1;
+/* Set by StopDaemon, so that the daemon does not reconnect. */
+static volatile int Stopping = 0;
+/*
+ * Set in a forked child, whose LoomActivations counts the activations of the
+ * parent's threads. They never finish in the child, and the forking thread's
+ * own cannot be told apart, so the child always evacuates all threads.
+ */
+static int ActivationsInherited = 0;
+/*
+ * The tag of the command being processed. Messages about it carry the tag, so
+ * that the controller routes them to the client that sent the command.
+ */
+static unsigned CurrentTag = 0;
+
+/* Commands received during an update, processed after it. */
+struct QueuedCommand {
+  unsigned Tag;
+  char Cmd[MaxBufferSize];
+};
+#define MaxQueuedCommands (16)
+static struct QueuedCommand QueuedCommands[MaxQueuedCommands];
+static unsigned QueueHead = 0, QueueLength = 0;
+
+/* How often Evacuate reports its progress, in milliseconds. */
+#define ProgressInterval (1000)
+/*
+ * How long Evacuate waits for LoomUpdateLock at a time before checking the
+ * deadline and cancellation, in milliseconds.
+ */
+#define LockSlice (100)
+/*
+ * How long a targeted update waits for the activations of the functions it
+ * patches to finish, in milliseconds, before it evacuates all threads.
+ */
+#define QuiescenceTimeout (100)
+/* How long the watchdog watches a filter by default, in milliseconds. */
+#define DefaultWatchdogWindow (10000)
+/*
+ * How often the daemon samples LoomProgress, in milliseconds, and how many
+ * samples it keeps.
+ */
+#define ProgressSampleInterval (1000)
+#define MaxProgressSamples (64)
+/*
+ * How long the daemon waits before reconnecting to the controller, in
+ * milliseconds. The delay doubles after each failure.
+ */
+#define MinReconnectDelay (100)
+#define MaxReconnectDelay (30000)
+
+/*
+ * Recent samples of LoomProgress in a ring, so that the watchdog takes the
+ * progress rate before an install from the past instead of waiting for it.
+ */
+struct ProgressSample {
+  /* in nanoseconds, as returned by MonotonicTime */
+  uint64_t Time;
+  unsigned long Progress;
+};
+static struct ProgressSample ProgressSamples[MaxProgressSamples];
+/* The next sample goes to ProgressSamples[NextProgressSample]. */
+static unsigned NextProgressSample = 0, NumProgressSamples = 0;
 
 static int BlockAllSignals() {
   sigset_t SigSet;
@@ -70,7 +163,7 @@ static int CreateSocketToController() {
   ServerAddr.sin_addr.s_addr = inet_addr(CONTROLLER_IP);
   ServerAddr.sin_port = htons(CONTROLLER_PORT);
   if (connect(Sock, (struct sockaddr *)&ServerAddr, sizeof ServerAddr) == -1) {
-    perror("failed to connect to the controller server");
+    close(Sock);
     return -1;
   }
   return Sock;
@@ -78,23 +171,102 @@ static int CreateSocketToController() {
 
 void InitFilters() {
   unsigned i;
+  long NumCPUs = sysconf(_SC_NPROCESSORS_CONF);
   for (i = 0; i < MaxNumFilters; ++i) {
     Filters[i].FilterType = Unknown;
   }
+  NumProbeCPUs = (NumCPUs > 0 ? NumCPUs : 1);
+}
+
+/*
+ * Runs of slots in the same function, defined by the instrumenter. See
+ * CheckInserter::createSlotRuns.
+ */
+extern const unsigned LoomSlotRuns[] __attribute__((weak));
+extern const unsigned LoomNumSlotRuns __attribute__((weak));
+
+static int HasSlotRuns() {
+  return &LoomNumSlotRuns != NULL && LoomNumSlotRuns > 0;
 }
 
+/*
+ * Returns the function slot <SlotID> is in, or -1 if the instruction has no
+ * slot, e.g. because it is in a blocking region. Requires LoomSlotRuns.
+ */
+static unsigned GetSlotFunc(unsigned SlotID) {
+  unsigned Low = 0, High = LoomNumSlotRuns;
+  /* Find the last run that starts at or before <SlotID>. */
+  while (High - Low > 1) {
+    unsigned Mid = Low + (High - Low) / 2;
+    if (LoomSlotRuns[2 * Mid] <= SlotID)
+      Low = Mid;
+    else
+      High = Mid;
+  }
+  return LoomSlotRuns[2 * Low + 1];
+}
+
+static int IsLoomFile(const char *FileName) {
+  size_t Length = strlen(FileName);
+  return Length >= 3 && strcmp(FileName + Length - 3, ".lm") == 0;
+}
+
+static int IsPatched(const struct Filter *F, unsigned FuncID) {
+  unsigned i;
+  for (i = 0; i < F->NumFuncsToPatch; ++i) {
+    if (F->FuncsToPatch[i] == FuncID)
+      return 1;
+  }
+  return 0;
+}
+
+/*
+ * Derives the functions to patch of a .lm file from LoomSlotRuns, the way
+ * loom_compile.py does from the bitcode.
+ */
+static int DeriveFuncsToPatch(struct Filter *F) {
+  unsigned i;
+  F->NumFuncsToPatch = 0;
+  F->FuncsToPatch = calloc(F->NumOps, sizeof(unsigned));
+  if (F->NumOps > 0 && F->FuncsToPatch == NULL)
+    return -1;
+  for (i = 0; i < F->NumOps; ++i) {
+    unsigned FuncID = GetSlotFunc(F->Ops[i].SlotID);
+    if (!IsPatched(F, FuncID))
+      F->FuncsToPatch[F->NumFuncsToPatch++] = FuncID;
+  }
+  return 0;
+}
+
+/*
+ * Reads a filter compiled by loom_compile.py (.filter), or a .lm file if the
+ * program is instrumented with the slot table. A .lm file may only refer to
+ * slots by IDs; <file>:<line> needs the location index, which only
+ * loom_compile.py reads. Every ID is checked against the program, which the
+ * filter may not be compiled against.
+ */
 static int ReadFilter(unsigned FilterID,
                       const char *FileName,
                       struct Filter *F) {
   FILE *FilterFile = NULL;
   int NumericFilterType;
+  int FromLoomFile = IsLoomFile(FileName);
   unsigned i;
 
   F->FilterType = Unknown;
   F->Ops = NULL;
+  F->Counters = NULL;
+  F->Interval = NULL;
   F->FuncsToPatch = NULL;
   F->UnsafeBackEdges = NULL;
   F->UnsafeCallSites = NULL;
+  F->Budget = 0;
+
+  if (FromLoomFile && !HasSlotRuns()) {
+    fprintf(stderr, "cannot read %s: the program has no slot table. "
+            "compile it with loom_compile.py\n", FileName);
+    return -1;
+  }
 
   FilterFile = fopen(FileName, "r");
   if (!FilterFile) {
@@ -109,13 +281,45 @@ static int ReadFilter(unsigned FilterID,
   if (fscanf(FilterFile, "%u", &F->NumOps) != 1)
     goto format_error;
   F->Ops = calloc(F->NumOps, sizeof(struct Operation));
-  // TODO: check the return value of calloc
+  if (F->NumOps > 0 && F->Ops == NULL)
+    goto out_of_memory;
+  if (F->FilterType == Probe && F->NumOps > 0) {
+    size_t Size = (size_t)F->NumOps * NumProbeCPUs *
+        sizeof(struct ProbeCounter);
+    if (posix_memalign((void **)&F->Counters, sizeof(struct ProbeCounter),
+                       Size) != 0) {
+      F->Counters = NULL;
+      goto out_of_memory;
+    }
+    memset(F->Counters, 0, Size);
+  }
+  if (F->FilterType == LatencyProbe) {
+    size_t Size = NumProbeCPUs * sizeof(struct IntervalHistogram);
+    F->Interval = malloc(sizeof(struct IntervalProbe));
+    if (F->Interval == NULL)
+      goto out_of_memory;
+    if (posix_memalign((void **)&F->Interval->Histograms,
+                       sizeof(struct IntervalHistogram), Size) != 0) {
+      free(F->Interval);
+      F->Interval = NULL;
+      goto out_of_memory;
+    }
+    memset(F->Interval->Histograms, 0, Size);
+    F->Interval->Serial = 0;
+  }
 
   for (i = 0; i < F->NumOps; ++i) {
     int EntryOrExit;
     unsigned SlotID;
     if (fscanf(FilterFile, "%d %u\n", &EntryOrExit, &SlotID) != 2)
       goto format_error;
+    /* The filter may be compiled against another program. */
+    if (SlotID >= LoomNumInsts)
+      goto format_error;
+    if (HasSlotRuns() && GetSlotFunc(SlotID) == (unsigned)-1) {
+      fprintf(stderr, "instruction %u has no slot\n", SlotID);
+      goto format_error;
+    }
     switch (F->FilterType) {
       case CriticalRegion:
         {
@@ -124,7 +328,23 @@ static int ReadFilter(unsigned FilterID,
                           EnterCriticalRegion :
                           ExitCriticalRegion);
           Op->Arg = (void *)(unsigned long)FilterID;
-          // TODO: check the range of SlotID
+          Op->SlotID = SlotID;
+        }
+        break;
+      case Probe:
+        {
+          /* Whether the operation is a start or an end does not matter. */
+          struct Operation *Op = &F->Ops[i];
+          Op->CallBack = HitProbe;
+          Op->Arg = F->Counters + (size_t)i * NumProbeCPUs;
+          Op->SlotID = SlotID;
+        }
+        break;
+      case LatencyProbe:
+        {
+          struct Operation *Op = &F->Ops[i];
+          Op->CallBack = (EntryOrExit == 0 ? StartInterval : EndInterval);
+          Op->Arg = F->Interval;
           Op->SlotID = SlotID;
         }
         break;
@@ -133,40 +353,82 @@ static int ReadFilter(unsigned FilterID,
     }
   }
 
+  if (FromLoomFile) {
+    if (DeriveFuncsToPatch(F) == -1)
+      goto out_of_memory;
+    /* As loom_compile.py, report no unsafe back edges or call sites. */
+    F->NumUnsafeBackEdges = 0;
+    F->NumUnsafeCallSites = 0;
+    fclose(FilterFile);
+    return 0;
+  }
+
   if (fscanf(FilterFile, "%u", &F->NumFuncsToPatch) != 1)
     goto format_error;
   F->FuncsToPatch = calloc(F->NumFuncsToPatch, sizeof(unsigned));
-  // TODO: check the return value of calloc
+  if (F->NumFuncsToPatch > 0 && F->FuncsToPatch == NULL)
+    goto out_of_memory;
 
   for (i = 0; i < F->NumFuncsToPatch; ++i) {
-    if (fscanf(FilterFile, "%u", &F->FuncsToPatch[i]) != 1)
+    unsigned Hash;
+    if (fscanf(FilterFile, "%u %u", &F->FuncsToPatch[i], &Hash) != 2 ||
+        F->FuncsToPatch[i] >= LoomNumFuncs)
       goto format_error;
+    /* An edit shifted the slot IDs of the function since. */
+    if (Hash != LoomFuncHashes[F->FuncsToPatch[i]]) {
+      fprintf(stderr, "%s is compiled against another build: function %u "
+              "has changed. recompile it\n", FileName, F->FuncsToPatch[i]);
+      goto error;
+    }
+  }
+  /* Operations in unpatched functions would never run. */
+  if (HasSlotRuns()) {
+    for (i = 0; i < F->NumOps; ++i) {
+      if (!IsPatched(F, GetSlotFunc(F->Ops[i].SlotID))) {
+        fprintf(stderr, "the function of slot %u is not patched\n",
+                F->Ops[i].SlotID);
+        goto format_error;
+      }
+    }
   }
 
   if (fscanf(FilterFile, "%u", &F->NumUnsafeBackEdges) != 1)
     goto format_error;
   F->UnsafeBackEdges = calloc(F->NumUnsafeBackEdges, sizeof(unsigned));
-  // TODO: check the return value of calloc
+  if (F->NumUnsafeBackEdges > 0 && F->UnsafeBackEdges == NULL)
+    goto out_of_memory;
   for (i = 0; i < F->NumUnsafeBackEdges; ++i) {
-    if (fscanf(FilterFile, "%u", &F->UnsafeBackEdges[i]) != 1)
+    if (fscanf(FilterFile, "%u", &F->UnsafeBackEdges[i]) != 1 ||
+        F->UnsafeBackEdges[i] >= LoomNumBackEdges)
       goto format_error;
   }
 
   if (fscanf(FilterFile, "%u", &F->NumUnsafeCallSites) != 1)
     goto format_error;
   F->UnsafeCallSites = calloc(F->NumUnsafeCallSites, sizeof(unsigned));
-  // TODO: check the return value of calloc
+  if (F->NumUnsafeCallSites > 0 && F->UnsafeCallSites == NULL)
+    goto out_of_memory;
   for (i = 0; i < F->NumUnsafeCallSites; ++i) {
-    if (fscanf(FilterFile, "%u", &F->UnsafeCallSites[i]) != 1)
+    if (fscanf(FilterFile, "%u", &F->UnsafeCallSites[i]) != 1 ||
+        F->UnsafeCallSites[i] >= LoomNumBlockingCS)
       goto format_error;
   }
 
   fclose(FilterFile);
   return 0;
 
+out_of_memory:
+  fprintf(stderr, "out of memory when reading filter file %s\n", FileName);
+  goto error;
 format_error:
   fprintf(stderr, "wrong format in filter file %s\n", FileName);
+error:
   if (F->Ops) free(F->Ops);
+  if (F->Counters) free(F->Counters);
+  if (F->Interval) {
+    free(F->Interval->Histograms);
+    free(F->Interval);
+  }
   if (F->FuncsToPatch) free(F->FuncsToPatch);
   if (F->UnsafeBackEdges) free(F->UnsafeBackEdges);
   if (F->UnsafeCallSites) free(F->UnsafeCallSites);
@@ -174,26 +436,222 @@ format_error:
   return -1;
 }
 
-static void Evacuate(const unsigned *UnsafeBackEdges,
-                     unsigned NumUnsafeBackEdges,
-                     const unsigned *UnsafeCallSites,
-                     unsigned NumUnsafeCallSites) {
+static long ElapsedMilliseconds(const struct timespec *Start,
+                                const struct timespec *End) {
+  return (End->tv_sec - Start->tv_sec) * 1000 +
+      (End->tv_nsec - Start->tv_nsec) / 1000000;
+}
+
+/* Messages are dropped while the daemon is not connected. */
+static int SendToController(const char *M) {
+  if (CtrlSock == -1)
+    return -1;
+  return SendTaggedMessage(CtrlSock, CurrentTag, M);
+}
+
+/*
+ * Queues a command that arrives during an update. Answers right away if the
+ * queue is full.
+ */
+static void QueueCommand(unsigned Tag, const char *Cmd) {
+  struct QueuedCommand *Q;
+  if (QueueLength == MaxQueuedCommands) {
+    SendTaggedMessage(CtrlSock, Tag, "the daemon is busy");
+    return;
+  }
+  Q = &QueuedCommands[(QueueHead + QueueLength) % MaxQueuedCommands];
+  Q->Tag = Tag;
+  strcpy(Q->Cmd, Cmd);
+  ++QueueLength;
+}
+
+/*
+ * Checks whether the controller asked to cancel the ongoing update. Other
+ * commands are queued.
+ */
+static int IsCancelled() {
+  struct pollfd PFD;
+  char Buffer[MaxBufferSize];
+  unsigned Tag;
+  PFD.fd = CtrlSock;
+  PFD.events = POLLIN;
+  while (poll(&PFD, 1, 0) == 1) {
+    if (ReceiveTaggedMessage(CtrlSock, &Tag, Buffer) == -1)
+      return 0;
+    if (strcmp(Buffer, "cancel") == 0)
+      return 1;
+    QueueCommand(Tag, Buffer);
+  }
+  return 0;
+}
+
+static int PrintThreadState(char *Buffer, const struct ThreadInfo *T) {
+  unsigned Arg = GetThreadStateArg(T);
+  switch (GetThreadState(T)) {
+    case ThreadRunning:
+      return sprintf(Buffer, "running");
+    case ThreadBlocking:
+      return sprintf(Buffer, "blocking at call site %u", Arg);
+    case ThreadParked:
+      return sprintf(Buffer, "parked at back edge %u", Arg);
+    case ThreadSlowPath:
+      return sprintf(Buffer, "in the slow path of function %u", Arg);
+    case ThreadPreempted:
+      return sprintf(Buffer, "preempted");
+  }
+  return sprintf(Buffer, "unknown");
+}
+
+static int IsUnsafeCallSite(unsigned CallSiteID,
+                            const unsigned *UnsafeCallSites,
+                            unsigned NumUnsafeCallSites) {
+  unsigned i;
+  for (i = 0; i < NumUnsafeCallSites; ++i) {
+    if (UnsafeCallSites[i] == CallSiteID)
+      return 1;
+  }
+  return 0;
+}
+
+/*
+ * Describes what an evacuation is waiting for. Threads that are running or in
+ * the slow path hold LoomUpdateLock, and threads blocking at unsafe call sites
+ * must leave them first.
+ */
+static void DescribeStall(char *Message,
+                          const unsigned *UnsafeCallSites,
+                          unsigned NumUnsafeCallSites,
+                          long Elapsed) {
+  struct ThreadInfo Threads[MaxListedThreads];
+  unsigned NumThreads = ListThreads(Threads, MaxListedThreads);
   unsigned i;
+  int Printed = sprintf(Message, "evacuating for %ld ms.", Elapsed);
+  int Occupied = 0, Culprits = 0;
+  for (i = 0; i < NumUnsafeCallSites; ++i) {
+    if (LoomCounter[UnsafeCallSites[i]] > 0) {
+      /* Leave room for the trailing "...". */
+      if (Printed + 16 >= MaxBufferSize) {
+        Printed += sprintf(Message + Printed, " ...");
+        break;
+      }
+      if (!Occupied)
+        Printed += sprintf(Message + Printed, " occupied call sites:");
+      Printed += sprintf(Message + Printed, " %u", UnsafeCallSites[i]);
+      Occupied = 1;
+    }
+  }
+  for (i = 0; i < NumThreads; ++i) {
+    enum ThreadState State = GetThreadState(&Threads[i]);
+    if (State == ThreadParked || State == ThreadPreempted)
+      continue;
+    if (State == ThreadBlocking &&
+        !IsUnsafeCallSite(GetThreadStateArg(&Threads[i]),
+                          UnsafeCallSites, NumUnsafeCallSites))
+      continue;
+    /* Leave room for the longest state and the trailing "...". */
+    if (Printed + 64 >= MaxBufferSize) {
+      Printed += sprintf(Message + Printed, " ...");
+      break;
+    }
+    Printed += sprintf(Message + Printed, "%s %d (",
+                       Culprits ? "," : " culprits:", (int)Threads[i].TID);
+    Printed += PrintThreadState(Message + Printed, &Threads[i]);
+    Printed += sprintf(Message + Printed, ")");
+    Culprits = 1;
+  }
+  if (!Occupied && !Culprits)
+    sprintf(Message + Printed, " waiting for running threads");
+}
+
+/*
+ * Sends an interim message, which starts with '+', to the controller. The
+ * controller keeps waiting for the final response.
+ */
+static void ReportProgress(const unsigned *UnsafeCallSites,
+                           unsigned NumUnsafeCallSites,
+                           long Elapsed) {
+  char Message[MaxBufferSize];
+  Message[0] = '+';
+  DescribeStall(Message + 1, UnsafeCallSites, NumUnsafeCallSites, Elapsed);
+  SendToController(Message);
+}
+
+static void ClearWaitFlags() {
+  unsigned i;
+  for (i = 0; i < LoomNumFuncs; ++i)
+    LoomFuncStates[i] &= ~LoomPending;
+  memset((void *)LoomWait, 0, LoomNumBackEdges * sizeof(int));
+}
+
+/*
+ * Returns 0 with LoomUpdateLock held once no thread is running or blocked in
+ * any unsafe part of the program. Returns -1 without holding LoomUpdateLock if
+ * the evacuation times out after <Timeout> milliseconds or is cancelled. A
+ * timeout of 0 waits forever.
+ */
+static int Evacuate(const unsigned *UnsafeBackEdges,
+                    unsigned NumUnsafeBackEdges,
+                    const unsigned *UnsafeCallSites,
+                    unsigned NumUnsafeCallSites,
+                    unsigned Timeout) {
+  unsigned i;
+  struct timespec Start, LastReport;
   /* Turn on wait flags for all safe back edges. */
-  int Unsafe[MaxNumBackEdges];
-  memset(Unsafe, 0, sizeof(Unsafe));
+  for (i = 0; i < LoomNumBackEdges; ++i)
+    LoomWait[i] = 1;
   for (i = 0; i < NumUnsafeBackEdges; ++i)
-    Unsafe[UnsafeBackEdges[i]] = 1;
-  for (i = 0; i < MaxNumBackEdges; ++i) {
-    if (!Unsafe[i])
-      LoomWait[i] = 1;
-  }
+    LoomWait[UnsafeBackEdges[i]] = 0;
+  /* Make instrumented back edges call LoomBackEdge, which checks LoomWait. */
+  for (i = 0; i < LoomNumFuncs; ++i)
+    LoomFuncStates[i] |= LoomPending;
 
+  clock_gettime(CLOCK_REALTIME, &Start);
+  LastReport = Start;
   /* Make sure nobody is running inside an unsafe call site. */
   while (1) {
     int InBlockingCallSite = 0;
-    unsigned i;
-    pthread_rwlock_wrlock(&LoomUpdateLock);
+    struct timespec Now;
+    long Elapsed;
+    unsigned Slice;
+
+    clock_gettime(CLOCK_REALTIME, &Now);
+    Elapsed = ElapsedMilliseconds(&Start, &Now);
+    if (Timeout > 0 && Elapsed >= (long)Timeout) {
+      char Message[MaxBufferSize];
+      DescribeStall(Message, UnsafeCallSites, NumUnsafeCallSites, Elapsed);
+      fprintf(stderr, "evacuation timed out: %s\n", Message);
+      ReportProgress(UnsafeCallSites, NumUnsafeCallSites, Elapsed);
+      SendToController("+evacuation timed out. roll back");
+      break;
+    }
+    if (IsCancelled()) {
+      SendToController("+evacuation cancelled. roll back");
+      break;
+    }
+    if (ElapsedMilliseconds(&LastReport, &Now) >= ProgressInterval) {
+      ReportProgress(UnsafeCallSites, NumUnsafeCallSites, Elapsed);
+      LastReport = Now;
+    }
+
+    /*
+     * LoomUpdateLock prefers us, so threads arriving at checks wait for us
+     * instead of starving us. Wait in slices, so that we can check the
+     * deadline and cancellation.
+     */
+    if (Timeout > 0 && (long)Timeout - Elapsed < LockSlice)
+      Slice = (long)Timeout - Elapsed;
+    else
+      Slice = LockSlice;
+    if (LockForUpdate(Slice) != 0) {
+      /*
+       * Preempt threads lagging in uninstrumented code. A library call may
+       * come from an unsafe call site or loop, which we cannot tell.
+       */
+      if (LoomPreemptDelay >= 0 && Elapsed >= LoomPreemptDelay &&
+          NumUnsafeBackEdges == 0 && NumUnsafeCallSites == 0)
+        PreemptThreads();
+      continue;
+    }
     for (i = 0; i < NumUnsafeCallSites; ++i) {
       if (LoomCounter[UnsafeCallSites[i]] > 0) {
         InBlockingCallSite = 1;
@@ -201,72 +659,344 @@ static void Evacuate(const unsigned *UnsafeBackEdges,
       }
     }
     if (!InBlockingCallSite) {
-      break;
+      return 0;
     }
-    pthread_rwlock_unlock(&LoomUpdateLock);
+    UnlockAfterUpdate();
+    /*
+     * Let threads leaving the unsafe call sites take LoomUpdateLock in
+     * LoomAfterBlocking.
+     */
+    usleep(1000);
   }
+
+  ClearWaitFlags();
+  return -1;
 }
 
 static void Resume() {
   /* Restore wait flags and counters. */
-  memset((void *)LoomWait, 0, sizeof(LoomWait));
+  ClearWaitFlags();
   /* Resume application threads. */
-  pthread_rwlock_unlock(&LoomUpdateLock);
+  UnlockAfterUpdate();
 }
 
-static int AddFilter(unsigned FilterID, const char *FileName) {
-  struct Filter F;
+/*
+ * An update can avoid stopping the world if activations are counted and the
+ * filter has no unsafe back edges or call sites, which may be anywhere.
+ */
+static int CanQuiesce(const struct Filter *F) {
+  return LoomActivations != NULL && !ActivationsInherited &&
+      F->NumFuncsToPatch > 0 &&
+      F->NumUnsafeBackEdges == 0 && F->NumUnsafeCallSites == 0;
+}
+
+static void OpenGates(const struct Filter *F) {
   unsigned i;
-  assert(FilterID < MaxNumFilters);
-  if (Filters[FilterID].FilterType != Unknown) {
-    fprintf(stderr, "filter %u already exists\n", FilterID);
-    return -1;
+  /* Publish the update before any thread passes a gate. */
+  __sync_synchronize();
+  for (i = 0; i < F->NumFuncsToPatch; ++i)
+    LoomFuncStates[F->FuncsToPatch[i]] &= ~LoomGated;
+}
+
+/*
+ * Stops only the threads entering the functions <F> patches, and waits for
+ * the running activations of these functions to finish. Returns 0 with the
+ * gates closed once no activation is left. Returns -1 with the gates open if
+ * some activation lasts longer than QuiescenceTimeout, and stores the ID of
+ * the busy function to <BusyFuncID>.
+ */
+static int Quiesce(const struct Filter *F, unsigned *BusyFuncID) {
+  unsigned i;
+  uint64_t Start = MonotonicTime();
+  for (i = 0; i < F->NumFuncsToPatch; ++i)
+    LoomFuncStates[F->FuncsToPatch[i]] |= LoomGated;
+  /* Pairs with the atomic increment at function entries. */
+  __sync_synchronize();
+  while (1) {
+    int Busy = 0;
+    for (i = 0; i < F->NumFuncsToPatch; ++i) {
+      if (LoomActivations[F->FuncsToPatch[i]] > 0) {
+        *BusyFuncID = F->FuncsToPatch[i];
+        Busy = 1;
+        break;
+      }
+    }
+    if (!Busy)
+      return 0;
+    if (MonotonicTime() - Start >= (uint64_t)QuiescenceTimeout * 1000000)
+      break;
+    usleep(1000);
   }
+  OpenGates(F);
+  return -1;
+}
 
-  if (ReadFilter(FilterID, FileName, &F) == -1)
-    return -1;
+/*
+ * Makes sure no thread runs the code <F> affects. Waits only for the threads
+ * running the functions <F> patches if possible, and evacuates all threads
+ * otherwise. Sets <Targeted> to tell ResumeThreads which way is taken.
+ */
+static int StopThreads(const struct Filter *F,
+                       unsigned Timeout,
+                       int *Targeted) {
+  *Targeted = 0;
+  if (CanQuiesce(F)) {
+    unsigned BusyFuncID;
+    char Message[MaxBufferSize];
+    if (Quiesce(F, &BusyFuncID) == 0) {
+      *Targeted = 1;
+      return 0;
+    }
+    /*
+     * Either an activation is really long, or a longjmp or an exception
+     * through code without landing pads left it uncounted.
+     */
+    snprintf(Message, sizeof(Message),
+             "+activation count of function %u stuck at %u for %d ms. "
+             "evacuate all threads",
+             BusyFuncID, (unsigned)LoomActivations[BusyFuncID],
+             QuiescenceTimeout);
+    SendToController(Message);
+  }
+  return Evacuate(F->UnsafeBackEdges, F->NumUnsafeBackEdges,
+                  F->UnsafeCallSites, F->NumUnsafeCallSites,
+                  Timeout);
+}
+
+static void ResumeThreads(const struct Filter *F, int Targeted) {
+  if (Targeted)
+    OpenGates(F);
+  else
+    Resume();
+}
 
-  Evacuate(F.UnsafeBackEdges, F.NumUnsafeBackEdges,
-           F.UnsafeCallSites, F.NumUnsafeCallSites);
+static void FreeFilter(struct Filter *F) {
+  free(F->Ops);
+  free(F->Counters);
+  if (F->Interval) {
+    free(F->Interval->Histograms);
+    free(F->Interval);
+  }
+  free(F->FuncsToPatch);
+  free(F->UnsafeBackEdges);
+  free(F->UnsafeCallSites);
+}
+
+/* The caller must make sure no thread is running the affected code. */
+static void InstallFilter(unsigned FilterID, struct Filter *F) {
+  unsigned i;
 
   // Switch the functions to be patched to the slow path.
-  for (i = 0; i < F.NumFuncsToPatch; ++i) {
-    assert(F.FuncsToPatch[i] < MaxNumFuncs);
-    LoomSwitches[F.FuncsToPatch[i]] = 1;
+  for (i = 0; i < F->NumFuncsToPatch; ++i) {
+    LoomFuncStates[F->FuncsToPatch[i]] |= LoomPatched;
   }
 
-  switch (F.FilterType) {
+  switch (F->FilterType) {
     case CriticalRegion:
       pthread_mutex_init(&Mutexes[FilterID], NULL);
-      for (i = 0; i < F.NumOps; ++i) {
-        PrependOperation(&F.Ops[i], &LoomOperations[F.Ops[i].SlotID]);
+      memset(&LockStats[FilterID], 0, sizeof(struct LockStats));
+      for (i = 0; i < F->NumOps; ++i) {
+        PrependOperation(&F->Ops[i], &LoomOperations[F->Ops[i].SlotID]);
+      }
+      break;
+    case Probe:
+    case LatencyProbe:
+      /* ls reports zero lock statistics for it. */
+      memset(&LockStats[FilterID], 0, sizeof(struct LockStats));
+      if (F->Interval)
+        F->Interval->Serial = ++LastIntervalSerial;
+      for (i = 0; i < F->NumOps; ++i) {
+        PrependOperation(&F->Ops[i], &LoomOperations[F->Ops[i].SlotID]);
+      }
+      break;
+    case ShadowRegion:
+      pthread_mutex_init(&Mutexes[FilterID], NULL);
+      memset(&LockStats[FilterID], 0, sizeof(struct LockStats));
+      memset(&ShadowStats[FilterID], 0, sizeof(struct ShadowStats));
+      ShadowStats[FilterID].InstalledAt = MonotonicTime();
+      ShadowStats[FilterID].LastChange = ShadowStats[FilterID].InstalledAt;
+      for (i = 0; i < F->NumOps; ++i) {
+        PrependOperation(&F->Ops[i], &LoomOperations[F->Ops[i].SlotID]);
       }
       break;
     default:
       assert(0 && "should be already handled in ReadFilter");
   }
 
-  Filters[FilterID] = F;
+  Filters[FilterID] = *F;
+}
+
+/*
+ * Turns critical-region filter <F> into a shadow filter, whose operations
+ * count how often the region would be entered and contended instead of
+ * locking.
+ */
+static int ShadowFilter(struct Filter *F) {
+  unsigned i;
+  if (F->FilterType != CriticalRegion) {
+    fprintf(stderr, "only critical regions can be shadowed\n");
+    return -1;
+  }
+  F->FilterType = ShadowRegion;
+  for (i = 0; i < F->NumOps; ++i) {
+    struct Operation *Op = &F->Ops[i];
+    Op->CallBack = (Op->CallBack == EnterCriticalRegion ?
+                    EnterShadowRegion :
+                    ExitShadowRegion);
+  }
+  return 0;
+}
+
+static void SleepMilliseconds(unsigned Milliseconds) {
+  struct timespec T;
+  T.tv_sec = Milliseconds / 1000;
+  T.tv_nsec = (long)(Milliseconds % 1000) * 1000000;
+  while (nanosleep(&T, &T) == -1 && errno == EINTR);
+}
 
-  Resume();
+static const struct ProgressSample *GetProgressSample(unsigned Age) {
+  return &ProgressSamples[(NextProgressSample + MaxProgressSamples - 1 - Age) %
+                          MaxProgressSamples];
+}
+
+/* Samples LoomProgress if the last sample is ProgressSampleInterval old. */
+static void SampleProgress() {
+  uint64_t Now = MonotonicTime();
+  struct ProgressSample *S;
+  if (!LoomProgress)
+    return;
+  if (NumProgressSamples > 0 &&
+      Now < GetProgressSample(0)->Time +
+      (uint64_t)ProgressSampleInterval * 1000000)
+    return;
+  S = &ProgressSamples[NextProgressSample];
+  S->Time = Now;
+  S->Progress = LoomProgress();
+  NextProgressSample = (NextProgressSample + 1) % MaxProgressSamples;
+  if (NumProgressSamples < MaxProgressSamples)
+    ++NumProgressSamples;
+}
+
+/*
+ * Returns the progress per millisecond in the last <Window> milliseconds, or
+ * in as much of them as the samples cover. Returns -1 if there is no sample
+ * yet.
+ */
+static double MeasureProgressRate(unsigned Window) {
+  char Message[MaxBufferSize];
+  uint64_t Now = MonotonicTime();
+  unsigned long Progress = LoomProgress();
+  const struct ProgressSample *S = NULL;
+  unsigned Age;
+  /* Take the newest sample at least <Window> old, or else the oldest. */
+  for (Age = 0; Age < NumProgressSamples; ++Age) {
+    S = GetProgressSample(Age);
+    if (S->Time + (uint64_t)Window * 1000000 <= Now)
+      break;
+  }
+  if (S == NULL || S->Time >= Now)
+    return -1;
+  sprintf(Message, "+measured the progress rate in the last %u ms",
+          (unsigned)((Now - S->Time) / 1000000));
+  SendToController(Message);
+  return (double)(Progress - S->Progress) * 1000000 / (Now - S->Time);
+}
+
+/*
+ * Returns the overhead of a watched filter in percent. If the application
+ * defines LoomProgress, it is how much the progress rate dropped since the
+ * filter was installed. Otherwise, it is the time threads spent waiting for
+ * the filter's lock, relative to the time since the filter was installed.
+ */
+static double MeasureOverhead(unsigned FilterID) {
+  const struct Filter *F = &Filters[FilterID];
+  uint64_t Elapsed = MonotonicTime() - F->InstalledAt + 1;
+  if (LoomProgress) {
+    double Rate = (double)(LoomProgress() - F->ProgressAtInstall) * 1000000 /
+        Elapsed;
+    if (F->BaselineRate <= 0)
+      return 0;
+    return (F->BaselineRate - Rate) * 100 / F->BaselineRate;
+  }
+  return (double)LockStats[FilterID].WaitTime * 100 / Elapsed;
+}
+
+static int AddFilter(unsigned FilterID,
+                     const char *FileName,
+                     unsigned Timeout,
+                     unsigned Budget,
+                     unsigned Window,
+                     int Shadow) {
+  struct Filter F;
+  double BaselineRate = 0;
+  int Targeted;
+  assert(FilterID < MaxNumFilters);
+  if (Filters[FilterID].FilterType != Unknown) {
+    fprintf(stderr, "filter %u already exists\n", FilterID);
+    return -1;
+  }
+
+  if (ReadFilter(FilterID, FileName, &F) == -1)
+    return -1;
+
+  if (Shadow && ShadowFilter(&F) == -1) {
+    FreeFilter(&F);
+    return -1;
+  }
+
+  if (Budget > 0) {
+    if (LoomProgress) {
+      BaselineRate = MeasureProgressRate(Window);
+      if (BaselineRate < 0) {
+        /* The daemon has just started. */
+        SendToController("+no progress rate to compare with yet. "
+                         "the filter is not watched");
+        Budget = 0;
+      }
+    } else if (F.FilterType != CriticalRegion) {
+      fprintf(stderr, "no progress signal to watch filter %u\n", FilterID);
+      FreeFilter(&F);
+      return -1;
+    }
+  }
+
+  if (StopThreads(&F, Timeout, &Targeted) == -1) {
+    FreeFilter(&F);
+    return -1;
+  }
+
+  InstallFilter(FilterID, &F);
+
+  ResumeThreads(&F, Targeted);
+
+  /*
+   * Call LoomProgress after resuming threads, because it may take a lock held
+   * by a stopped thread.
+   */
+  if (Budget > 0) {
+    struct Filter *Installed = &Filters[FilterID];
+    Installed->Budget = Budget;
+    Installed->Window = Window;
+    Installed->BaselineRate = BaselineRate;
+    Installed->ProgressAtInstall = (LoomProgress ? LoomProgress() : 0);
+    Installed->InstalledAt = MonotonicTime();
+  }
 
   return 0;
 }
 
+/* The caller frees <F> afterwards. */
 static void EraseFilter(struct Filter *F) {
   unsigned i;
   assert(F->FilterType != Unknown);
   F->FilterType = Unknown;
   for (i = 0; i < F->NumOps; ++i)
     UnlinkOperation(&F->Ops[i], &LoomOperations[F->Ops[i].SlotID]);
-  free(F->Ops);
-  free(F->FuncsToPatch);
-  free(F->UnsafeBackEdges);
-  free(F->UnsafeCallSites);
 }
 
-static int DeleteFilter(unsigned FilterID) {
+static int DeleteFilter(unsigned FilterID, unsigned Timeout) {
   struct Filter *F = &Filters[FilterID];
+  int Targeted;
 
   assert(FilterID < MaxNumFilters);
   if (F->FilterType == Unknown) {
@@ -274,27 +1004,130 @@ static int DeleteFilter(unsigned FilterID) {
     return -1;
   }
 
-  Evacuate(F->UnsafeBackEdges, F->NumUnsafeBackEdges,
-           F->UnsafeCallSites, F->NumUnsafeCallSites);
+  if (StopThreads(F, Timeout, &Targeted) == -1)
+    return -1;
 
   // TODO: We could switch functions back to the slow path if we kept track of
   // how many filters are patching each function.
 
   switch (F->FilterType) {
     case CriticalRegion:
+    case ShadowRegion:
       pthread_mutex_destroy(&Mutexes[FilterID]);
       break;
+    case Probe:
+    case LatencyProbe:
+      break;
     default:
       fprintf(stderr, "unknown filter type\n");
       return -1;
   }
   EraseFilter(F);
 
-  Resume();
+  /* Open the gates before freeing the list of patched functions. */
+  ResumeThreads(F, Targeted);
+  FreeFilter(F);
 
   return 0;
 }
 
+/*
+ * Deletes the watched filters that exceed their budgets when their windows
+ * end, and reports the rollbacks to the controller as interim messages, which
+ * start with '+', so that a waiting controller client keeps waiting.
+ */
+static void CheckWatchdogs() {
+  unsigned i;
+  uint64_t Now = MonotonicTime();
+  /* Nobody asked for these messages. */
+  CurrentTag = 0;
+  for (i = 0; i < MaxNumFilters; ++i) {
+    struct Filter *F = &Filters[i];
+    char Message[MaxBufferSize];
+    unsigned Budget;
+    double Overhead;
+    if (F->FilterType == Unknown || F->Budget == 0 ||
+        Now < F->InstalledAt + (uint64_t)F->Window * 1000000)
+      continue;
+    Budget = F->Budget;
+    Overhead = MeasureOverhead(i);
+    F->Budget = 0;
+    if (Overhead <= Budget) {
+      fprintf(stderr, "filter %u is within its budget: overhead = %.1f%%\n",
+              i, Overhead);
+      continue;
+    }
+    if (DeleteFilter(i, DefaultEvacuationTimeout) == -1) {
+      sprintf(Message, "+the watchdog failed to delete filter %u: "
+              "overhead = %.1f%%, budget = %u%%", i, Overhead, Budget);
+    } else {
+      sprintf(Message, "+filter %u is successfully deleted by the watchdog: "
+              "overhead = %.1f%%, budget = %u%%", i, Overhead, Budget);
+    }
+    SendToController(Message);
+  }
+}
+
+/*
+ * Returns how many milliseconds the daemon may wait before it checks the
+ * watchdogs or samples LoomProgress, or -1 if it has neither to do.
+ */
+static int NextWatchdogTimeout() {
+  unsigned i;
+  uint64_t Now = MonotonicTime();
+  int Timeout = -1;
+  if (LoomProgress) {
+    uint64_t Deadline = (NumProgressSamples == 0 ? Now :
+                         GetProgressSample(0)->Time +
+                         (uint64_t)ProgressSampleInterval * 1000000);
+    Timeout = (Deadline > Now ? (Deadline - Now + 999999) / 1000000 : 0);
+  }
+  for (i = 0; i < MaxNumFilters; ++i) {
+    const struct Filter *F = &Filters[i];
+    uint64_t Deadline;
+    int Remaining;
+    if (F->FilterType == Unknown || F->Budget == 0)
+      continue;
+    Deadline = F->InstalledAt + (uint64_t)F->Window * 1000000;
+    Remaining = (Deadline > Now ? (Deadline - Now + 999999) / 1000000 : 0);
+    if (Timeout == -1 || Remaining < Timeout)
+      Timeout = Remaining;
+  }
+  return Timeout;
+}
+
+/* Reads argv[0], which is not truncated to 15 characters like comm. */
+static void GetProgramName(char *Name, size_t Size) {
+  FILE *CmdLine = fopen("/proc/self/cmdline", "r");
+  Name[0] = '\0';
+  if (CmdLine == NULL)
+    return;
+  if (fgets(Name, Size, CmdLine) == NULL)
+    Name[0] = '\0';
+  fclose(CmdLine);
+}
+
+/* Lists the registered application threads and their states. */
+static void PrintThreads(char *Response) {
+  struct ThreadInfo Threads[MaxListedThreads];
+  unsigned NumThreads = ListThreads(Threads, MaxListedThreads);
+  char ProgramName[256];
+  unsigned i;
+  int Printed;
+  GetProgramName(ProgramName, sizeof ProgramName);
+  Printed = sprintf(Response, "process %d %s\nTID\tstate", getpid(),
+                    ProgramName);
+  for (i = 0; i < NumThreads; ++i) {
+    /* Leave room for the longest state and the trailing "\n...". */
+    if (Printed + 64 >= MaxBufferSize) {
+      sprintf(Response + Printed, "\n...");
+      break;
+    }
+    Printed += sprintf(Response + Printed, "\n%d\t", (int)Threads[i].TID);
+    Printed += PrintThreadState(Response + Printed, &Threads[i]);
+  }
+}
+
 static unsigned ListFilters(unsigned *FilterIDs, unsigned MaxLen) {
   unsigned i;
   unsigned Len = 0;
@@ -310,13 +1143,286 @@ static unsigned ListFilters(unsigned *FilterIDs, unsigned MaxLen) {
   return Len;
 }
 
+static int PrintHistogram(char *Buffer, const unsigned long *Histogram) {
+  int Printed = 0;
+  int Last = NumLockStatBuckets - 1;
+  int i;
+  /* Omit trailing empty buckets. */
+  while (Last > 0 && Histogram[Last] == 0)
+    --Last;
+  for (i = 0; i <= Last; ++i)
+    Printed += sprintf(Buffer + Printed, "%s%lu", i ? "," : "", Histogram[i]);
+  return Printed;
+}
+
+/*
+ * Reports the lock statistics of all filters, one filter per line:
+ * <filter ID> <acquisitions> <contended> <owner TID or 0> <wait histogram>
+ * <hold histogram>. Each histogram lists its bucket counts separated by
+ * commas. Filters other than critical regions report zeros. The controller
+ * parses and aggregates them.
+ */
+static void ListLockStats(char *Response) {
+  unsigned i;
+  int Printed = sprintf(Response, "lockstats");
+  for (i = 0; i < MaxNumFilters; ++i) {
+    const struct LockStats *Stats = &LockStats[i];
+    char Line[MaxBufferSize];
+    int Len;
+    if (Filters[i].FilterType == Unknown)
+      continue;
+    /* Each histogram takes at most 21 characters per bucket. */
+    assert(64 + NumLockStatBuckets * 21 * 2 < MaxBufferSize);
+    Len = sprintf(Line, "\n%u %lu %lu %d ",
+                  i, Stats->NumAcquisitions, Stats->NumContended,
+                  (int)Stats->Owner);
+    Len += PrintHistogram(Line + Len, Stats->WaitHistogram);
+    Line[Len++] = ' ';
+    Len += PrintHistogram(Line + Len, Stats->HoldHistogram);
+    Line[Len] = '\0';
+    /* Leave room for the trailing "\n...". */
+    if (Printed + Len + 5 >= MaxBufferSize) {
+      sprintf(Response + Printed, "\n...");
+      break;
+    }
+    strcpy(Response + Printed, Line);
+    Printed += Len;
+  }
+}
+
+/*
+ * Reports what the shadow filters would cost if they were installed for real,
+ * one filter per line.
+ */
+static void ListShadowStats(char *Response) {
+  unsigned i;
+  uint64_t Now = MonotonicTime();
+  int Printed = sprintf(Response, "ID\tentries\tentries/s\toverlapping"
+                        "\tmax inside\test. wait (ms)\test. wait/entry (us)");
+  for (i = 0; i < MaxNumFilters; ++i) {
+    struct ShadowStats Stats;
+    char Line[MaxBufferSize];
+    double Elapsed;
+    int Len;
+    if (Filters[i].FilterType != ShadowRegion)
+      continue;
+    pthread_mutex_lock(&Mutexes[i]);
+    Stats = ShadowStats[i];
+    pthread_mutex_unlock(&Mutexes[i]);
+    /* Count the threads waiting right now. */
+    if (Stats.Occupancy > 1)
+      Stats.EstimatedWaitTime += (Now - Stats.LastChange) *
+          (Stats.Occupancy - 1);
+    Elapsed = (double)(Now - Stats.InstalledAt + 1) / 1000000000;
+    Len = sprintf(Line, "\n%u\t%lu\t%.1f\t%lu\t%u\t%.1f\t%.1f",
+                  i, Stats.NumEntries, Stats.NumEntries / Elapsed,
+                  Stats.NumOverlapping, Stats.MaxOccupancy,
+                  Stats.EstimatedWaitTime / 1000000.0,
+                  (Stats.NumEntries ?
+                   Stats.EstimatedWaitTime / 1000.0 / Stats.NumEntries : 0));
+    /* Leave room for the trailing "\n...". */
+    if (Printed + Len + 5 >= MaxBufferSize) {
+      sprintf(Response + Printed, "\n...");
+      break;
+    }
+    strcpy(Response + Printed, Line);
+    Printed += Len;
+  }
+}
+
+/*
+ * Reports the hits of each probe, one slot per line, summed over the CPUs.
+ * Reading the counters does not stop the threads.
+ */
+static void ListProbes(char *Response) {
+  unsigned i, j, k;
+  int Printed = sprintf(Response, "ID\tslot\thits");
+  for (i = 0; i < MaxNumFilters; ++i) {
+    const struct Filter *F = &Filters[i];
+    if (F->FilterType != Probe)
+      continue;
+    for (j = 0; j < F->NumOps; ++j) {
+      const struct ProbeCounter *Counters = F->Ops[j].Arg;
+      unsigned long Hits = 0;
+      for (k = 0; k < NumProbeCPUs; ++k)
+        Hits += Counters[k].Hits;
+      /* Leave room for this line and the trailing "\n...". */
+      if (Printed + 64 >= MaxBufferSize) {
+        sprintf(Response + Printed, "\n...");
+        return;
+      }
+      Printed += sprintf(Response + Printed, "\n%u\t%u\t%lu",
+                         i, F->Ops[j].SlotID, Hits);
+    }
+  }
+}
+
+/* Returns the end of the bucket holding the <Permille>th permille. */
+static uint64_t GetIntervalPercentile(const unsigned long *Counts,
+                                      unsigned long Total,
+                                      unsigned Permille) {
+  unsigned long Rank = (Total * Permille + 999) / 1000;
+  unsigned long Seen = 0;
+  unsigned i;
+  for (i = 0; i + 1 < NumIntervalBuckets; ++i) {
+    Seen += Counts[i];
+    if (Seen >= Rank)
+      break;
+  }
+  return GetIntervalBucketEnd(i);
+}
+
+/*
+ * Reports the durations each latency probe measures, summed over the CPUs, one
+ * probe per line. A percentile is the end of the bucket holding it, at most
+ * 1/16 above the exact value. Reading the histograms does not stop the
+ * threads.
+ */
+static void ListIntervals(char *Response) {
+  unsigned i, j, k;
+  int Printed = sprintf(Response, "ID\tcount\tmean\tp50\tp90\tp99"
+                        "\tp99.9\tmax (us)");
+  for (i = 0; i < MaxNumFilters; ++i) {
+    const struct Filter *F = &Filters[i];
+    unsigned long Counts[NumIntervalBuckets];
+    unsigned long Total = 0;
+    uint64_t Sum = 0;
+    if (F->FilterType != LatencyProbe)
+      continue;
+    memset(Counts, 0, sizeof Counts);
+    for (k = 0; k < NumProbeCPUs; ++k) {
+      const struct IntervalHistogram *Histogram = &F->Interval->Histograms[k];
+      for (j = 0; j < NumIntervalBuckets; ++j)
+        Counts[j] += Histogram->Counts[j];
+      Sum += Histogram->Sum;
+    }
+    for (j = 0; j < NumIntervalBuckets; ++j)
+      Total += Counts[j];
+    /* Leave room for this line and the trailing "\n...". */
+    if (Printed + 160 >= MaxBufferSize) {
+      sprintf(Response + Printed, "\n...");
+      return;
+    }
+    if (Total == 0) {
+      Printed += sprintf(Response + Printed, "\n%u\t0\t-\t-\t-\t-\t-\t-", i);
+      continue;
+    }
+    Printed += sprintf(Response + Printed,
+                       "\n%u\t%lu\t%.1f\t%.1f\t%.1f\t%.1f\t%.1f\t%.1f",
+                       i, Total, Sum / 1000.0 / Total,
+                       GetIntervalPercentile(Counts, Total, 500) / 1000.0,
+                       GetIntervalPercentile(Counts, Total, 900) / 1000.0,
+                       GetIntervalPercentile(Counts, Total, 990) / 1000.0,
+                       GetIntervalPercentile(Counts, Total, 999) / 1000.0,
+                       GetIntervalPercentile(Counts, Total, 1000) / 1000.0);
+  }
+}
+
+/*
+ * Processes in different namespaces, e.g. different applications or runs, have
+ * their own filter IDs. Set by LOOM_NAMESPACE, which must not contain spaces.
+ */
+static const char *GetNamespace() {
+  const char *Namespace = getenv("LOOM_NAMESPACE");
+  return (Namespace != NULL && Namespace[0] != '\0' ? Namespace : "default");
+}
+
+int LoadFilters(const char *StateFileName) {
+  FILE *StateFile;
+  char Line[MaxBufferSize];
+  char Namespace[MaxBufferSize];
+  unsigned FilterID;
+  char FileName[MaxBufferSize];
+  int NumFields;
+
+  StateFile = fopen(StateFileName, "r");
+  if (!StateFile) {
+    fprintf(stderr, "cannot open state file %s\n", StateFileName);
+    return -1;
+  }
+  /*
+   * Each line is <namespace> <filter ID> <file name>. A word is no longer than
+   * its line, so it fits in the buffers.
+   */
+  while (fgets(Line, MaxBufferSize, StateFile) != NULL) {
+    struct Filter F;
+    if (strchr(Line, '\n') == NULL && !feof(StateFile)) {
+      fprintf(stderr, "line too long in %s. skip it\n", StateFileName);
+      /* Discard the rest of the line. */
+      while (fgets(Line, MaxBufferSize, StateFile) != NULL &&
+             strchr(Line, '\n') == NULL) {
+      }
+      continue;
+    }
+    NumFields = sscanf(Line, "%s %u %s", Namespace, &FilterID, FileName);
+    /* Blank lines have no fields. */
+    if (NumFields == EOF)
+      continue;
+    if (NumFields != 3) {
+      fprintf(stderr, "malformed line in %s. skip it\n", StateFileName);
+      continue;
+    }
+    if (strcmp(Namespace, GetNamespace()) != 0)
+      continue;
+    if (FilterID >= MaxNumFilters ||
+        Filters[FilterID].FilterType != Unknown) {
+      fprintf(stderr, "invalid filter ID %u in %s\n", FilterID, StateFileName);
+      continue;
+    }
+    if (ReadFilter(FilterID, FileName, &F) == -1)
+      continue;
+    InstallFilter(FilterID, &F);
+    fprintf(stderr, "filter %u is loaded from %s\n", FilterID, FileName);
+  }
+  fclose(StateFile);
+  return 0;
+}
+
 void ClearFilters() {
   unsigned i;
   for (i = 0; i < MaxNumFilters; ++i) {
     struct Filter *F = &Filters[i];
-    if (F->FilterType != Unknown)
+    if (F->FilterType != Unknown) {
       EraseFilter(F);
+      FreeFilter(F);
+    }
+  }
+}
+
+/*
+ * Parses the options following add and del. timeout=<ms> overrides
+ * DefaultEvacuationTimeout. Only add accepts budget=<percent> and
+ * window=<ms>, which turn on the watchdog, and shadow, which installs a
+ * critical region that only counts; pass NULL <Budget>, <Window> and
+ * <Shadow> to reject them.
+ */
+static int ParseOptions(unsigned *Timeout,
+                        unsigned *Budget,
+                        unsigned *Window,
+                        int *Shadow) {
+  char *Token;
+  *Timeout = DefaultEvacuationTimeout;
+  if (Budget)
+    *Budget = 0;
+  if (Window)
+    *Window = DefaultWatchdogWindow;
+  if (Shadow)
+    *Shadow = 0;
+  while ((Token = strtok(NULL, " ")) != NULL) {
+    if (strncmp(Token, "timeout=", strlen("timeout=")) == 0)
+      *Timeout = atoi(Token + strlen("timeout="));
+    else if (Shadow && strcmp(Token, "shadow") == 0)
+      *Shadow = 1;
+    else if (Budget && strncmp(Token, "budget=", strlen("budget=")) == 0)
+      *Budget = atoi(Token + strlen("budget="));
+    else if (Window && strncmp(Token, "window=", strlen("window=")) == 0)
+      *Window = atoi(Token + strlen("window="));
+    else
+      return -1;
   }
+  if (Window && *Window == 0)
+    return -1;
+  return 0;
 }
 
 static int ProcessMessage(char *Buffer, char *Response) {
@@ -330,34 +1436,75 @@ static int ProcessMessage(char *Buffer, char *Response) {
     char *Token = strtok(NULL, " ");
     unsigned FilterID;
     char *FileName;
+    unsigned Timeout, Budget, Window;
+    int Shadow;
     if (Token == NULL) {
-      sprintf(Response, "wrong format. expect: add <filter ID> <file name>");
+      sprintf(Response, "wrong format. expect: add <filter ID> <file name> "
+              "[timeout=<ms>] [budget=<percent>] [window=<ms>] [shadow]");
       return -1;
     }
     FilterID = atoi(Token);
     FileName = strtok(NULL, " ");
-    if (FileName == NULL) {
-      sprintf(Response, "wrong format. expect: add <filter ID> <file name>");
+    if (FileName == NULL ||
+        ParseOptions(&Timeout, &Budget, &Window, &Shadow) == -1) {
+      sprintf(Response, "wrong format. expect: add <filter ID> <file name> "
+              "[timeout=<ms>] [budget=<percent>] [window=<ms>] [shadow]");
       return -1;
     }
-    if (AddFilter(FilterID, FileName) == -1) {
+    if (AddFilter(FilterID, FileName, Timeout, Budget, Window, Shadow) == -1) {
       sprintf(Response, "failed to add the filter");
       return -1;
     }
-    sprintf(Response, "filter %u is successfully added", FilterID);
+    /* The controller keeps shadowed filters out of the state file. */
+    sprintf(Response, "filter %u is successfully %s", FilterID,
+            Shadow ? "shadowed" : "added");
   } else if (strcmp(Cmd, "del") == 0) {
     char *Token = strtok(NULL, " ");
     unsigned FilterID;
-    if (Token == NULL) {
-      sprintf(Response, "wrong format. expect: del <filter ID>");
+    unsigned Timeout;
+    if (Token == NULL || ParseOptions(&Timeout, NULL, NULL, NULL) == -1) {
+      sprintf(Response, "wrong format. expect: del <filter ID> [timeout=<ms>]");
       return -1;
     }
     FilterID = atoi(Token);
-    if (DeleteFilter(FilterID) == -1) {
+    if (DeleteFilter(FilterID, Timeout) == -1) {
       sprintf(Response, "failed to delete the filter");
       return -1;
     }
     sprintf(Response, "filter %u is successfully deleted", FilterID);
+  } else if (strcmp(Cmd, "trace") == 0) {
+    char *Action = strtok(NULL, " ");
+    if (Action != NULL && strcmp(Action, "on") == 0) {
+      StartTracing();
+      sprintf(Response, "tracing is on");
+    } else if (Action != NULL && strcmp(Action, "off") == 0) {
+      StopTracing();
+      sprintf(Response, "tracing is off");
+    } else if (Action != NULL && strcmp(Action, "dump") == 0) {
+      char *FileName = strtok(NULL, " ");
+      if (FileName == NULL) {
+        sprintf(Response, "wrong format. expect: trace dump <file name>");
+        return -1;
+      }
+      if (DumpTrace(FileName) == -1) {
+        sprintf(Response, "failed to dump the trace");
+        return -1;
+      }
+      sprintf(Response, "trace is dumped to %s", FileName);
+    } else {
+      sprintf(Response, "wrong format. expect: trace on|off|dump <file name>");
+      return -1;
+    }
+  } else if (strcmp(Cmd, "threads") == 0) {
+    PrintThreads(Response);
+  } else if (strcmp(Cmd, "lockstats") == 0) {
+    ListLockStats(Response);
+  } else if (strcmp(Cmd, "shadowstats") == 0) {
+    ListShadowStats(Response);
+  } else if (strcmp(Cmd, "probes") == 0) {
+    ListProbes(Response);
+  } else if (strcmp(Cmd, "intervals") == 0) {
+    ListIntervals(Response);
   } else if (strcmp(Cmd, "ls") == 0) {
     unsigned FilterIDs[MaxNumFilters];
     unsigned NumFilters = ListFilters(FilterIDs, MaxNumFilters);
@@ -373,8 +1520,81 @@ static int ProcessMessage(char *Buffer, char *Response) {
   return 0;
 }
 
-static void *RunDaemon(void *Arg) {
+/*
+ * Serves the controller until the connection breaks. Returns -1 if the daemon
+ * should reconnect.
+ */
+static int ServeController() {
   char Buffer[MaxBufferSize];
+
+  /* Tell the controller "I am a daemon". */
+  snprintf(Buffer, MaxBufferSize, "iam loom_daemon %d %s\n",
+           getpid(), GetNamespace());
+  if (SendMessage(CtrlSock, Buffer) == -1)
+    return -1;
+  while (1) {
+    char Response[MaxBufferSize] = {'\0'};
+    struct pollfd PFD;
+    int Ready;
+    SampleProgress();
+    CheckWatchdogs();
+    if (QueueLength > 0) {
+      /* Process the commands received during the last update first. */
+      struct QueuedCommand *Q = &QueuedCommands[QueueHead];
+      QueueHead = (QueueHead + 1) % MaxQueuedCommands;
+      --QueueLength;
+      CurrentTag = Q->Tag;
+      strcpy(Buffer, Q->Cmd);
+    } else {
+      /* Wake up when the next watchdog window ends. */
+      PFD.fd = CtrlSock;
+      PFD.events = POLLIN;
+      Ready = poll(&PFD, 1, NextWatchdogTimeout());
+      if (Ready == -1 && errno != EINTR) {
+        perror("poll");
+        return -1;
+      }
+      if (Ready <= 0)
+        continue;
+      if (ReceiveTaggedMessage(CtrlSock, &CurrentTag, Buffer) == -1)
+        return -1;
+      /* The update to cancel has already finished. */
+      if (strcmp(Buffer, "cancel") == 0)
+        continue;
+    }
+    ProcessMessage(Buffer, Response);
+    assert(strlen(Response) > 0 && "empty response");
+    if (SendToController(Response) == -1)
+      return -1;
+  }
+}
+
+/* Sleeps <Milliseconds>, and keeps checking the watchdogs meanwhile. */
+static void WaitToReconnect(unsigned Milliseconds) {
+  uint64_t Until = MonotonicTime() + (uint64_t)Milliseconds * 1000000;
+  uint64_t Now;
+  while ((Now = MonotonicTime()) < Until && !Stopping) {
+    int Timeout = NextWatchdogTimeout();
+    unsigned Left = (Until - Now) / 1000000 + 1;
+    SleepMilliseconds(Timeout >= 0 && (unsigned)Timeout < Left ?
+                      (unsigned)Timeout : Left);
+    SampleProgress();
+    CheckWatchdogs();
+  }
+}
+
+/*
+ * Connects to the controller, serves it, and reconnects whenever the
+ * connection fails or breaks, e.g. because the controller is not started yet
+ * or restarts. Reconnecting re-registers the process, and the controller asks
+ * for its filters again. The delay between attempts backs off exponentially
+ * with a random jitter, so that many processes, e.g. the children of a forking
+ * server, do not reconnect in lockstep.
+ */
+static void *RunDaemon(void *Arg) {
+  int Forked = (intptr_t)Arg;
+  unsigned Seed = getpid() ^ (unsigned)MonotonicTime();
+  unsigned Delay = MinReconnectDelay;
   fprintf(stderr, "daemon is running...\n");
 
   /*
@@ -390,35 +1610,52 @@ static void *RunDaemon(void *Arg) {
   /* Set the thread name, so that we can "ps c" to view it. */
   SetThreadName();
 
-  CtrlSock = CreateSocketToController();
-  if (CtrlSock == -1)
-    return (void *)-1;
-  fprintf(stderr, "Loom daemon is connected to Loom controller\n");
+  /* Spread the connections of forked children. */
+  if (Forked)
+    WaitToReconnect(rand_r(&Seed) % MinReconnectDelay);
 
-  /* Tell the controller "I am a daemon". */
-  sprintf(Buffer, "iam loom_daemon %d\n", getpid());
-  if (SendMessage(CtrlSock, Buffer) == -1)
-    return (void *)-1;
-  while (1) {
-    char Response[MaxBufferSize] = {'\0'};
-    if (ReceiveMessage(CtrlSock, Buffer) == -1)
-      return (void *)-1;
-    ProcessMessage(Buffer, Response);
-    assert(strlen(Response) > 0 && "empty response");
-    if (SendMessage(CtrlSock, Response) == -1)
-      return (void *)-1;
+  while (!Stopping) {
+    int Sock = CreateSocketToController();
+    if (Sock == -1) {
+      if (Delay == MinReconnectDelay)
+        fprintf(stderr, "cannot connect to Loom controller. "
+                "retry in the background\n");
+      /* Wait for a random time in [Delay / 2, Delay]. */
+      WaitToReconnect(Delay / 2 + rand_r(&Seed) % (Delay / 2 + 1));
+      Delay = (Delay * 2 < MaxReconnectDelay ? Delay * 2 : MaxReconnectDelay);
+      continue;
+    }
+    CtrlSock = Sock;
+    Delay = MinReconnectDelay;
+    fprintf(stderr, "Loom daemon is connected to Loom controller\n");
+    ServeController();
+    /* Commands queued on the broken connection cannot be answered. */
+    QueueLength = 0;
+    CtrlSock = -1;
+    if (!Stopping) {
+      close(Sock);
+      fprintf(stderr, "Loom daemon is disconnected from Loom controller\n");
+    }
   }
-
-  /* unreachable */
-  assert(0 && "unreachable");
-
   return NULL;
 }
 
-int StartDaemon() {
+int StartDaemon(int Forked) {
   pthread_t DaemonTID;
-  if (pthread_create(&DaemonTID, NULL, RunDaemon, NULL) == -1) {
-    perror("pthread_create");
+  if (Forked && CtrlSock != -1) {
+    /* Do not share the connection of the parent process. */
+    close(CtrlSock);
+    CtrlSock = -1;
+    QueueLength = 0;
+  }
+  if (Forked) {
+    /* The child makes its own progress. */
+    NumProgressSamples = 0;
+    ActivationsInherited = 1;
+  }
+  if (pthread_create(&DaemonTID, NULL, RunDaemon,
+                     (void *)(intptr_t)Forked) != 0) {
+    fprintf(stderr, "failed to create the daemon thread\n");
     return -1;
   }
   return 0;
@@ -431,6 +1668,7 @@ int StopDaemon() {
    * need to explicitly kill it.
    * TODO: issue a warning if the daemon already exits.
    */
+  Stopping = 1;
   if (CtrlSock != -1) {
     close(CtrlSock);
     CtrlSock = -1;
@@ -0,0 +1,102 @@
+/* for REG_RIP and REG_EIP */
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <ucontext.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "Threads.h"
+#include "UpdateEngine.h"
+#include "UpdateLock.h"
+
+/* Real-time signals are queued, and rarely used by applications. */
+#define PreemptSignal (SIGRTMAX - 3)
+
+/* Defined if the program is instrumented with -loom-preemptible. */
+extern const unsigned LoomPreemptible __attribute__((weak));
+/* Defined by the linker around section loom_text. */
+extern const char __start_loom_text[] __attribute__((weak));
+extern const char __stop_loom_text[] __attribute__((weak));
+
+__thread volatile sig_atomic_t HoldsUpdateLock = 0;
+__thread volatile sig_atomic_t InLoomRuntime = 0;
+int LoomPreemptDelay = -1;
+
+static uintptr_t GetInterruptedPC(const ucontext_t *Context) {
+#if defined(__x86_64__)
+  return Context->uc_mcontext.gregs[REG_RIP];
+#else
+  return Context->uc_mcontext.gregs[REG_EIP];
+#endif
+}
+
+static int IsInstrumentedCode(uintptr_t PC) {
+  return PC >= (uintptr_t)__start_loom_text &&
+      PC < (uintptr_t)__stop_loom_text;
+}
+
+/*
+ * Parks the thread if it holds LoomUpdateLock in uninstrumented code, e.g. a
+ * long call into a library, which never runs a slot or reads Loom's state.
+ * Code in loom_text may be anywhere in a region a filter cares about, and the
+ * runtime may hold its own locks, so threads there are left alone. The thread
+ * keeps its share of LoomUpdateLock, and the daemon counts it as parked.
+ */
+static void HandlePreemption(int Sig, siginfo_t *Info, void *Context) {
+  uint64_t SavedState;
+  int SavedErrno;
+  (void)Sig;
+  (void)Info;
+  if (!HoldsUpdateLock || InLoomRuntime ||
+      IsInstrumentedCode(GetInterruptedPC((ucontext_t *)Context)))
+    return;
+  SavedErrno = errno;
+  SavedState = (MyThread ? MyThread->StateWord : 0);
+  SetThreadState(ThreadPreempted, 0);
+  ParkInUpdateLock();
+  if (MyThread)
+    MyThread->StateWord = SavedState;
+  errno = SavedErrno;
+}
+
+int InitPreemption(int Delay) {
+  struct sigaction Action;
+#if !defined(__x86_64__) && !defined(__i386__)
+  fprintf(stderr, "preemption is not supported on this architecture\n");
+  return -1;
+#endif
+  if (&LoomPreemptible == NULL || !LoomPreemptible) {
+    fprintf(stderr, "preemption requires instrumenting with "
+            "-loom-preemptible\n");
+    return -1;
+  }
+  memset(&Action, 0, sizeof Action);
+  Action.sa_sigaction = HandlePreemption;
+  Action.sa_flags = SA_SIGINFO | SA_RESTART;
+  sigemptyset(&Action.sa_mask);
+  if (sigaction(PreemptSignal, &Action, NULL) == -1) {
+    perror("sigaction");
+    return -1;
+  }
+  LoomPreemptDelay = Delay;
+  return 0;
+}
+
+void PreemptThreads() {
+  struct ThreadInfo Threads[MaxListedThreads];
+  unsigned NumThreads = ListThreads(Threads, MaxListedThreads);
+  unsigned i;
+  for (i = 0; i < NumThreads; ++i) {
+    enum ThreadState State = GetThreadState(&Threads[i]);
+    /* Only these threads may hold LoomUpdateLock. */
+    if (State != ThreadRunning && State != ThreadSlowPath)
+      continue;
+    if (syscall(SYS_tgkill, getpid(), Threads[i].TID, PreemptSignal) == -1)
+      perror("tgkill");
+  }
+}
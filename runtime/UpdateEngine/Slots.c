@@ -1,23 +1,42 @@
+#define _GNU_SOURCE
+
 #include <assert.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
 
+#include "Trace.h"
 #include "UpdateEngine.h"
 
-int LoomSwitches[MaxNumFuncs];
-struct Operation *LoomOperations[MaxNumInsts];
+struct Operation **LoomOperations;
 pthread_mutex_t Mutexes[MaxNumFilters];
+struct LockStats LockStats[MaxNumFilters];
+struct ShadowStats ShadowStats[MaxNumFilters];
+unsigned NumProbeCPUs = 1;
+static __thread pid_t MyTID = 0;
+
+/* Deeper starts drop the oldest ones. */
+#define MaxIntervalDepth (32)
+
+struct IntervalStart {
+  uint64_t Serial;
+  uint64_t Timestamp;
+};
+
+static __thread struct IntervalStart IntervalStack[MaxIntervalDepth];
+static __thread unsigned IntervalDepth = 0;
 
 void LoomSlot(unsigned SlotID) {
   struct Operation *Op;
-  assert(SlotID < MaxNumInsts);
+  assert(SlotID < LoomNumInsts);
+  ++InLoomRuntime;
   for (Op = LoomOperations[SlotID]; Op; Op = Op->Next) {
     Op->CallBack(Op->Arg);
   }
-}
-
-int LoomSwitch(int FuncID) {
-  return LoomSwitches[FuncID];
+  --InLoomRuntime;
 }
 
 void PrependOperation(struct Operation *Op, struct Operation **Pos) {
@@ -35,12 +54,154 @@ int UnlinkOperation(struct Operation *Op, struct Operation **List) {
   return UnlinkOperation(Op, &(*List)->Next);
 }
 
+static unsigned GetBucket(uint64_t Nanoseconds) {
+  unsigned Bucket;
+  if (Nanoseconds == 0)
+    return 0;
+  Bucket = 64 - __builtin_clzll(Nanoseconds);
+  return (Bucket < NumLockStatBuckets ? Bucket : NumLockStatBuckets - 1);
+}
+
 void EnterCriticalRegion(void *Arg) {
-  unsigned FilterID = (unsigned)Arg;
-  pthread_mutex_lock(&Mutexes[FilterID]);
+  unsigned FilterID = (unsigned)(unsigned long)Arg;
+  struct LockStats *Stats = &LockStats[FilterID];
+  uint64_t Acquired;
+  TraceEvent(TraceLockWait, FilterID);
+  /* Only time the wait if the lock is contended. */
+  if (pthread_mutex_trylock(&Mutexes[FilterID]) == 0) {
+    Acquired = MonotonicTime();
+    ++Stats->WaitHistogram[0];
+  } else {
+    uint64_t Start = MonotonicTime();
+    pthread_mutex_lock(&Mutexes[FilterID]);
+    Acquired = MonotonicTime();
+    ++Stats->NumContended;
+    Stats->WaitTime += Acquired - Start;
+    ++Stats->WaitHistogram[GetBucket(Acquired - Start)];
+  }
+  ++Stats->NumAcquisitions;
+  if (MyTID == 0)
+    MyTID = syscall(SYS_gettid);
+  Stats->Owner = MyTID;
+  Stats->AcquiredAt = Acquired;
+  TraceEvent(TraceLockAcquired, FilterID);
 }
 
 void ExitCriticalRegion(void *Arg) {
-  unsigned FilterID = (unsigned)Arg;
+  unsigned FilterID = (unsigned)(unsigned long)Arg;
+  struct LockStats *Stats = &LockStats[FilterID];
+  ++Stats->HoldHistogram[GetBucket(MonotonicTime() - Stats->AcquiredAt)];
+  Stats->Owner = 0;
+  pthread_mutex_unlock(&Mutexes[FilterID]);
+  TraceEvent(TraceLockReleased, FilterID);
+}
+
+/* Accounts for the time since the occupancy last changed. */
+static void AdvanceShadowClock(struct ShadowStats *Stats, uint64_t Now) {
+  if (Stats->Occupancy > 1)
+    Stats->EstimatedWaitTime += (Now - Stats->LastChange) *
+        (Stats->Occupancy - 1);
+  Stats->LastChange = Now;
+}
+
+void EnterShadowRegion(void *Arg) {
+  unsigned FilterID = (unsigned)(unsigned long)Arg;
+  struct ShadowStats *Stats = &ShadowStats[FilterID];
+  pthread_mutex_lock(&Mutexes[FilterID]);
+  AdvanceShadowClock(Stats, MonotonicTime());
+  ++Stats->NumEntries;
+  if (Stats->Occupancy > 0)
+    ++Stats->NumOverlapping;
+  ++Stats->Occupancy;
+  if (Stats->Occupancy > Stats->MaxOccupancy)
+    Stats->MaxOccupancy = Stats->Occupancy;
   pthread_mutex_unlock(&Mutexes[FilterID]);
 }
+
+void ExitShadowRegion(void *Arg) {
+  unsigned FilterID = (unsigned)(unsigned long)Arg;
+  struct ShadowStats *Stats = &ShadowStats[FilterID];
+  pthread_mutex_lock(&Mutexes[FilterID]);
+  /*
+   * Threads inside the region when the filter is installed exit without
+   * entering.
+   */
+  if (Stats->Occupancy > 0) {
+    AdvanceShadowClock(Stats, MonotonicTime());
+    --Stats->Occupancy;
+  }
+  pthread_mutex_unlock(&Mutexes[FilterID]);
+}
+
+void HitProbe(void *Arg) {
+  struct ProbeCounter *Counters = Arg;
+  int CPU = sched_getcpu();
+  /*
+   * The thread may migrate meanwhile, so the add must still be atomic, but the
+   * counter is rarely shared.
+   */
+  if (CPU < 0)
+    CPU = 0;
+  __sync_fetch_and_add(&Counters[CPU % NumProbeCPUs].Hits, 1);
+}
+
+unsigned GetIntervalBucket(uint64_t Nanoseconds) {
+  unsigned Shift;
+  unsigned Bucket;
+  if (Nanoseconds < (1 << IntervalSubBucketBits))
+    return Nanoseconds;
+  Shift = 63 - __builtin_clzll(Nanoseconds) - IntervalSubBucketBits;
+  Bucket = ((Shift + 1) << IntervalSubBucketBits) +
+      ((Nanoseconds >> Shift) & ((1 << IntervalSubBucketBits) - 1));
+  return (Bucket < NumIntervalBuckets ? Bucket : NumIntervalBuckets - 1);
+}
+
+uint64_t GetIntervalBucketEnd(unsigned Bucket) {
+  unsigned Shift, SubBucket;
+  if (Bucket < (1 << IntervalSubBucketBits))
+    return Bucket + 1;
+  Shift = (Bucket >> IntervalSubBucketBits) - 1;
+  SubBucket = Bucket & ((1 << IntervalSubBucketBits) - 1);
+  return (uint64_t)((1 << IntervalSubBucketBits) + SubBucket + 1) << Shift;
+}
+
+void StartInterval(void *Arg) {
+  const struct IntervalProbe *Probe = Arg;
+  /*
+   * The oldest start probably never ends, e.g. because its thread left the
+   * interval by unwinding.
+   */
+  if (IntervalDepth == MaxIntervalDepth) {
+    memmove(IntervalStack, IntervalStack + 1,
+            (MaxIntervalDepth - 1) * sizeof(struct IntervalStart));
+    --IntervalDepth;
+  }
+  IntervalStack[IntervalDepth].Serial = Probe->Serial;
+  IntervalStack[IntervalDepth].Timestamp = MonotonicTime();
+  ++IntervalDepth;
+}
+
+void EndInterval(void *Arg) {
+  const struct IntervalProbe *Probe = Arg;
+  uint64_t Now = MonotonicTime();
+  uint64_t Elapsed;
+  struct IntervalHistogram *Histogram;
+  unsigned i = IntervalDepth;
+  int CPU;
+  while (i > 0 && IntervalStack[i - 1].Serial != Probe->Serial)
+    --i;
+  /* The thread was inside the interval when the probe was installed. */
+  if (i == 0)
+    return;
+  Elapsed = Now - IntervalStack[i - 1].Timestamp;
+  memmove(IntervalStack + i - 1, IntervalStack + i,
+          (IntervalDepth - i) * sizeof(struct IntervalStart));
+  --IntervalDepth;
+
+  CPU = sched_getcpu();
+  if (CPU < 0)
+    CPU = 0;
+  Histogram = &Probe->Histograms[CPU % NumProbeCPUs];
+  __sync_fetch_and_add(&Histogram->Counts[GetIntervalBucket(Elapsed)], 1);
+  __sync_fetch_and_add(&Histogram->Sum, Elapsed);
+}
@@ -1,6 +1,9 @@
 #ifndef __LOOM_SYNC_H
 #define __LOOM_SYNC_H
 
+#include <stdint.h>
+#include <time.h>
+
 typedef volatile unsigned atomic_t;
 
 static inline int atomic_dec(atomic_t *v) {
@@ -11,7 +14,17 @@ static inline int atomic_inc(atomic_t *v) {
   return __sync_add_and_fetch(v, 1);
 }
 
+/* in nanoseconds */
+static inline uint64_t MonotonicTime() {
+  struct timespec T;
+  clock_gettime(CLOCK_MONOTONIC, &T);
+  return (uint64_t)T.tv_sec * 1000000000 + T.tv_nsec;
+}
+
 void EnterCriticalRegion(void *Arg);
 void ExitCriticalRegion(void *Arg);
+/* Replace EnterCriticalRegion and ExitCriticalRegion in shadow mode. */
+void EnterShadowRegion(void *Arg);
+void ExitShadowRegion(void *Arg);
 
 #endif
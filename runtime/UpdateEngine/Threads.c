@@ -0,0 +1,72 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "Threads.h"
+
+__thread struct ThreadInfo *MyThread = NULL;
+/* protects <Threads> */
+static pthread_mutex_t ThreadsMutex = PTHREAD_MUTEX_INITIALIZER;
+static struct ThreadInfo *Threads = NULL;
+
+void RegisterThread() {
+  struct ThreadInfo *T = malloc(sizeof(struct ThreadInfo));
+  if (T == NULL) {
+    perror("malloc");
+    return;
+  }
+  T->TID = syscall(SYS_gettid);
+  T->StateWord = ((uint64_t)ThreadRunning << 32);
+  T->Prev = NULL;
+  pthread_mutex_lock(&ThreadsMutex);
+  T->Next = Threads;
+  if (Threads)
+    Threads->Prev = T;
+  Threads = T;
+  pthread_mutex_unlock(&ThreadsMutex);
+  MyThread = T;
+}
+
+void UnregisterThread() {
+  struct ThreadInfo *T = MyThread;
+  if (T == NULL)
+    return;
+  MyThread = NULL;
+  pthread_mutex_lock(&ThreadsMutex);
+  if (T->Prev)
+    T->Prev->Next = T->Next;
+  else
+    Threads = T->Next;
+  if (T->Next)
+    T->Next->Prev = T->Prev;
+  pthread_mutex_unlock(&ThreadsMutex);
+  free(T);
+}
+
+void ResetThreadRegistry() {
+  /*
+   * Other threads do not exist in the child, and one of them may have held
+   * <ThreadsMutex> when the parent forked. Their entries are leaked.
+   */
+  pthread_mutex_init(&ThreadsMutex, NULL);
+  Threads = MyThread;
+  if (MyThread) {
+    MyThread->TID = syscall(SYS_gettid);
+    MyThread->Prev = NULL;
+    MyThread->Next = NULL;
+  }
+}
+
+unsigned ListThreads(struct ThreadInfo *Infos, unsigned MaxLen) {
+  struct ThreadInfo *T;
+  unsigned Len = 0;
+  pthread_mutex_lock(&ThreadsMutex);
+  for (T = Threads; T && Len < MaxLen; T = T->Next) {
+    Infos[Len] = *T;
+    ++Len;
+  }
+  pthread_mutex_unlock(&ThreadsMutex);
+  return Len;
+}
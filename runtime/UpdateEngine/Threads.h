@@ -0,0 +1,60 @@
+#ifndef __LOOM_THREADS_H
+#define __LOOM_THREADS_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/* What an application thread is doing, as far as Loom can tell. */
+enum ThreadState {
+  ThreadRunning = 0,
+  /* in blocking call site <Arg> */
+  ThreadBlocking,
+  /* parked at back edge <Arg> by an update */
+  ThreadParked,
+  /* last seen at a back edge in the slow path of function <Arg> */
+  ThreadSlowPath,
+  /* parked in uninstrumented code by a preemption signal */
+  ThreadPreempted
+};
+
+struct ThreadInfo {
+  pid_t TID;
+  /*
+   * The state in the high 32 bits, and its argument in the low 32 bits, so
+   * that the daemon reads both in one load.
+   */
+  volatile uint64_t StateWord;
+  struct ThreadInfo *Prev;
+  struct ThreadInfo *Next;
+};
+
+/* NULL if the current thread is not an application thread */
+extern __thread struct ThreadInfo *MyThread;
+
+static inline void SetThreadState(enum ThreadState State, unsigned Arg) {
+  if (MyThread)
+    MyThread->StateWord = ((uint64_t)State << 32) | Arg;
+}
+
+static inline enum ThreadState GetThreadState(const struct ThreadInfo *T) {
+  return (enum ThreadState)(T->StateWord >> 32);
+}
+
+static inline unsigned GetThreadStateArg(const struct ThreadInfo *T) {
+  return (unsigned)T->StateWord;
+}
+
+void RegisterThread();
+void UnregisterThread();
+/* Forgets all threads but the current one. Call it in a forked child. */
+void ResetThreadRegistry();
+/*
+ * Copies at most <MaxLen> registered threads to <Threads>, and returns how
+ * many are copied.
+ */
+unsigned ListThreads(struct ThreadInfo *Threads, unsigned MaxLen);
+
+/* How many threads the daemon lists at most. */
+#define MaxListedThreads (512)
+
+#endif
@@ -0,0 +1,214 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "Sync.h"
+#include "Trace.h"
+
+/* Each thread keeps its last NumTraceEvents events. Must be a power of two. */
+#define NumTraceEvents (1 << 16)
+/*
+ * How many buffers of exited threads are kept until a dump. Beyond that, new
+ * threads take them over, and their events are lost.
+ */
+#define MaxExitedTraceBuffers (64)
+
+enum TraceBufferState {
+  /* written by a running thread */
+  BufferOwned = 0,
+  /* The thread has exited, and its events are not dumped yet. */
+  BufferExited,
+  /* The events are dumped. A new thread may take the buffer. */
+  BufferFree
+};
+
+struct TraceRecord {
+  uint64_t Timestamp; /* in nanoseconds */
+  uint32_t Type;
+  uint32_t Arg;
+};
+
+/*
+ * Only the owner thread writes a buffer, so recording needs no lock. Buffers
+ * are never freed, so that the daemon can dump events of exited threads.
+ * Instead, a new thread reuses the buffer of an exited thread once its events
+ * are dumped, or once too many exited threads keep theirs.
+ */
+struct TraceBuffer {
+  pid_t TID;
+  volatile int State;
+  volatile uint64_t NumWritten;
+  struct TraceBuffer *Next;
+  struct TraceRecord Records[NumTraceEvents];
+};
+
+volatile int LoomTracing = 0;
+static __thread struct TraceBuffer *MyTraceBuffer = NULL;
+/* all trace buffers, pushed without locks */
+static struct TraceBuffer *volatile TraceBuffers = NULL;
+/* the number of buffers in state BufferExited */
+static volatile unsigned NumExitedTraceBuffers = 0;
+
+/* Takes over a buffer in state <State>. Returns NULL if there is none. */
+static struct TraceBuffer *ReuseTraceBuffer(int State) {
+  struct TraceBuffer *Buffer;
+  for (Buffer = TraceBuffers; Buffer; Buffer = Buffer->Next) {
+    if (Buffer->State == State &&
+        __sync_bool_compare_and_swap(&Buffer->State, State, BufferOwned))
+      return Buffer;
+  }
+  return NULL;
+}
+
+static struct TraceBuffer *CreateTraceBuffer() {
+  struct TraceBuffer *Buffer = ReuseTraceBuffer(BufferFree);
+  if (Buffer == NULL && NumExitedTraceBuffers >= MaxExitedTraceBuffers) {
+    Buffer = ReuseTraceBuffer(BufferExited);
+    if (Buffer)
+      __sync_sub_and_fetch(&NumExitedTraceBuffers, 1);
+  }
+  if (Buffer) {
+    Buffer->TID = syscall(SYS_gettid);
+    Buffer->NumWritten = 0;
+    return Buffer;
+  }
+
+  Buffer = malloc(sizeof(struct TraceBuffer));
+  if (Buffer == NULL)
+    return NULL;
+  Buffer->TID = syscall(SYS_gettid);
+  Buffer->State = BufferOwned;
+  Buffer->NumWritten = 0;
+  do {
+    Buffer->Next = TraceBuffers;
+  } while (!__sync_bool_compare_and_swap(&TraceBuffers, Buffer->Next, Buffer));
+  return Buffer;
+}
+
+void ReleaseTraceBuffer() {
+  if (MyTraceBuffer == NULL)
+    return;
+  __sync_add_and_fetch(&NumExitedTraceBuffers, 1);
+  /* Publish the events before the buffer may be reused. */
+  __sync_synchronize();
+  MyTraceBuffer->State = BufferExited;
+  MyTraceBuffer = NULL;
+}
+
+void RecordEvent(enum TraceEventType Type, unsigned Arg) {
+  struct TraceRecord *Record;
+  if (MyTraceBuffer == NULL) {
+    MyTraceBuffer = CreateTraceBuffer();
+    if (MyTraceBuffer == NULL)
+      return;
+  }
+  Record = &MyTraceBuffer->Records[MyTraceBuffer->NumWritten &
+                                   (NumTraceEvents - 1)];
+  Record->Timestamp = MonotonicTime();
+  Record->Type = Type;
+  Record->Arg = Arg;
+  /* Publish the record after filling it. */
+  __sync_synchronize();
+  ++MyTraceBuffer->NumWritten;
+}
+
+void StartTracing() {
+  LoomTracing = 1;
+}
+
+void StopTracing() {
+  LoomTracing = 0;
+}
+
+static void DumpEvent(FILE *TraceFile,
+                      int *First,
+                      const char *Name,
+                      char Phase,
+                      pid_t TID,
+                      uint64_t Timestamp,
+                      const char *ArgName,
+                      unsigned Arg) {
+  fprintf(TraceFile,
+          "%s\n{\"name\": \"%s\", \"ph\": \"%c\", \"pid\": %d, \"tid\": %d, "
+          "\"ts\": %.3f, \"args\": {\"%s\": %u}%s}",
+          *First ? "" : ",",
+          Name, Phase, getpid(), TID, Timestamp / 1000.0, ArgName, Arg,
+          Phase == 'i' ? ", \"s\": \"t\"" : "");
+  *First = 0;
+}
+
+static void DumpRecord(FILE *TraceFile,
+                       int *First,
+                       pid_t TID,
+                       const struct TraceRecord *Record) {
+  uint64_t T = Record->Timestamp;
+  unsigned Arg = Record->Arg;
+  switch (Record->Type) {
+    case TraceSlowPath:
+      DumpEvent(TraceFile, First, "slow path", 'i', TID, T, "function", Arg);
+      break;
+    case TraceParkBegin:
+      DumpEvent(TraceFile, First, "park", 'B', TID, T, "back edge", Arg);
+      break;
+    case TraceParkEnd:
+      DumpEvent(TraceFile, First, "park", 'E', TID, T, "back edge", Arg);
+      break;
+    case TraceBlockingBegin:
+      DumpEvent(TraceFile, First, "blocking", 'B', TID, T, "call site", Arg);
+      break;
+    case TraceBlockingEnd:
+      DumpEvent(TraceFile, First, "blocking", 'E', TID, T, "call site", Arg);
+      break;
+    case TraceLockWait:
+      DumpEvent(TraceFile, First, "lock wait", 'B', TID, T, "filter", Arg);
+      break;
+    case TraceLockAcquired:
+      DumpEvent(TraceFile, First, "lock wait", 'E', TID, T, "filter", Arg);
+      DumpEvent(TraceFile, First, "critical region", 'B', TID, T, "filter",
+                Arg);
+      break;
+    case TraceLockReleased:
+      DumpEvent(TraceFile, First, "critical region", 'E', TID, T, "filter",
+                Arg);
+      break;
+  }
+}
+
+/*
+ * Events recorded while dumping may be lost or torn. Stop tracing first for an
+ * exact dump.
+ */
+int DumpTrace(const char *FileName) {
+  struct TraceBuffer *Buffer;
+  int First = 1;
+  FILE *TraceFile = fopen(FileName, "w");
+  if (!TraceFile) {
+    fprintf(stderr, "cannot open trace file %s\n", FileName);
+    return -1;
+  }
+  fprintf(TraceFile, "{\"traceEvents\": [");
+  for (Buffer = TraceBuffers; Buffer; Buffer = Buffer->Next) {
+    uint64_t End = Buffer->NumWritten;
+    uint64_t Begin = (End > NumTraceEvents ? End - NumTraceEvents : 0);
+    uint64_t i;
+    /* Its events are dumped already. */
+    if (Buffer->State == BufferFree)
+      continue;
+    for (i = Begin; i < End; ++i) {
+      DumpRecord(TraceFile, &First, Buffer->TID,
+                 &Buffer->Records[i & (NumTraceEvents - 1)]);
+    }
+    /* The events of an exited thread are dumped. Let a new thread reuse it. */
+    if (Buffer->State == BufferExited &&
+        __sync_bool_compare_and_swap(&Buffer->State, BufferExited, BufferFree))
+      __sync_sub_and_fetch(&NumExitedTraceBuffers, 1);
+  }
+  fprintf(TraceFile, "\n]}\n");
+  if (fclose(TraceFile) != 0) {
+    perror("fclose");
+    return -1;
+  }
+  return 0;
+}
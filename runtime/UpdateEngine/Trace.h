@@ -0,0 +1,46 @@
+#ifndef __LOOM_TRACE_H
+#define __LOOM_TRACE_H
+
+#define likely(x) __builtin_expect((x), 1)
+#define unlikely(x) __builtin_expect((x), 0)
+
+enum TraceEventType {
+  /* A back edge continues in the slow path. Arg = function ID */
+  TraceSlowPath = 0,
+  /* A thread parks at a cycle check. Arg = back edge ID */
+  TraceParkBegin,
+  TraceParkEnd,
+  /* A thread enters a blocking region. Arg = call site ID */
+  TraceBlockingBegin,
+  TraceBlockingEnd,
+  /* A thread waits for, acquires and releases a filter lock. Arg = filter ID */
+  TraceLockWait,
+  TraceLockAcquired,
+  TraceLockReleased
+};
+
+extern volatile int LoomTracing;
+
+void RecordEvent(enum TraceEventType Type, unsigned Arg);
+
+/*
+ * Records an event into the ring buffer of the current thread. Costs one
+ * predicted branch when tracing is off.
+ */
+#define TraceEvent(Type, Arg) \
+  do { \
+    if (unlikely(LoomTracing)) \
+      RecordEvent((Type), (Arg)); \
+  } while (0)
+
+/*
+ * Called when the current thread exits. Its buffer is kept until the next
+ * dump, and then reused by a new thread.
+ */
+void ReleaseTraceBuffer();
+void StartTracing();
+void StopTracing();
+/* Writes all buffered events in the Chrome trace format. */
+int DumpTrace(const char *FileName);
+
+#endif
@@ -2,9 +2,13 @@
 #define __LOOM_UPDATER_H
 
 #include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <sys/types.h>
 
 #include "Sync.h"
 #include "loom/config.h"
+#include "loom/FuncState.h"
 
 typedef void *ArgumentType;
 typedef void (*CallBackType)(ArgumentType);
@@ -16,25 +20,182 @@ struct Operation {
   struct Operation *Next;
 };
 
+/*
+ * Bucket 0 counts durations of 0 ns, and bucket i > 0 counts durations in
+ * [2^(i-1), 2^i) ns. The last bucket also counts longer durations.
+ */
+#define NumLockStatBuckets (48)
+
+/*
+ * Contention statistics of the lock of a critical-region filter. Only the
+ * lock holder updates them, so they need no extra synchronization. The
+ * daemon reads them racily.
+ */
+struct LockStats {
+  unsigned long NumAcquisitions;
+  /* acquisitions that had to wait */
+  unsigned long NumContended;
+  /* total time spent waiting, in nanoseconds */
+  uint64_t WaitTime;
+  unsigned long WaitHistogram[NumLockStatBuckets];
+  unsigned long HoldHistogram[NumLockStatBuckets];
+  /* thread ID of the current holder, or 0 */
+  volatile pid_t Owner;
+  uint64_t AcquiredAt;
+};
+
+/*
+ * Statistics of a critical-region filter installed in shadow mode, which
+ * counts instead of locking, so that its cost can be predicted before it is
+ * installed for real. Protected by the filter's mutex, which is only held to
+ * update them.
+ */
+struct ShadowStats {
+  unsigned long NumEntries;
+  /* entries that find another thread inside, i.e. would have to wait */
+  unsigned long NumOverlapping;
+  /* threads inside the region */
+  unsigned Occupancy;
+  unsigned MaxOccupancy;
+  /*
+   * The integral of (Occupancy - 1) over time, in nanoseconds: the total time
+   * threads would wait if the region were serialized, assuming the region
+   * takes as long.
+   */
+  uint64_t EstimatedWaitTime;
+  /* when Occupancy last changed */
+  uint64_t LastChange;
+  uint64_t InstalledAt;
+};
+
+/*
+ * The hit counter of a probe on one CPU. Each probe has one per CPU, so that
+ * threads on different CPUs do not share a cache line.
+ */
+struct ProbeCounter {
+  volatile unsigned long Hits;
+} __attribute__((aligned(64)));
+
+/*
+ * Histograms of latency probes are HDR-style. Durations below
+ * 2^IntervalSubBucketBits ns have their own buckets, and each larger power of
+ * two is split into 2^IntervalSubBucketBits buckets, so a bucket is at most
+ * 1/16 as wide as its durations. Durations of 2^MaxIntervalBits ns (about 18
+ * minutes) or longer fall into the last bucket.
+ */
+#define IntervalSubBucketBits (4)
+#define MaxIntervalBits (40)
+#define NumIntervalBuckets \
+  ((MaxIntervalBits - IntervalSubBucketBits + 1) << IntervalSubBucketBits)
+
+/* The durations a latency probe measures on one CPU. */
+struct IntervalHistogram {
+  volatile unsigned long Counts[NumIntervalBuckets];
+  /* in nanoseconds */
+  volatile uint64_t Sum;
+} __attribute__((aligned(64)));
+
+/*
+ * A latency probe measures how long a thread takes from any of its start slots
+ * to any of its end slots.
+ */
+struct IntervalProbe {
+  /*
+   * Unique among all latency probes ever installed, so that the starts left by
+   * a deleted probe never match the ends of another.
+   */
+  uint64_t Serial;
+  /* NumProbeCPUs histograms */
+  struct IntervalHistogram *Histograms;
+};
+
+/* sizes of the tables, defined in the instrumented program */
+extern const unsigned LoomNumBackEdges;
+extern const unsigned LoomNumBlockingCS;
+extern const unsigned LoomNumFuncs;
+extern const unsigned LoomNumInsts;
+
 /* control application threads */
-extern volatile int LoomWait[MaxNumBackEdges];
-extern atomic_t LoomCounter[MaxNumBlockingCS];
-extern pthread_rwlock_t LoomUpdateLock;
+extern volatile int *LoomWait;
+extern atomic_t *LoomCounter;
+/*
+ * LoomFuncStates[i] holds the LoomPatched and LoomPending bits of function i.
+ * Defined in the instrumented program.
+ */
+extern volatile int LoomFuncStates[];
+/*
+ * LoomFuncHashes[i] is the hash of the slots of function i, which a compiled
+ * filter must match. Defined in the instrumented program.
+ */
+extern const unsigned LoomFuncHashes[];
+/*
+ * LoomActivations[i] counts the running activations of function i. Defined
+ * only if the program is instrumented with -loom-track-activations.
+ */
+extern atomic_t LoomActivations[] __attribute__((weak));
 /*
  * LoomOperations[i] points to the first operation in slot i. Other operations
  * are chained via the Next pointer in struct Operation.
  */
-extern int LoomSwitches[MaxNumFuncs];
-extern struct Operation *LoomOperations[MaxNumInsts];
+extern struct Operation **LoomOperations;
 extern pthread_mutex_t Mutexes[MaxNumFilters];
+extern struct LockStats LockStats[MaxNumFilters];
+extern struct ShadowStats ShadowStats[MaxNumFilters];
+/* the number of counters of each probe */
+extern unsigned NumProbeCPUs;
+
+/*
+ * Optionally defined by the application. Returns a counter that grows with
+ * useful work, e.g. the number of requests served. The watchdog uses it to
+ * measure the overhead of a filter.
+ */
+unsigned long LoomProgress() __attribute__((weak));
+
+/*
+ * Whether the current thread holds LoomUpdateLock, and whether it runs the
+ * runtime's code, which may hold the runtime's own locks. The preemption
+ * handler reads them.
+ */
+extern __thread volatile sig_atomic_t HoldsUpdateLock;
+extern __thread volatile sig_atomic_t InLoomRuntime;
+/*
+ * How long an evacuation waits before preempting threads, in milliseconds.
+ * -1 if preemption is off.
+ */
+extern int LoomPreemptDelay;
+
+int InitPreemption(int Delay);
+/* Signals the threads that may hold LoomUpdateLock. */
+void PreemptThreads();
+
+/* Counts a hit. <Arg> points to the NumProbeCPUs counters of the probe. */
+void HitProbe(void *Arg);
+/*
+ * Start and end a measurement of latency probe <Arg>. Each thread keeps a stack
+ * of starts, so that nested and recursive intervals end at the innermost start.
+ */
+void StartInterval(void *Arg);
+void EndInterval(void *Arg);
+unsigned GetIntervalBucket(uint64_t Nanoseconds);
+/* Returns the smallest duration above bucket <Bucket>. */
+uint64_t GetIntervalBucketEnd(unsigned Bucket);
 
 void PrependOperation(struct Operation *Op, struct Operation **Pos);
 int UnlinkOperation(struct Operation *Op, struct Operation **List);
 
-int StartDaemon();
+/*
+ * Starts the daemon thread, which connects to the controller in the
+ * background. <Forked> tells whether it is for a forked child.
+ */
+int StartDaemon(int Forked);
 int StopDaemon();
 
 void InitFilters();
+/*
+ * Installs the filters listed in a state file without evacuation. Only call
+ * it before the application creates any thread.
+ */
+int LoadFilters(const char *StateFileName);
 void ClearFilters();
 
 #endif
@@ -0,0 +1,111 @@
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+#include "Sync.h"
+#include "UpdateLock.h"
+
+/* threads holding LoomUpdateLock shared, parked ones included */
+static volatile int Readers = 0;
+/* threads parked while holding LoomUpdateLock */
+static volatile int Parked = 0;
+/* 1 while the daemon holds or waits for LoomUpdateLock */
+static volatile int Writer = 0;
+/* bumped whenever a thread leaves or parks while the daemon waits */
+static volatile int Events = 0;
+
+static void FutexWait(volatile int *Addr, int Value,
+                      const struct timespec *Timeout) {
+  syscall(SYS_futex, Addr, FUTEX_WAIT_PRIVATE, Value, Timeout, NULL, 0);
+}
+
+static void FutexWakeAll(volatile int *Addr) {
+  syscall(SYS_futex, Addr, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+static void NotifyWriter() {
+  __sync_add_and_fetch(&Events, 1);
+  FutexWakeAll(&Events);
+}
+
+void AcquireUpdateLock() {
+  while (1) {
+    /* Pairs with the barrier after the daemon sets Writer. */
+    __sync_add_and_fetch(&Readers, 1);
+    if (!Writer)
+      return;
+    /* The daemon may have seen our share. */
+    __sync_sub_and_fetch(&Readers, 1);
+    NotifyWriter();
+    while (Writer)
+      FutexWait(&Writer, 1, NULL);
+  }
+}
+
+void ReleaseUpdateLock() {
+  __sync_sub_and_fetch(&Readers, 1);
+  if (Writer)
+    NotifyWriter();
+}
+
+int LockForUpdate(unsigned Milliseconds) {
+  uint64_t Deadline = MonotonicTime() + (uint64_t)Milliseconds * 1000000;
+  Writer = 1;
+  __sync_synchronize();
+  while (1) {
+    int Seen = Events;
+    int NumReaders, NumParked;
+    uint64_t Now;
+    struct timespec Timeout;
+    __sync_synchronize();
+    /*
+     * Read Readers before Parked, so that a thread parking in between is not
+     * mistaken for one still running. The operands of == are unsequenced, so
+     * read them into locals.
+     */
+    NumReaders = Readers;
+    __sync_synchronize();
+    NumParked = Parked;
+    if (NumReaders == NumParked)
+      return 0;
+    Now = MonotonicTime();
+    if (Now >= Deadline)
+      break;
+    Timeout.tv_sec = (Deadline - Now) / 1000000000;
+    Timeout.tv_nsec = (Deadline - Now) % 1000000000;
+    FutexWait(&Events, Seen, &Timeout);
+  }
+  UnlockAfterUpdate();
+  return -1;
+}
+
+void UnlockAfterUpdate() {
+  Writer = 0;
+  __sync_synchronize();
+  FutexWakeAll(&Writer);
+}
+
+void ParkInUpdateLock() {
+  while (1) {
+    __sync_add_and_fetch(&Parked, 1);
+    NotifyWriter();
+    while (Writer)
+      FutexWait(&Writer, 1, NULL);
+    __sync_sub_and_fetch(&Parked, 1);
+    /*
+     * The daemon may have taken the lock again, counting us as parked, before
+     * we left. If so, we must stay.
+     */
+    if (!Writer)
+      return;
+  }
+}
+
+void ResetUpdateLock(int Holds) {
+  Readers = (Holds ? 1 : 0);
+  Parked = 0;
+  Writer = 0;
+  Events = 0;
+}
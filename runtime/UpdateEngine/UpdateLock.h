@@ -0,0 +1,37 @@
+#ifndef __LOOM_UPDATE_LOCK_H
+#define __LOOM_UPDATE_LOCK_H
+
+/*
+ * LoomUpdateLock. Application threads hold it shared while they run
+ * instrumented code, and the daemon holds it exclusively while it updates the
+ * program. It prefers the daemon: threads taking it while the daemon waits for
+ * it block, so that they cannot starve an update.
+ *
+ * A thread preempted in uninstrumented code parks in the signal handler
+ * without giving up its share, because a signal handler cannot release a
+ * pthread lock. The lock counts parked threads instead, and the daemon takes
+ * it once every thread still holding it is parked. Parked threads stay parked
+ * until the daemon releases it. The lock is built on atomic instructions and
+ * futexes, so that parking is async-signal-safe.
+ */
+
+void AcquireUpdateLock();
+void ReleaseUpdateLock();
+/*
+ * Takes LoomUpdateLock exclusively. Returns 0 once every thread holding it is
+ * parked, or -1 without holding it after <Milliseconds>.
+ */
+int LockForUpdate(unsigned Milliseconds);
+void UnlockAfterUpdate();
+/*
+ * Called by the preemption handler of a thread holding LoomUpdateLock. Returns
+ * once the daemon does not hold the lock.
+ */
+void ParkInUpdateLock();
+/*
+ * Called in a forked child, where only the forking thread is left. <Holds>
+ * tells whether it holds LoomUpdateLock.
+ */
+void ResetUpdateLock(int Holds);
+
+#endif
@@ -2,25 +2,125 @@
 
 import os
 import sys
+import shutil
+import hashlib
 import rcs_utils
 import argparse
 
+def file_digest(file_name):
+    h = hashlib.sha1()
+    with open(file_name, 'rb') as f:
+        while True:
+            chunk = f.read(1 << 20)
+            if not chunk:
+                break
+            h.update(chunk)
+    return h.hexdigest()
+
+def filter_file_name(lm):
+    return os.path.splitext(lm)[0] + '.filter'
+
 if __name__ == '__main__':
     parser = argparse.ArgumentParser(description = 'compile .lm to .filter')
     parser.add_argument('bc', help = 'the bitcode file')
-    parser.add_argument('lm', help = '.lm file')
+    parser.add_argument('lm', nargs = '+', help = '.lm files')
+    parser.add_argument('--cache-dir',
+                        default = os.path.expanduser('~/.loom/filter-cache'),
+                        help = 'where compiled filters are cached, keyed by ' +
+                               'the bitcode and the .lm file')
+    parser.add_argument('--no-cache', action = 'store_true',
+                        help = 'always recompile')
+    parser.add_argument('--blocking-funcs',
+                        help = 'the list of blocking external functions ' +
+                               'the program was instrumented with')
+    parser.add_argument('--no-blocking-wrappers', action = 'store_true',
+                        help = 'the program was instrumented with ' +
+                               '--no-blocking-wrappers')
+    parser.add_argument('--no-coalesce-blocking-cs', action = 'store_true',
+                        help = 'the program was instrumented with ' +
+                               '--no-coalesce-blocking-cs')
+    parser.add_argument('--loc-index',
+                        help = 'the source location index used to resolve ' +
+                               '<file>:<line> (default: <prog>.loom.idx)')
+    parser.add_argument('--id-map',
+                        help = 'the ID map the program was instrumented ' +
+                               'with (default: <prog>.loom.ids)')
     args = parser.parse_args()
-    
-    if not args.lm.endswith('.lm'):
-        print >> sys.stderr, 'The input file should end with .lm'
-        sys.exit(1)
 
-    # TODO: loom_utils.load_all_plugins
-    cmd = rcs_utils.load_plugin('opt', 'RCSID')
-    cmd = rcs_utils.load_plugin(cmd, 'LoomCompiler')
-    cmd = ' '.join((cmd, '-compile'))
-    cmd = ' '.join((cmd, '-lm', args.lm))
-    cmd = ' '.join((cmd, '-analyze', '-q'))
-    cmd = ' '.join((cmd, '<', args.bc))
-    cmd = ' '.join((cmd, '>', os.path.splitext(args.lm)[0] + '.filter'))
-    rcs_utils.invoke(cmd)
+    if args.loc_index is None:
+        loc_index = os.path.splitext(args.bc)[0] + '.loom.idx'
+        if os.path.exists(loc_index):
+            args.loc_index = loc_index
+    if args.id_map is None:
+        id_map = os.path.splitext(args.bc)[0] + '.loom.ids'
+        if os.path.exists(id_map):
+            args.id_map = id_map
+
+    for lm in args.lm:
+        if not lm.endswith('.lm'):
+            print >> sys.stderr, 'The input file should end with .lm:', lm
+            sys.exit(1)
+
+    # A compiled filter only depends on the bitcode, how blocking call sites
+    # are identified, the ID map, and the .lm file. The prefix is the version
+    # of the filter format, so that filters cached in an older format are not
+    # reused.
+    cache_key = 'v2-' + file_digest(args.bc)
+    if args.blocking_funcs is not None:
+        cache_key += '-' + file_digest(args.blocking_funcs)
+    if args.no_blocking_wrappers:
+        cache_key += '-no-blocking-wrappers'
+    if args.no_coalesce_blocking_cs:
+        cache_key += '-no-coalesce-blocking-cs'
+    if args.id_map is not None:
+        cache_key += '-' + file_digest(args.id_map)
+    cache_dir = os.path.join(args.cache_dir, cache_key)
+    if not args.no_cache and not os.path.isdir(cache_dir):
+        os.makedirs(cache_dir)
+    misses = []
+    for lm in args.lm:
+        cached = os.path.join(cache_dir, file_digest(lm) + '.filter')
+        if not args.no_cache and os.path.exists(cached):
+            shutil.copyfile(cached, filter_file_name(lm))
+        else:
+            if os.path.exists(filter_file_name(lm)):
+                os.remove(filter_file_name(lm))
+            misses.append(lm)
+
+    if len(misses) > 0:
+        # Compile all misses in one run, so that the bitcode is loaded and
+        # IDs are assigned only once.
+        # TODO: loom_utils.load_all_plugins
+        cmd = rcs_utils.load_plugin('opt', 'RCSID')
+        cmd = rcs_utils.load_plugin(cmd, 'RCSCFG')
+        cmd = rcs_utils.load_plugin(cmd, 'LoomAnalysis')
+        cmd = rcs_utils.load_plugin(cmd, 'LoomCompiler')
+        cmd = ' '.join((cmd, '-compile', '-write-filters'))
+        if args.blocking_funcs is not None:
+            cmd = ' '.join((cmd, '-blocking-funcs', args.blocking_funcs))
+        if args.no_blocking_wrappers:
+            cmd = ' '.join((cmd, '-blocking-wrappers=false'))
+        if args.no_coalesce_blocking_cs:
+            cmd = ' '.join((cmd, '-coalesce-blocking-cs=false'))
+        if args.loc_index is not None:
+            cmd = ' '.join((cmd, '-loc-index', args.loc_index))
+        if args.id_map is not None:
+            cmd = ' '.join((cmd, '-loom-id-map', args.id_map))
+        for lm in misses:
+            cmd = ' '.join((cmd, '-lm', lm))
+        cmd = ' '.join((cmd, '-analyze', '-q'))
+        cmd = ' '.join((cmd, '<', args.bc))
+        cmd = ' '.join((cmd, '>', '/dev/null'))
+        rcs_utils.invoke(cmd)
+
+    failed = False
+    for lm in misses:
+        if not os.path.exists(filter_file_name(lm)):
+            print >> sys.stderr, 'failed to compile', lm
+            failed = True
+            continue
+        if not args.no_cache:
+            cached = os.path.join(cache_dir, file_digest(lm) + '.filter')
+            shutil.copyfile(filter_file_name(lm), cached)
+    if failed:
+        sys.exit(1)
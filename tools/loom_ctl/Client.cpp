@@ -1,3 +1,5 @@
+#include <errno.h>
+#include <poll.h>
 #include <pthread.h>
 #include <signal.h>
 #include <arpa/inet.h>
@@ -6,6 +8,7 @@
 #include <sstream>
 #include <vector>
 #include <map>
+#include <set>
 
 #include "llvm/Support/CommandLine.h"
 #include "llvm/Support/raw_ostream.h"
@@ -18,9 +21,43 @@ using namespace std;
 using namespace llvm;
 using namespace loom;
 
-static int CommandAddFilter(int CtrlServerSock,
-                            pid_t PID,
-                            const string &FilterFileName) {
+static cl::opt<int> Timeout(
+    "timeout",
+    cl::desc("Roll back -add or -del if evacuating the process takes longer "
+             "than <ms> milliseconds. 0 means no timeout. By default, use "
+             "the timeout the application is configured with"),
+    cl::init(-1));
+
+static cl::opt<unsigned> Budget(
+    "budget",
+    cl::desc("Watch the filter added by -add, and delete it if its overhead "
+             "exceeds <percent> percent"),
+    cl::init(0));
+static cl::opt<unsigned> Window(
+    "window",
+    cl::desc("How long the watchdog watches the filter added by -add, in "
+             "milliseconds"),
+    cl::init(0));
+
+static cl::opt<bool> Shadow(
+    "shadow",
+    cl::desc("Add the critical region with -add in shadow mode, which counts "
+             "how often threads would enter and wait for it instead of "
+             "locking. See -shadowstats"));
+
+static void AppendOptions(ostringstream &OS) {
+  if (Timeout >= 0)
+    OS << " timeout=" << Timeout;
+}
+
+static void AppendWatchdogOptions(ostringstream &OS) {
+  if (Budget > 0)
+    OS << " budget=" << Budget;
+  if (Window > 0)
+    OS << " window=" << Window;
+}
+
+static string CommandAddFilter(pid_t PID, const string &FilterFileName) {
   ostringstream OS;
   OS << "add " << PID << " ";
   // Convert to full path whenever possible, so that the user can use relative
@@ -31,107 +68,312 @@ static int CommandAddFilter(int CtrlServerSock,
   } else {
     OS << FilterFileName;
   }
-  return SendMessage(CtrlServerSock, OS.str().c_str());
+  AppendOptions(OS);
+  AppendWatchdogOptions(OS);
+  if (Shadow)
+    OS << " shadow";
+  return OS.str();
 }
 
-static int CommandDeleteFilter(int CtrlServerSock,
-                               unsigned PID,
-                               unsigned FilterID) {
+static string CommandDeleteFilter(unsigned PID, unsigned FilterID) {
   ostringstream OS;
   OS << "del " << PID << " " << FilterID;
-  return SendMessage(CtrlServerSock, OS.str().c_str());
+  AppendOptions(OS);
+  return OS.str();
 }
 
-static int CommandListFilters(int CtrlServerSock, pid_t PID = -1) {
+static string CommandListFilters(pid_t PID = -1) {
   ostringstream OS;
   OS << "ls";
   if (PID != -1)
     OS << " " << PID;
-  return SendMessage(CtrlServerSock, OS.str().c_str());
+  return OS.str();
 }
 
-static int CommandListDaemons(int CtrlServerSock) {
-  return SendMessage(CtrlServerSock, "ps");
+static string CommandCancel(pid_t PID) {
+  ostringstream OS;
+  OS << "cancel " << PID;
+  return OS.str();
 }
 
-int loom::RunControllerClient(CtlAction ControllerAction,
-                              const cl::list<string> &Args) {
-  // TODO: check format before connecting to the controller server
-  int CtrlServerSock = socket(AF_INET, SOCK_STREAM, 0);
-  if (CtrlServerSock == -1) {
-    perror("socket");
-    return -1;
-  }
+static string CommandListThreads(pid_t PID) {
+  ostringstream OS;
+  OS << "threads " << PID;
+  return OS.str();
+}
 
-  struct sockaddr_in ServerAddr;
-  bzero(&ServerAddr, sizeof ServerAddr);
-  ServerAddr.sin_family = AF_INET;
-  ServerAddr.sin_addr.s_addr = inet_addr(CONTROLLER_IP);
-  ServerAddr.sin_port = htons(CONTROLLER_PORT);
-  if (connect(CtrlServerSock,
-              (struct sockaddr *)&ServerAddr, sizeof ServerAddr) == -1) {
-    perror("failed to connect to the controller server");
-    return -1;
-  }
+static string CommandShadowStats(pid_t PID) {
+  ostringstream OS;
+  OS << "shadowstats " << PID;
+  return OS.str();
+}
 
-  if (SendMessage(CtrlServerSock, "iam loom_ctl") == -1) {
-    close(CtrlServerSock);
-    return -1;
+static string CommandListProbes(pid_t PID) {
+  ostringstream OS;
+  OS << "probes " << PID;
+  return OS.str();
+}
+
+static string CommandListIntervals(pid_t PID) {
+  ostringstream OS;
+  OS << "intervals " << PID;
+  return OS.str();
+}
+
+static int CommandTrace(pid_t PID, const vector<string> &Args, string &Cmd) {
+  ostringstream OS;
+  OS << "trace " << PID << " " << Args[1];
+  if (Args[1] == "dump") {
+    // The daemon runs in another directory, so pass it a full path.
+    const string &TraceFileName = Args[2];
+    if (TraceFileName[0] == '/') {
+      OS << " " << TraceFileName;
+    } else {
+      char *CWD = getcwd(NULL, 0);
+      if (CWD == NULL) {
+        perror("getcwd");
+        return -1;
+      }
+      OS << " " << CWD << "/" << TraceFileName;
+      free(CWD);
+    }
   }
+  Cmd = OS.str();
+  return 0;
+}
 
-  // TODO: "goto" doesn't seem a good habit.
+// Builds the command of <ControllerAction> to send to the controller server.
+static int BuildCommand(CtlAction ControllerAction,
+                        const vector<string> &Args,
+                        string &Cmd) {
   switch (ControllerAction) {
     case add:
       if (Args.size() != 2)
         goto format_error;
-      if (CommandAddFilter(CtrlServerSock,
-                           atoi(Args[0].c_str()),
-                           Args[1]) == -1)
-        goto error;
+      Cmd = CommandAddFilter(atoi(Args[0].c_str()), Args[1]);
       break;
     case del:
       if (Args.size() != 2)
         goto format_error;
       // TODO: check Args[0] and Args[1] are numbers
-      if (CommandDeleteFilter(CtrlServerSock,
-                              atoi(Args[0].c_str()),
-                              atoi(Args[1].c_str())) == -1)
-        goto error;
+      Cmd = CommandDeleteFilter(atoi(Args[0].c_str()), atoi(Args[1].c_str()));
       break;
     case ls:
       if (Args.size() >= 2)
         goto format_error;
-      if (Args.size() == 1) {
-        if (CommandListFilters(CtrlServerSock, atoi(Args[0].c_str())) == -1)
-          goto error;
-      } else {
-        if (CommandListFilters(CtrlServerSock) == -1)
-          goto error;
-      }
+      if (Args.size() == 1)
+        Cmd = CommandListFilters(atoi(Args[0].c_str()));
+      else
+        Cmd = CommandListFilters();
       break;
     case ps:
       if (Args.size() != 0)
         goto format_error;
-      if (CommandListDaemons(CtrlServerSock) == -1)
-        goto error;
+      Cmd = "ps";
+      break;
+    case cancel:
+      if (Args.size() != 1)
+        goto format_error;
+      Cmd = CommandCancel(atoi(Args[0].c_str()));
+      break;
+    case trace:
+      if ((Args.size() == 2 && (Args[1] == "on" || Args[1] == "off")) ||
+          (Args.size() == 3 && Args[1] == "dump"))
+        return CommandTrace(atoi(Args[0].c_str()), Args, Cmd);
+      goto format_error;
+    case threads:
+      if (Args.size() != 1)
+        goto format_error;
+      Cmd = CommandListThreads(atoi(Args[0].c_str()));
+      break;
+    case shadowstats:
+      if (Args.size() != 1)
+        goto format_error;
+      Cmd = CommandShadowStats(atoi(Args[0].c_str()));
+      break;
+    case probes:
+      if (Args.size() != 1)
+        goto format_error;
+      Cmd = CommandListProbes(atoi(Args[0].c_str()));
+      break;
+    case intervals:
+      if (Args.size() != 1)
+        goto format_error;
+      Cmd = CommandListIntervals(atoi(Args[0].c_str()));
       break;
     default:
-      assert(false);
+      goto format_error;
   }
+  return 0;
 
-  {
-    char Response[MaxBufferSize] = {'\0'};
-    if (ReceiveMessage(CtrlServerSock, Response) == -1)
-      goto error;
-    outs() << Response << "\n";
+format_error:
+  errs() << "wrong format\n";
+  return -1;
+}
+
+// Maps the first word of a line in a session to an action.
+static int ParseAction(const string &Name, CtlAction &ControllerAction) {
+  static const char *Names[] = {
+    "add", "del", "ls", "ps", "cancel", "trace", "threads", "shadowstats",
+    "probes", "intervals"
+  };
+  static const CtlAction Actions[] = {
+    add, del, ls, ps, cancel, trace, threads, shadowstats, probes, intervals
+  };
+  for (size_t i = 0; i < sizeof(Names) / sizeof(Names[0]); ++i) {
+    if (Name == Names[i]) {
+      ControllerAction = Actions[i];
+      return 0;
+    }
   }
+  return -1;
+}
 
-  close(CtrlServerSock);
+// Prints a message from the controller server. Returns whether it is the final
+// response to a request. Interim messages start with '+'.
+static bool PrintResponse(unsigned RequestID,
+                          const char *Response,
+                          bool InSession) {
+  bool Final = (RequestID != 0 && Response[0] != '+');
+  if (InSession)
+    outs() << "[" << RequestID << "] ";
+  outs() << (Response[0] == '+' ? Response + 1 : Response) << "\n";
+  outs().flush();
+  return Final;
+}
+
+// Sends a command for each line of the standard input, e.g.
+// "add <PID> <file>", as soon as it is read, without waiting for the
+// responses to the previous commands. Responses are printed as they arrive,
+// prefixed with the IDs of the requests they answer. Returns when the input
+// ends and all requests are answered.
+static int RunSession(int CtrlServerSock) {
+  unsigned NextRequestID = 1;
+  set<unsigned> PendingRequests;
+  bool InputEnded = false;
+  string Input;
+  while (!InputEnded || !PendingRequests.empty()) {
+    struct pollfd PFDs[2];
+    PFDs[0].fd = CtrlServerSock;
+    PFDs[0].events = POLLIN;
+    // poll ignores negative file descriptors.
+    PFDs[1].fd = (InputEnded ? -1 : STDIN_FILENO);
+    PFDs[1].events = POLLIN;
+    if (poll(PFDs, 2, -1) == -1) {
+      if (errno == EINTR)
+        continue;
+      perror("poll");
+      return -1;
+    }
+
+    if (PFDs[0].revents) {
+      unsigned RequestID;
+      char Response[MaxBufferSize];
+      if (ReceiveTaggedMessage(CtrlServerSock, &RequestID, Response) == -1)
+        return -1;
+      if (PrintResponse(RequestID, Response, true))
+        PendingRequests.erase(RequestID);
+    }
+
+    if (PFDs[1].revents) {
+      char Buffer[MaxBufferSize];
+      ssize_t Len = read(STDIN_FILENO, Buffer, sizeof Buffer);
+      if (Len == -1) {
+        perror("read");
+        return -1;
+      }
+      if (Len == 0) {
+        InputEnded = true;
+        // The last line may have no trailing newline.
+        Input += "\n";
+      } else {
+        Input.append(Buffer, Len);
+      }
+      size_t End;
+      while ((End = Input.find('\n')) != string::npos) {
+        string Line = Input.substr(0, End);
+        Input.erase(0, End + 1);
+        istringstream IS(Line);
+        string Name, Arg;
+        CtlAction ControllerAction;
+        vector<string> LineArgs;
+        if (!(IS >> Name))
+          continue;
+        while (IS >> Arg)
+          LineArgs.push_back(Arg);
+        string Cmd;
+        if (ParseAction(Name, ControllerAction) == -1) {
+          errs() << "unknown command: " << Line << "\n";
+          continue;
+        }
+        if (BuildCommand(ControllerAction, LineArgs, Cmd) == -1)
+          continue;
+        unsigned RequestID = NextRequestID++;
+        outs() << "[" << RequestID << "] > " << Line << "\n";
+        outs().flush();
+        if (SendTaggedMessage(CtrlServerSock, RequestID, Cmd.c_str()) == -1)
+          return -1;
+        PendingRequests.insert(RequestID);
+      }
+    }
+  }
   return 0;
+}
+
+int loom::RunControllerClient(CtlAction ControllerAction,
+                              const cl::list<string> &Args) {
+  string Cmd;
+  if (ControllerAction == session) {
+    if (!Args.empty()) {
+      errs() << "wrong format\n";
+      return -1;
+    }
+  } else if (BuildCommand(ControllerAction,
+                          vector<string>(Args.begin(), Args.end()),
+                          Cmd) == -1) {
+    return -1;
+  }
+
+  int CtrlServerSock = socket(AF_INET, SOCK_STREAM, 0);
+  if (CtrlServerSock == -1) {
+    perror("socket");
+    return -1;
+  }
+
+  struct sockaddr_in ServerAddr;
+  bzero(&ServerAddr, sizeof ServerAddr);
+  ServerAddr.sin_family = AF_INET;
+  ServerAddr.sin_addr.s_addr = inet_addr(CONTROLLER_IP);
+  ServerAddr.sin_port = htons(CONTROLLER_PORT);
+  if (connect(CtrlServerSock,
+              (struct sockaddr *)&ServerAddr, sizeof ServerAddr) == -1) {
+    perror("failed to connect to the controller server");
+    close(CtrlServerSock);
+    return -1;
+  }
+
+  int Ret = 0;
+  if (SendMessage(CtrlServerSock, "iam loom_ctl") == -1) {
+    Ret = -1;
+  } else if (ControllerAction == session) {
+    Ret = RunSession(CtrlServerSock);
+  } else if (SendTaggedMessage(CtrlServerSock, 1, Cmd.c_str()) == -1) {
+    Ret = -1;
+  } else {
+    // Print interim messages, and messages nobody asked for, e.g. rollbacks
+    // by the watchdog, until the final response.
+    while (true) {
+      unsigned RequestID;
+      char Response[MaxBufferSize] = {'\0'};
+      if (ReceiveTaggedMessage(CtrlServerSock, &RequestID, Response) == -1) {
+        Ret = -1;
+        break;
+      }
+      if (PrintResponse(RequestID, Response, false))
+        break;
+    }
+  }
 
-format_error:
-  errs() << "wrong format\n";
-error:
   close(CtrlServerSock);
-  return -1;
+  return Ret;
 }
@@ -1,12 +1,19 @@
 #include <pthread.h>
 #include <signal.h>
+#include <stdint.h>
 #include <arpa/inet.h>
+#include <sys/socket.h>
 
 #include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <fstream>
 #include <sstream>
 #include <vector>
 #include <map>
+#include <set>
 
+#include "llvm/ADT/DenseMap.h"
 #include "llvm/Support/CommandLine.h"
 #include "llvm/Support/raw_ostream.h"
 
@@ -18,36 +25,628 @@ using namespace std;
 using namespace llvm;
 using namespace loom;
 
-// protect <CtrlClientSock> and <Daemons>
+static cl::opt<string> StateFileName(
+    "state-file",
+    cl::desc("Keep the installed filters in <file>. Applications started with "
+             "LOOM_STATE_FILE=<file> install them at startup"));
+
+// A filter registered in a namespace. An ID is registered while any process
+// uses the filter, an add is pending, or the state file lists it.
+struct RegisteredFilter {
+  RegisteredFilter(): Hash(0), NumPendingAdds(0), InStateFile(false) {}
+
+  bool isRegistered() const { return FileName != ""; }
+  bool isUnused() const {
+    return Users.empty() && NumPendingAdds == 0 && !InStateFile;
+  }
+
+  string FileName;
+  // hash of the content of the filter file
+  uint64_t Hash;
+  // processes that have the filter installed
+  set<pid_t> Users;
+  // adds sent to daemons and not answered yet
+  unsigned NumPendingAdds;
+  // whether the filter is successfully added to any process, and not deleted
+  // since. The state file lists these filters.
+  bool InStateFile;
+};
+
+// The filters of the processes in one namespace, e.g. one application or one
+// run. Processes announce their namespaces with LOOM_NAMESPACE. Filter IDs are
+// only unique within a namespace.
+struct Namespace {
+  Namespace(): Filters(MaxNumFilters), NumUsedIDs(0) {}
+
+  // indexed by filter ID
+  vector<RegisteredFilter> Filters;
+  DenseMap<uint64_t, unsigned> IDsByHash;
+  // IDs freed since, reused first
+  vector<unsigned> FreeIDs;
+  // IDs >= NumUsedIDs have never been used.
+  unsigned NumUsedIDs;
+};
+
+// Messages waiting to be sent to a socket. Each socket has a writer thread that
+// sends them, so that nobody sends while holding <Mutex>: a client that stops
+// reading would otherwise block every other client and daemon.
+struct Outbox {
+  Outbox(int S): Sock(S), Closed(false), Broken(false) {
+    pthread_mutex_init(&Lock, NULL);
+    pthread_cond_init(&NonEmpty, NULL);
+  }
+  ~Outbox() {
+    pthread_cond_destroy(&NonEmpty);
+    pthread_mutex_destroy(&Lock);
+  }
+
+  int Sock;
+  pthread_t Writer;
+  // Protects the fields below. Taken after <Mutex>, if both.
+  pthread_mutex_t Lock;
+  pthread_cond_t NonEmpty;
+  // tags and messages
+  deque<pair<unsigned, string> > Messages;
+  // set when the connection ends
+  bool Closed;
+  // set when a send fails
+  bool Broken;
+};
+
+// Protects the global data below. It only guards the registry; messages are
+// queued to <Outboxes> and sent by the writer threads.
 static pthread_mutex_t Mutex = PTHREAD_MUTEX_INITIALIZER;
-static int CtrlClientSock = -1;
+static map<int, Outbox *> Outboxes;
+static set<int> CtrlClientSocks;
 static map<pid_t, int> Daemons;
+static map<pid_t, string> DaemonNamespaces;
+static map<string, Namespace> Namespaces;
+
+// Identifies a filter across namespaces.
+typedef pair<string, unsigned> FilterKey;
+
+// Lock statistics of a filter, aggregated over the daemons that answer ls.
+struct LockStats {
+  LockStats(): NumAcquisitions(0), NumContended(0) {}
+
+  unsigned long NumAcquisitions;
+  unsigned long NumContended;
+  // Bucket 0 counts durations of 0 ns, and bucket i > 0 counts durations in
+  // [2^(i-1), 2^i) ns.
+  vector<unsigned long> WaitHistogram;
+  vector<unsigned long> HoldHistogram;
+  // <PID>/<TID> of the threads holding the lock
+  vector<string> Owners;
+};
+
+// A request that daemons have yet to answer.
+struct Request {
+  Request(): ClientSock(-1), RequestID(0), DaemonSock(-1), FilterID(-1),
+             IsSync(false), IsListing(false), ListingAllFilters(false) {}
+
+  // -1 if the client has exited, in which case the answers are dropped
+  int ClientSock;
+  // the tag the client gave the request
+  unsigned RequestID;
+  // the daemon that answers the request, or -1 for ls
+  int DaemonSock;
+  // the filter an add installs, or -1
+  unsigned FilterID;
+  string NamespaceName;
+  // The server asks a daemon for its filters when it connects, so that the
+  // filters loaded from the state file are counted as used.
+  bool IsSync;
+  // ls asks daemons for their lock statistics, and replies to the client when
+  // all of them answer.
+  bool IsListing;
+  // whether ls lists all filters or the filters on one process
+  bool ListingAllFilters;
+  set<int> PendingDaemons;
+  map<FilterKey, LockStats> AggregatedStats;
+};
+
+// Requests indexed by the tags of the commands sent to daemons. Tags are
+// assigned by the server, because request IDs of different clients collide.
+static map<unsigned, Request> Requests;
+static unsigned NextTag = 1;
+
+// FNV-1a. Returns -1 if the file cannot be read.
+static int HashFile(const string &FileName, uint64_t &Hash) {
+  ifstream File(FileName.c_str(), ios::binary);
+  if (!File)
+    return -1;
+  Hash = 14695981039346656037ULL;
+  char C;
+  while (File.get(C)) {
+    Hash ^= (unsigned char)C;
+    Hash *= 1099511628211ULL;
+  }
+  return 0;
+}
+
+// The caller must hold <Mutex>.
+static void SaveState() {
+  if (StateFileName == "")
+    return;
+  // Write to a temporary file and rename it, so that applications starting
+  // meanwhile never see a partial file.
+  string TempFileName = StateFileName + ".tmp";
+  {
+    ofstream StateFile(TempFileName.c_str());
+    for (map<string, Namespace>::iterator I = Namespaces.begin();
+         I != Namespaces.end(); ++I) {
+      const vector<RegisteredFilter> &Filters = I->second.Filters;
+      for (size_t i = 0; i < Filters.size(); ++i) {
+        if (Filters[i].InStateFile)
+          StateFile << I->first << " " << i << " " << Filters[i].FileName
+              << "\n";
+      }
+    }
+    if (!StateFile) {
+      errs() << "failed to write " << TempFileName << "\n";
+      return;
+    }
+  }
+  if (rename(TempFileName.c_str(), StateFileName.c_str()) == -1)
+    perror("rename");
+}
+
+// Registers filter <FilterID> as <FileName>.
+static void RegisterFilter(Namespace &NS,
+                           unsigned FilterID,
+                           const string &FileName,
+                           uint64_t Hash) {
+  RegisteredFilter &F = NS.Filters[FilterID];
+  F.FileName = FileName;
+  F.Hash = Hash;
+  NS.IDsByHash[Hash] = FilterID;
+}
+
+// Frees the ID of filter <FilterID> if nothing uses the filter.
+static void ReleaseIfUnused(Namespace &NS, unsigned FilterID) {
+  RegisteredFilter &F = NS.Filters[FilterID];
+  if (!F.isRegistered() || !F.isUnused())
+    return;
+  DenseMap<uint64_t, unsigned>::iterator I = NS.IDsByHash.find(F.Hash);
+  if (I != NS.IDsByHash.end() && I->second == FilterID)
+    NS.IDsByHash.erase(I);
+  F = RegisteredFilter();
+  NS.FreeIDs.push_back(FilterID);
+}
+
+static int LoadState() {
+  if (StateFileName == "")
+    return 0;
+  ifstream StateFile(StateFileName.c_str());
+  // No filter is installed yet.
+  if (!StateFile)
+    return 0;
+  string NamespaceName;
+  unsigned FilterID;
+  string FilterFileName;
+  while (StateFile >> NamespaceName >> FilterID >> FilterFileName) {
+    if (FilterID >= MaxNumFilters) {
+      errs() << StateFileName << ": invalid filter ID " << FilterID << "\n";
+      return -1;
+    }
+    uint64_t Hash = 0;
+    if (HashFile(FilterFileName, Hash) == -1)
+      errs() << StateFileName << ": cannot read " << FilterFileName << "\n";
+    Namespace &NS = Namespaces[NamespaceName];
+    RegisterFilter(NS, FilterID, FilterFileName, Hash);
+    NS.Filters[FilterID].InStateFile = true;
+    NS.NumUsedIDs = max(NS.NumUsedIDs, FilterID + 1);
+  }
+  // The IDs below NumUsedIDs that the state file does not list are free.
+  for (map<string, Namespace>::iterator I = Namespaces.begin();
+       I != Namespaces.end(); ++I) {
+    Namespace &NS = I->second;
+    for (unsigned i = NS.NumUsedIDs; i > 0; --i) {
+      if (!NS.Filters[i - 1].isRegistered())
+        NS.FreeIDs.push_back(i - 1);
+    }
+  }
+  return 0;
+}
+
+// Tracks which processes use which filters according to the responses of the
+// daemon of process <PID>. The watchdog of a daemon reports its rollbacks as
+// interim messages. The caller must hold <Mutex>.
+static void UpdateState(pid_t PID, const char *Response) {
+  unsigned FilterID;
+  char Action[16];
+  if (Response[0] == '+')
+    ++Response;
+  if (sscanf(Response, "filter %u is successfully %15s",
+             &FilterID, Action) != 2)
+    return;
+  if (FilterID >= MaxNumFilters || !DaemonNamespaces.count(PID))
+    return;
+  Namespace &NS = Namespaces[DaemonNamespaces[PID]];
+  RegisteredFilter &F = NS.Filters[FilterID];
+  if (!F.isRegistered())
+    return;
+  if (strcmp(Action, "added") == 0) {
+    F.Users.insert(PID);
+    F.InStateFile = true;
+  } else if (strcmp(Action, "shadowed") == 0) {
+    // A restarted application must not install a shadowed filter for real.
+    F.Users.insert(PID);
+  } else if (strcmp(Action, "deleted") == 0) {
+    F.Users.erase(PID);
+    F.InStateFile = false;
+    ReleaseIfUnused(NS, FilterID);
+  }
+  SaveState();
+}
+
+static void MergeHistogram(vector<unsigned long> &To, const string &From) {
+  istringstream IS(From);
+  string Count;
+  for (size_t i = 0; getline(IS, Count, ','); ++i) {
+    if (i >= To.size())
+      To.resize(i + 1);
+    To[i] += strtoul(Count.c_str(), NULL, 10);
+  }
+}
+
+// Merges the lock statistics a daemon reports. See ListLockStats in the Loom
+// runtime for the format. The caller must hold <Mutex>.
+static void MergeLockStats(map<FilterKey, LockStats> &AggregatedStats,
+                           pid_t PID,
+                           const char *Response) {
+  const string &NamespaceName = DaemonNamespaces[PID];
+  istringstream IS(Response);
+  string Line;
+  // Skip "lockstats".
+  getline(IS, Line);
+  while (getline(IS, Line)) {
+    istringstream LineStream(Line);
+    unsigned FilterID;
+    unsigned long NumAcquisitions, NumContended;
+    pid_t Owner;
+    string WaitHistogram, HoldHistogram;
+    // Skip the trailing "..." of a truncated report.
+    if (!(LineStream >> FilterID >> NumAcquisitions >> NumContended >> Owner
+          >> WaitHistogram >> HoldHistogram))
+      continue;
+    LockStats &Stats = AggregatedStats[FilterKey(NamespaceName, FilterID)];
+    Stats.NumAcquisitions += NumAcquisitions;
+    Stats.NumContended += NumContended;
+    MergeHistogram(Stats.WaitHistogram, WaitHistogram);
+    MergeHistogram(Stats.HoldHistogram, HoldHistogram);
+    if (Owner != 0) {
+      ostringstream OS;
+      OS << PID << "/" << Owner;
+      Stats.Owners.push_back(OS.str());
+    }
+  }
+}
 
-// needn't be protected, because it is only used by HandleControllerClient.
-static vector<string> FilterFileNames(MaxNumFilters);
+static string FormatDuration(unsigned long long Nanoseconds) {
+  ostringstream OS;
+  if (Nanoseconds < 1000)
+    OS << Nanoseconds << "ns";
+  else if (Nanoseconds < 1000000)
+    OS << Nanoseconds / 1000 << "us";
+  else if (Nanoseconds < 1000000000)
+    OS << Nanoseconds / 1000000 << "ms";
+  else
+    OS << Nanoseconds / 1000000000 << "s";
+  return OS.str();
+}
+
+// Returns the upper bound of the bucket that contains the <Percent>th
+// percentile.
+static string GetPercentile(const vector<unsigned long> &Histogram,
+                            unsigned Percent) {
+  unsigned long Total = 0;
+  for (size_t i = 0; i < Histogram.size(); ++i)
+    Total += Histogram[i];
+  if (Total == 0)
+    return "-";
+  unsigned long Rank = (Total * Percent + 99) / 100;
+  unsigned long Seen = 0;
+  size_t i;
+  for (i = 0; i + 1 < Histogram.size(); ++i) {
+    Seen += Histogram[i];
+    if (Seen >= Rank)
+      break;
+  }
+  if (i == 0)
+    return "0";
+  return "<" + FormatDuration(1ULL << i);
+}
+
+static void PrintLockStats(ostringstream &OS,
+                           const map<FilterKey, LockStats> &AggregatedStats,
+                           const FilterKey &Key) {
+  map<FilterKey, LockStats>::const_iterator I = AggregatedStats.find(Key);
+  if (I == AggregatedStats.end()) {
+    OS << "\t-\t-\t-\t-\t-";
+    return;
+  }
+  const LockStats &Stats = I->second;
+  OS << "\t" << Stats.NumAcquisitions << "\t" << Stats.NumContended;
+  OS << "\t" << GetPercentile(Stats.WaitHistogram, 50);
+  OS << "/" << GetPercentile(Stats.WaitHistogram, 99);
+  OS << "\t" << GetPercentile(Stats.HoldHistogram, 50);
+  OS << "/" << GetPercentile(Stats.HoldHistogram, 99);
+  OS << "\t";
+  if (Stats.Owners.empty())
+    OS << "-";
+  for (size_t i = 0; i < Stats.Owners.size(); ++i)
+    OS << (i ? "," : "") << Stats.Owners[i];
+}
+
+static void *RunWriter(void *Arg) {
+  Outbox *O = (Outbox *)Arg;
+  pthread_mutex_lock(&O->Lock);
+  while (true) {
+    while (O->Messages.empty() && !O->Closed)
+      pthread_cond_wait(&O->NonEmpty, &O->Lock);
+    if (O->Closed)
+      break;
+    pair<unsigned, string> M = O->Messages.front();
+    O->Messages.pop_front();
+    pthread_mutex_unlock(&O->Lock);
+    int Ret = SendTaggedMessage(O->Sock, M.first, M.second.c_str());
+    pthread_mutex_lock(&O->Lock);
+    if (Ret == -1) {
+      O->Broken = true;
+      O->Messages.clear();
+      // Wake up the thread reading <Sock>, which cleans up.
+      shutdown(O->Sock, SHUT_RDWR);
+      break;
+    }
+  }
+  pthread_mutex_unlock(&O->Lock);
+  return NULL;
+}
+
+// Starts the writer thread of <Sock>. Returns -1 on failure.
+static int OpenOutbox(int Sock) {
+  Outbox *O = new Outbox(Sock);
+  if (pthread_create(&O->Writer, NULL, RunWriter, O) != 0) {
+    perror("pthread_create");
+    delete O;
+    return -1;
+  }
+  pthread_mutex_lock(&Mutex);
+  Outboxes[Sock] = O;
+  pthread_mutex_unlock(&Mutex);
+  return 0;
+}
 
-static int HandleDaemon(int ClientSock, pid_t PID) {
+// Stops the writer thread of <Sock>, dropping the messages not sent yet. The
+// connection is ending, so nobody reads them.
+static void CloseOutbox(int Sock) {
+  pthread_mutex_lock(&Mutex);
+  map<int, Outbox *>::iterator I = Outboxes.find(Sock);
+  Outbox *O = I->second;
+  Outboxes.erase(I);
+  pthread_mutex_unlock(&Mutex);
+
+  pthread_mutex_lock(&O->Lock);
+  O->Closed = true;
+  pthread_cond_signal(&O->NonEmpty);
+  pthread_mutex_unlock(&O->Lock);
+  // Fail a send blocking on a peer that stops reading.
+  shutdown(Sock, SHUT_RDWR);
+  pthread_join(O->Writer, NULL);
+  delete O;
+}
+
+// Queues message <M> with tag <Tag> to <Sock> without blocking. Returns -1 if
+// an earlier send to <Sock> failed. The caller must hold <Mutex>.
+static int QueueMessage(int Sock, unsigned Tag, const string &M) {
+  map<int, Outbox *>::iterator I = Outboxes.find(Sock);
+  if (I == Outboxes.end())
+    return -1;
+  Outbox *O = I->second;
+  int Ret = 0;
+  pthread_mutex_lock(&O->Lock);
+  if (O->Broken) {
+    Ret = -1;
+  } else {
+    O->Messages.push_back(make_pair(Tag, M));
+    pthread_cond_signal(&O->NonEmpty);
+  }
+  pthread_mutex_unlock(&O->Lock);
+  return Ret;
+}
+
+// The caller must hold <Mutex>.
+static void Reply(int ClientSock, unsigned RequestID, const string &Response) {
+  if (ClientSock == -1)
+    return;
+  QueueMessage(ClientSock, RequestID, Response);
+}
+
+// Replies to ls <R>. The caller must hold <Mutex>.
+static void SendFilterList(const Request &R) {
+  vector<FilterKey> Keys;
+  if (R.ListingAllFilters) {
+    for (map<string, Namespace>::iterator I = Namespaces.begin();
+         I != Namespaces.end(); ++I) {
+      const vector<RegisteredFilter> &Filters = I->second.Filters;
+      for (size_t i = 0; i < Filters.size(); ++i) {
+        if (Filters[i].isRegistered())
+          Keys.push_back(FilterKey(I->first, i));
+      }
+    }
+  } else {
+    for (map<FilterKey, LockStats>::const_iterator I =
+             R.AggregatedStats.begin();
+         I != R.AggregatedStats.end(); ++I) {
+      Keys.push_back(I->first);
+    }
+  }
+
+  string Message = "namespace\tID\tfile\tprocesses\tacquired\tcontended"
+      "\twait p50/p99\thold p50/p99\towners";
+  for (size_t i = 0; i < Keys.size(); ++i) {
+    const RegisteredFilter &F =
+        Namespaces[Keys[i].first].Filters[Keys[i].second];
+    ostringstream OS;
+    OS << "\n" << Keys[i].first << "\t" << Keys[i].second << "\t"
+        << (F.isRegistered() ? F.FileName : "?") << "\t" << F.Users.size();
+    PrintLockStats(OS, R.AggregatedStats, Keys[i]);
+    // Leave room for the trailing "\n...".
+    if (Message.length() + OS.str().length() + 5 >= MaxBufferSize) {
+      Message += "\n...";
+      break;
+    }
+    Message += OS.str();
+  }
+  Reply(R.ClientSock, R.RequestID, Message);
+}
+
+// Returns a new tag for request <RequestID> of client <ClientSock>. The caller
+// must hold <Mutex>.
+static unsigned NewRequest(int ClientSock, unsigned RequestID) {
+  unsigned Tag = NextTag++;
+  // Tag 0 is for messages nobody asked for.
+  if (NextTag == 0)
+    NextTag = 1;
+  Requests[Tag].ClientSock = ClientSock;
+  Requests[Tag].RequestID = RequestID;
+  return Tag;
+}
+
+// Erases an answered request. The filter an add installs is released if the
+// add failed. The caller must hold <Mutex>.
+static void FinishRequest(map<unsigned, Request>::iterator I) {
+  Request &R = I->second;
+  if (R.FilterID != (unsigned)-1) {
+    Namespace &NS = Namespaces[R.NamespaceName];
+    --NS.Filters[R.FilterID].NumPendingAdds;
+    ReleaseIfUnused(NS, R.FilterID);
+  }
+  Requests.erase(I);
+}
+
+// Counts process <PID> as a user of the filters it reports, e.g. the filters
+// it loads from the state file. The caller must hold <Mutex>.
+static void SyncFilters(pid_t PID, const char *Response) {
+  Namespace &NS = Namespaces[DaemonNamespaces[PID]];
+  istringstream IS(Response);
+  string Word;
+  // Skip "filter IDs:".
+  IS >> Word >> Word;
+  unsigned FilterID;
+  while (IS >> FilterID) {
+    if (FilterID < MaxNumFilters && NS.Filters[FilterID].isRegistered())
+      NS.Filters[FilterID].Users.insert(PID);
+    else
+      errs() << "process " << PID << " has an unknown filter " << FilterID
+          << "\n";
+  }
+}
+
+// Routes a message from the daemon of process <PID> to the client whose
+// request it answers. The caller must hold <Mutex>.
+static void RouteResponse(int DaemonSock,
+                          pid_t PID,
+                          unsigned Tag,
+                          const char *Response) {
+  if (Tag == 0) {
+    // e.g. a rollback by the watchdog. Tell all clients.
+    errs() << "process " << PID << ": " << Response << "\n";
+    for (set<int>::iterator I = CtrlClientSocks.begin();
+         I != CtrlClientSocks.end(); ++I) {
+      Reply(*I, 0, Response);
+    }
+    return;
+  }
+
+  map<unsigned, Request>::iterator I = Requests.find(Tag);
+  if (I == Requests.end()) {
+    errs() << "process " << PID << ": unexpected response " << Response
+        << "\n";
+    return;
+  }
+  Request &R = I->second;
+  if (R.IsSync) {
+    SyncFilters(PID, Response);
+    FinishRequest(I);
+    return;
+  }
+  if (R.IsListing) {
+    // Lock statistics are aggregated instead of forwarded.
+    if (R.PendingDaemons.erase(DaemonSock) &&
+        strncmp(Response, "lockstats", strlen("lockstats")) == 0)
+      MergeLockStats(R.AggregatedStats, PID, Response);
+    if (R.PendingDaemons.empty()) {
+      SendFilterList(R);
+      FinishRequest(I);
+    }
+    return;
+  }
+  Reply(R.ClientSock, R.RequestID, Response);
+  // Interim messages start with '+'. The final response is yet to come.
+  if (Response[0] != '+')
+    FinishRequest(I);
+}
+
+// Answers the requests waiting for the daemon of process <PID> on
+// <DaemonSock>, which has exited, and releases the filters the process uses
+// unless it is still connected through another socket. The caller must have
+// removed <DaemonSock> from <Daemons> and must hold <Mutex>.
+static void ForgetDaemon(int DaemonSock, pid_t PID) {
+  map<unsigned, Request>::iterator I = Requests.begin();
+  while (I != Requests.end()) {
+    map<unsigned, Request>::iterator Next = I;
+    ++Next;
+    Request &R = I->second;
+    if (R.IsListing) {
+      // Do not let ls wait for this daemon.
+      if (R.PendingDaemons.erase(DaemonSock) && R.PendingDaemons.empty()) {
+        SendFilterList(R);
+        FinishRequest(I);
+      }
+    } else if (R.DaemonSock == DaemonSock) {
+      if (!R.IsSync)
+        Reply(R.ClientSock, R.RequestID, "the process exited");
+      FinishRequest(I);
+    }
+    I = Next;
+  }
+
+  // The process has reconnected through another socket, which has
+  // registered the process again and reported the filters it still uses.
+  if (Daemons.count(PID))
+    return;
+
+  Namespace &NS = Namespaces[DaemonNamespaces[PID]];
+  for (unsigned i = 0; i < NS.NumUsedIDs; ++i) {
+    if (NS.Filters[i].Users.erase(PID))
+      ReleaseIfUnused(NS, i);
+  }
+  DaemonNamespaces.erase(PID);
+}
+
+static int HandleDaemon(int ClientSock,
+                        pid_t PID,
+                        const string &NamespaceName) {
   pthread_mutex_lock(&Mutex);
   Daemons[PID] = ClientSock;
+  DaemonNamespaces[PID] = NamespaceName;
+  // Ask for the filters the process already has.
+  unsigned SyncTag = NewRequest(-1, 0);
+  Requests[SyncTag].DaemonSock = ClientSock;
+  Requests[SyncTag].IsSync = true;
+  if (QueueMessage(ClientSock, SyncTag, "ls") == -1)
+    Requests.erase(SyncTag);
   pthread_mutex_unlock(&Mutex);
 
+  unsigned Tag;
   char Response[MaxBufferSize];
-  while (ReceiveMessage(ClientSock, Response) == 0) {
+  while (ReceiveTaggedMessage(ClientSock, &Tag, Response) == 0) {
     pthread_mutex_lock(&Mutex);
-    if (CtrlClientSock == -1) {
-      errs() << "Loom controller client is not started yet\n";
-      pthread_mutex_unlock(&Mutex);
-      continue;
-    }
-    int Sock = CtrlClientSock;
+    UpdateState(PID, Response);
+    RouteResponse(ClientSock, PID, Tag, Response);
     pthread_mutex_unlock(&Mutex);
-
-    // Forward the response to the controller client.
-    // TODO: The controller client may receive multiple responses from a
-    // multiprocess program. We could have better handle this situation by
-    // sending OK only when all processes have successfully installed the
-    // filter, and deleting the filter if any process fails.
-    SendMessage(Sock, Response);
   }
 
   // Remove <ClientSock> from <Daemons>.
@@ -59,164 +658,280 @@ static int HandleDaemon(int ClientSock, pid_t PID) {
       break;
     }
   }
+  ForgetDaemon(ClientSock, PID);
   pthread_mutex_unlock(&Mutex);
 
   return 0;
 }
 
-static unsigned getFilterID(const string &FilterFileName) {
-  // Reuse the filter ID if this filter is already installed.
-  vector<string>::iterator Pos = find(FilterFileNames.begin(),
-                                      FilterFileNames.end(),
-                                      FilterFileName);
-  if (Pos != FilterFileNames.end())
-    return Pos - FilterFileNames.begin();
+// Returns the ID of the filter with the same content as <FilterFileName>, or
+// a free ID. Returns -1 if all filter IDs are used. The caller must hold
+// <Mutex>.
+static unsigned getFilterID(Namespace &NS,
+                            const string &FilterFileName,
+                            uint64_t Hash) {
+  // Reuse the filter ID if this filter is already registered.
+  DenseMap<uint64_t, unsigned>::iterator I = NS.IDsByHash.find(Hash);
+  if (I != NS.IDsByHash.end())
+    return I->second;
 
-  // Find the first unused ID.
-  Pos = find(FilterFileNames.begin(), FilterFileNames.end(), "");
-  if (Pos == FilterFileNames.end()) {
-    SendMessage(CtrlClientSock, "too many filters");
+  unsigned FilterID;
+  if (!NS.FreeIDs.empty()) {
+    FilterID = NS.FreeIDs.back();
+    NS.FreeIDs.pop_back();
+  } else if (NS.NumUsedIDs < MaxNumFilters) {
+    FilterID = NS.NumUsedIDs++;
+  } else {
     return -1;
   }
-  *Pos = FilterFileName;
-  return Pos - FilterFileNames.begin();
+  RegisterFilter(NS, FilterID, FilterFileName, Hash);
+  return FilterID;
 }
 
-static void HandleAddFilter(pid_t PID, const string &FilterFileName) {
-  unsigned FilterID = getFilterID(FilterFileName);
-  if (FilterID == (unsigned)-1)
+// Forwards a command, e.g. "trace on" or "threads", to the daemon of process
+// <PID>, which answers the client later. If the command adds filter
+// <FilterID>, the filter stays registered until the daemon answers. The caller
+// must hold <Mutex>.
+static void ForwardToDaemon(int ClientSock,
+                            unsigned RequestID,
+                            pid_t PID,
+                            const string &Cmd,
+                            unsigned FilterID = -1) {
+  map<pid_t, int>::iterator I = Daemons.find(PID);
+  if (I == Daemons.end()) {
+    Reply(ClientSock, RequestID, "no such process");
     return;
+  }
+  unsigned Tag = NewRequest(ClientSock, RequestID);
+  Request &R = Requests[Tag];
+  R.DaemonSock = I->second;
+  if (FilterID != (unsigned)-1) {
+    R.FilterID = FilterID;
+    R.NamespaceName = DaemonNamespaces[PID];
+    ++Namespaces[R.NamespaceName].Filters[FilterID].NumPendingAdds;
+  }
+  if (QueueMessage(I->second, Tag, Cmd) == -1) {
+    FinishRequest(Requests.find(Tag));
+    Reply(ClientSock, RequestID, "failed to communicate with this process");
+  }
+  // otherwise, expect the daemon to send the response back
+}
 
-  pthread_mutex_lock(&Mutex);
-  if (!Daemons.count(PID)) {
-    pthread_mutex_unlock(&Mutex);
-    SendMessage(CtrlClientSock, "no such process");
+// The caller must hold <Mutex>.
+static void HandleAddFilter(int ClientSock,
+                            unsigned RequestID,
+                            pid_t PID,
+                            const string &FilterFileName,
+                            const string &Options) {
+  if (!DaemonNamespaces.count(PID)) {
+    Reply(ClientSock, RequestID, "no such process");
+    return;
+  }
+  uint64_t Hash;
+  if (HashFile(FilterFileName, Hash) == -1) {
+    Reply(ClientSock, RequestID, "cannot read " + FilterFileName);
+    return;
+  }
+  Namespace &NS = Namespaces[DaemonNamespaces[PID]];
+  unsigned FilterID = getFilterID(NS, FilterFileName, Hash);
+  if (FilterID == (unsigned)-1) {
+    Reply(ClientSock, RequestID, "too many filters");
     return;
   }
-  int DaemonSock = Daemons[PID];
-  pthread_mutex_unlock(&Mutex);
 
   ostringstream OS;
-  OS << "add " << FilterID << " " << FilterFileName;
-  if (SendMessage(DaemonSock, OS.str().c_str()) == -1)
-    SendMessage(CtrlClientSock, "failed to communicate with this process");
-  // otherwise, expect the daemon to send the response back
+  OS << "add " << FilterID << " " << FilterFileName << Options;
+  ForwardToDaemon(ClientSock, RequestID, PID, OS.str(), FilterID);
 }
 
-static void HandleDeleteFilter(pid_t PID, unsigned FilterID) {
-  if (FilterID >= MaxNumFilters) {
-    SendMessage(CtrlClientSock, "invalid ID");
+// The caller must hold <Mutex>.
+static void HandleDeleteFilter(int ClientSock,
+                               unsigned RequestID,
+                               pid_t PID,
+                               unsigned FilterID,
+                               const string &Options) {
+  if (!DaemonNamespaces.count(PID)) {
+    Reply(ClientSock, RequestID, "no such process");
     return;
   }
-  if (FilterFileNames[FilterID] == "") {
-    SendMessage(CtrlClientSock, "no such filter ID");
+  if (FilterID >= MaxNumFilters) {
+    Reply(ClientSock, RequestID, "invalid ID");
     return;
   }
-  // TODO: a filter may still be used after the controller deletes it from one
-  // process but not all. For simplicity, we never reclaim a filter ID. This
-  // could be improved by keeping track of how many processes are using a
-  // filter.
-
-  pthread_mutex_lock(&Mutex);
-  if (!Daemons.count(PID)) {
-    pthread_mutex_unlock(&Mutex);
-    SendMessage(CtrlClientSock, "no such process");
+  // The ID is freed when no process uses the filter any more.
+  if (!Namespaces[DaemonNamespaces[PID]].Filters[FilterID].isRegistered()) {
+    Reply(ClientSock, RequestID, "no such filter ID");
     return;
   }
-  int DaemonSock = Daemons[PID];
-  pthread_mutex_unlock(&Mutex);
 
   ostringstream OS;
-  OS << "del " << FilterID;
-  if (SendMessage(DaemonSock, OS.str().c_str()) == -1)
-    SendMessage(CtrlClientSock, "failed to communicate with this process");
-  // otherwise, expect the daemon to send the response back
+  OS << "del " << FilterID << Options;
+  ForwardToDaemon(ClientSock, RequestID, PID, OS.str());
 }
-
-static void HandleListFilters(pid_t PID = -1) {
-  if (PID == -1) {
-    ostringstream OS;
-    OS << "ID\tfile";
-    for (size_t i = 0; i < FilterFileNames.size(); ++i) {
-      if (FilterFileNames[i] != "") {
-        OS << "\n" << i << "\t" << FilterFileNames[i];
-      }
-    }
-    SendMessage(CtrlClientSock, OS.str().c_str());
+static void HandleListFilters(int ClientSock,
+                              unsigned RequestID,
+                              pid_t PID = -1) {
+  if (PID != -1 && !Daemons.count(PID)) {
+    Reply(ClientSock, RequestID, "no such process");
     return;
   }
+  unsigned Tag = NewRequest(ClientSock, RequestID);
+  Request &R = Requests[Tag];
+  R.IsListing = true;
+  R.ListingAllFilters = (PID == -1);
+  for (map<pid_t, int>::iterator I = Daemons.begin(); I != Daemons.end(); ++I) {
+    if (PID == -1 || I->first == PID) {
+      if (QueueMessage(I->second, Tag, "lockstats") == 0)
+        R.PendingDaemons.insert(I->second);
+    }
+  }
+  // Otherwise, RouteResponse replies when all daemons answer.
+  if (R.PendingDaemons.empty()) {
+    SendFilterList(R);
+    Requests.erase(Tag);
+  }
+}
 
-  pthread_mutex_lock(&Mutex);
+// Asks the daemon to cancel the ongoing update, which may come from any client.
+// The daemon reports the cancellation to the client that issued the update.
+// The caller must hold <Mutex>.
+static void HandleCancel(int ClientSock, unsigned RequestID, pid_t PID) {
   if (!Daemons.count(PID)) {
-    SendMessage(CtrlClientSock, "no such process");
-    pthread_mutex_unlock(&Mutex);
+    Reply(ClientSock, RequestID, "no such process");
     return;
   }
-  SendMessage(Daemons[PID], "ls");
-  pthread_mutex_unlock(&Mutex);
+  // The daemon does not answer "cancel".
+  if (QueueMessage(Daemons[PID], 0, "cancel") == -1)
+    Reply(ClientSock, RequestID, "failed to communicate with this process");
+  else
+    Reply(ClientSock, RequestID, "cancellation is sent");
 }
 
-static void HandleListDaemons() {
+// The caller must hold <Mutex>.
+static void HandleListDaemons(int ClientSock, unsigned RequestID) {
   ostringstream OS;
-  OS << "PID\tsocket";
+  OS << "PID\tsocket\tnamespace";
   for (map<pid_t, int>::iterator I = Daemons.begin(); I != Daemons.end(); ++I) {
-    OS << "\n" << I->first << "\t" << I->second;
+    OS << "\n" << I->first << "\t" << I->second << "\t"
+        << DaemonNamespaces[I->first];
   }
-  SendMessage(CtrlClientSock, OS.str().c_str());
+  Reply(ClientSock, RequestID, OS.str());
 }
 
+// Handles command <Cmd> with ID <RequestID> from client <ClientSock>. Commands
+// that daemons answer return before the answers, so that a client may send
+// more commands meanwhile. The caller must hold <Mutex>.
+static void HandleCommand(int ClientSock,
+                          unsigned RequestID,
+                          const char *Cmd) {
+  istringstream IS(Cmd);
+  string Op;
+  if (!(IS >> Op)) {
+    Reply(ClientSock, RequestID, "wrong format");
+    return;
+  }
+  if (Op == "add") {
+    pid_t PID;
+    string FilterFileName, Options;
+    if (!(IS >> PID >> FilterFileName)) {
+      Reply(ClientSock, RequestID, "wrong format");
+      return;
+    }
+    // Pass the options, e.g. timeout=<ms>, to the daemon as is.
+    getline(IS, Options);
+    HandleAddFilter(ClientSock, RequestID, PID, FilterFileName, Options);
+  } else if (Op == "del") {
+    pid_t PID;
+    unsigned FilterID;
+    string Options;
+    if (!(IS >> PID >> FilterID)) {
+      Reply(ClientSock, RequestID, "wrong format");
+      return;
+    }
+    getline(IS, Options);
+    HandleDeleteFilter(ClientSock, RequestID, PID, FilterID, Options);
+  } else if (Op == "ls") {
+    unsigned PID;
+    if (!(IS >> PID))
+      HandleListFilters(ClientSock, RequestID);
+    else
+      HandleListFilters(ClientSock, RequestID, PID);
+  } else if (Op == "ps") {
+    HandleListDaemons(ClientSock, RequestID);
+  } else if (Op == "cancel") {
+    pid_t PID;
+    if (!(IS >> PID)) {
+      Reply(ClientSock, RequestID, "wrong format");
+      return;
+    }
+    HandleCancel(ClientSock, RequestID, PID);
+  } else if (Op == "trace") {
+    pid_t PID;
+    string Args;
+    if (!(IS >> PID)) {
+      Reply(ClientSock, RequestID, "wrong format");
+      return;
+    }
+    getline(IS, Args);
+    ForwardToDaemon(ClientSock, RequestID, PID, "trace" + Args);
+  } else if (Op == "threads") {
+    pid_t PID;
+    if (!(IS >> PID)) {
+      Reply(ClientSock, RequestID, "wrong format");
+      return;
+    }
+    ForwardToDaemon(ClientSock, RequestID, PID, "threads");
+  } else if (Op == "shadowstats") {
+    pid_t PID;
+    if (!(IS >> PID)) {
+      Reply(ClientSock, RequestID, "wrong format");
+      return;
+    }
+    ForwardToDaemon(ClientSock, RequestID, PID, "shadowstats");
+  } else if (Op == "probes") {
+    pid_t PID;
+    if (!(IS >> PID)) {
+      Reply(ClientSock, RequestID, "wrong format");
+      return;
+    }
+    ForwardToDaemon(ClientSock, RequestID, PID, "probes");
+  } else if (Op == "intervals") {
+    pid_t PID;
+    if (!(IS >> PID)) {
+      Reply(ClientSock, RequestID, "wrong format");
+      return;
+    }
+    ForwardToDaemon(ClientSock, RequestID, PID, "intervals");
+  } else {
+    Reply(ClientSock, RequestID, "unknown command");
+  }
+}
+
+// Any number of controller clients may connect at the same time, and each may
+// send commands without waiting for the responses of the previous ones.
 static int HandleControllerClient(int ClientSock) {
   pthread_mutex_lock(&Mutex);
-  if (CtrlClientSock != -1) {
-    errs() << "another Loom controller client is running\n";
-    pthread_mutex_unlock(&Mutex);
-    return -1;
-  }
-  CtrlClientSock = ClientSock;
+  CtrlClientSocks.insert(ClientSock);
   pthread_mutex_unlock(&Mutex);
 
+  unsigned RequestID;
   char Cmd[MaxBufferSize];
-  // benign race when reading <CtrlClientSock>
-  while (ReceiveMessage(CtrlClientSock, Cmd) == 0) {
-    istringstream IS(Cmd);
-    string Op;
-    if (!(IS >> Op)) {
-      SendMessage(CtrlClientSock, "wrong format");
-      continue;
-    }
-    if (Op == "add") {
-      pid_t PID;
-      string FilterFileName;
-      if (!(IS >> PID >> FilterFileName)) {
-        SendMessage(CtrlClientSock, "wrong format");
-        continue;
-      }
-      HandleAddFilter(PID, FilterFileName);
-    } else if (Op == "del") {
-      pid_t PID;
-      unsigned FilterID;
-      if (!(IS >> PID >> FilterID)) {
-        SendMessage(CtrlClientSock, "wrong format");
-        continue;
-      }
-      HandleDeleteFilter(PID, FilterID);
-    } else if (Op == "ls") {
-      unsigned PID;
-      if (!(IS >> PID))
-        HandleListFilters();
-      else
-        HandleListFilters(PID);
-    } else if (Op == "ps") {
-      HandleListDaemons();
-    } else {
-      SendMessage(CtrlClientSock, "unknown command");
-    }
+  while (ReceiveTaggedMessage(ClientSock, &RequestID, Cmd) == 0) {
+    pthread_mutex_lock(&Mutex);
+    HandleCommand(ClientSock, RequestID, Cmd);
+    pthread_mutex_unlock(&Mutex);
   }
 
   outs() << "Loom controller client exits.\n";
-  // Reset <CtrlClientSock> to allow another controller.
+  // Drop the answers to its pending requests, because HandleClient closes
+  // <ClientSock> afterwards.
   pthread_mutex_lock(&Mutex);
-  CtrlClientSock = -1;
+  CtrlClientSocks.erase(ClientSock);
+  for (map<unsigned, Request>::iterator I = Requests.begin();
+       I != Requests.end(); ++I) {
+    if (I->second.ClientSock == ClientSock)
+      I->second.ClientSock = -1;
+  }
   pthread_mutex_unlock(&Mutex);
 
   return 0;
@@ -233,21 +948,33 @@ static void *HandleClient(void *Arg) {
   }
 
   int Ret = 0;
-  if (strncmp(Buffer, "iam loom_daemon", strlen("iam loom_daemon")) == 0) {
+  bool IsDaemon =
+      (strncmp(Buffer, "iam loom_daemon", strlen("iam loom_daemon")) == 0);
+  if (!IsDaemon && strcmp(Buffer, "iam loom_ctl") != 0) {
+    outs() << "connected by an unknown client. ";
+    outs() << "close the connection immediately\n";
+    close(ClientSock);
+    return (void *)Ret;
+  }
+
+  if (OpenOutbox(ClientSock) == -1) {
+    close(ClientSock);
+    return (void *)-1;
+  }
+  if (IsDaemon) {
     outs() << "conntected by a Loom daemon\n";
     pid_t PID;
-    if (sscanf(Buffer, "iam loom_daemon %d", &PID) != 1)
+    char NamespaceName[MaxBufferSize];
+    if (sscanf(Buffer, "iam loom_daemon %d %s", &PID, NamespaceName) != 2)
       Ret = -1;
     else
-      Ret = HandleDaemon(ClientSock, PID);
-  } else if (strcmp(Buffer, "iam loom_ctl") == 0) {
+      Ret = HandleDaemon(ClientSock, PID, NamespaceName);
+  } else {
     outs() << "connected by a Loom controller client\n";
     Ret = HandleControllerClient(ClientSock);
-  } else {
-    outs() << "connected by an unknown client. ";
-    outs() << "close the connection immediately\n";
   }
 
+  CloseOutbox(ClientSock);
   close(ClientSock);
   return (void *)Ret;
 }
@@ -256,6 +983,11 @@ int loom::RunControllerServer() {
   // Ignore SIGPIPE.
   signal(SIGPIPE, SIG_IGN);
 
+  // Reuse the filter IDs of the installed filters, because applications
+  // started with the state file use them.
+  if (LoadState() == -1)
+    return -1;
+
   int AcceptSock = socket(AF_INET, SOCK_STREAM, 0);
   if (AcceptSock == -1) {
     perror("socket");
@@ -26,6 +26,21 @@ static cl::opt<CtlAction> ControllerAction(
         clEnumVal(del, "Delete an execution filter: -del <PID> <filter ID>"),
         clEnumVal(ls, "List all filters or filters on a process: -ls [PID]"),
         clEnumVal(ps, "List all daemon processes: -ps"),
+        clEnumVal(cancel, "Cancel the ongoing update on a process: "
+                  "-cancel <PID>"),
+        clEnumVal(trace, "Trace the Loom runtime of a process: "
+                  "-trace <PID> on|off|dump <file>"),
+        clEnumVal(threads, "List the threads of a process and what they are "
+                  "doing: -threads <PID>"),
+        clEnumVal(shadowstats, "Show what the filters added with -shadow "
+                  "would cost: -shadowstats <PID>"),
+        clEnumVal(probes, "Show the hit counts of the probes on a process: "
+                  "-probes <PID>"),
+        clEnumVal(intervals, "Show the latency percentiles measured by the "
+                  "latency probes on a process: -intervals <PID>"),
+        clEnumVal(session, "Read commands from the standard input, one per "
+                  "line, e.g. \"add <PID> <file>\", and send them without "
+                  "waiting for responses: -session"),
         clEnumValEnd),
     cl::init(server));
 static cl::list<string> Args(cl::Positional, cl::desc("<arguments>..."));
@@ -8,7 +8,8 @@ using namespace llvm;
 namespace loom {
 
 enum CtlAction {
-  server, add, del, ls, ps
+  server, add, del, ls, ps, cancel, trace, threads, shadowstats,
+  probes, intervals, session
 };
 
 int RunControllerServer();
@@ -1,17 +1,102 @@
 #!/usr/bin/env python
 
 import os
+import sys
+import json
 import rcs_utils
 import argparse
+import multiprocessing.pool
+
+def read_manifest(manifest):
+    hashes = []
+    with open(manifest) as f:
+        for line in f:
+            hashes.append(line.split()[0])
+    return hashes
+
+def invoke_parallel(cmds, jobs):
+    for cmd in cmds:
+        print >> sys.stderr, cmd
+    pool = multiprocessing.pool.ThreadPool(jobs)
+    rets = pool.map(os.system, cmds)
+    pool.close()
+    pool.join()
+    if any(ret != 0 for ret in rets):
+        print >> sys.stderr, 'some jobs failed'
+        sys.exit(1)
+
+def merge_reports(report, jobs):
+    # Each job reports the functions in its own partition. Add up the totals,
+    # and the pass times, which become the CPU time spent over all jobs.
+    module = None
+    total = {}
+    pass_seconds = {}
+    functions = []
+    for i in xrange(jobs):
+        with open(report + '.' + str(i)) as f:
+            r = json.load(f)
+        module = r['module']
+        for k, v in r['total'].iteritems():
+            total[k] = total.get(k, 0) + v
+        for k, v in r['pass_seconds'].iteritems():
+            pass_seconds[k] = pass_seconds.get(k, 0.0) + v
+        functions.extend(r['functions'])
+    functions.sort(key = lambda c: c['name'])
+    with open(report, 'w') as f:
+        f.write('{"module": %s,\n' % json.dumps(module))
+        f.write('"total": %s,\n' % json.dumps(total, sort_keys = True))
+        f.write('"pass_seconds": %s,\n' %
+                json.dumps(pass_seconds, sort_keys = True))
+        f.write('"functions": [')
+        f.write(','.join('\n' + json.dumps(c, sort_keys = True)
+                         for c in functions))
+        f.write('\n]}\n')
+    for i in xrange(jobs):
+        os.remove(report + '.' + str(i))
 
 if __name__ == '__main__':
     parser = argparse.ArgumentParser(
             description = 'insert Loom update engine to the program')
     parser.add_argument('prog', help = 'the program name (e.g. mysqld)')
+    parser.add_argument('--incremental', action = 'store_true',
+                        help = 'compile each function separately, and ' +
+                               'reuse the object code of functions that ' +
+                               'did not change since the last build')
+    parser.add_argument('-j', '--jobs', type = int, default = 1,
+                        help = 'number of parallel instrumentation and ' +
+                               'code generation jobs, each emitting one ' +
+                               'module (one per function with --incremental)')
+    parser.add_argument('--blocking-funcs',
+                        help = 'a file listing the external functions that ' +
+                               'may block, one per line (default: a ' +
+                               'built-in list)')
+    parser.add_argument('--no-blocking-wrappers', action = 'store_true',
+                        help = 'instrument the blocking calls inside ' +
+                               'functions that always block, instead of ' +
+                               'the calls to these functions')
+    parser.add_argument('--no-coalesce-blocking-cs', action = 'store_true',
+                        help = 'release the update lock around each ' +
+                               'blocking call, instead of once around ' +
+                               'consecutive ones')
+    parser.add_argument('--track-activations', action = 'store_true',
+                        help = 'count the running activations of each ' +
+                               'function, so that updates only stop the ' +
+                               'threads running the patched functions')
+    parser.add_argument('--preemptible', action = 'store_true',
+                        help = 'allow updates to preempt threads running ' +
+                               'uninstrumented code')
+    parser.add_argument('--report',
+                        help = 'write what the instrumentation costs each ' +
+                               'function to REPORT in JSON')
     args = parser.parse_args()
 
     instrumented_bc = args.prog + '.loom.bc'
     instrumented_exe = args.prog + '.loom'
+    loc_index = args.prog + '.loom.idx'
+    id_map = args.prog + '.loom.ids'
+    new_id_map = id_map + '.new'
+    cache_dir = args.prog + '.loom.cache'
+    manifest = os.path.join(cache_dir, 'manifest')
 
     # TODO: loom_utils.load_all_plugins
     cmd = rcs_utils.load_plugin('opt', 'RCSID')
@@ -19,16 +104,101 @@ if __name__ == '__main__':
     cmd = rcs_utils.load_plugin(cmd, 'libLoomUtils')
     cmd = rcs_utils.load_plugin(cmd, 'LoomAnalysis')
     cmd = rcs_utils.load_plugin(cmd, 'LoomInstrumenter')
-    cmd = ' '.join((cmd, '-break-crit-invokes', '-insert-checks', '-clone-bbs'))
-    cmd = ' '.join((cmd, '-o', instrumented_bc))
-    cmd = ' '.join((cmd, '<', args.prog + '.bc'))
-    rcs_utils.invoke(cmd)
+    if args.blocking_funcs is not None:
+        cmd = ' '.join((cmd, '-blocking-funcs', args.blocking_funcs))
+    if args.no_blocking_wrappers:
+        cmd = ' '.join((cmd, '-blocking-wrappers=false'))
+    if args.no_coalesce_blocking_cs:
+        cmd = ' '.join((cmd, '-coalesce-blocking-cs=false'))
+    if args.track_activations:
+        cmd = ' '.join((cmd, '-loom-track-activations'))
+    if args.preemptible:
+        cmd = ' '.join((cmd, '-loom-preemptible'))
+    # Keep the IDs of unchanged functions, so that their cached object code and
+    # the filters written for the previous build stay valid.
+    cmd = ' '.join((cmd, '-loom-id-map', id_map))
+    if not args.incremental and args.jobs == 1:
+        # Build the source location index before instrumenting, so that it
+        # only covers instructions in the original program.
+        cmd = ' '.join((cmd, '-build-loc-index', '-output-loc-index',
+                        loc_index))
+        cmd = ' '.join((cmd, '-loom-output-id-map', new_id_map))
+        cmd = ' '.join((cmd, '-break-crit-invokes', '-insert-checks',
+                        '-clone-bbs'))
+        if args.report is not None:
+            cmd = ' '.join((cmd, '-loom-report', args.report))
+        cmd = ' '.join((cmd, '-o', instrumented_bc))
+        cmd = ' '.join((cmd, '<', args.prog + '.bc'))
+        rcs_utils.invoke(cmd)
+        os.rename(new_id_map, id_map)
+        inputs = instrumented_bc
+    else:
+        if not os.path.isdir(cache_dir):
+            os.makedirs(cache_dir)
+        # Each job loads the whole program, so that all jobs agree on the IDs,
+        # but only instruments and emits its own partition of the functions:
+        # one module per function with --incremental, and one module for the
+        # whole partition otherwise, which keeps inlining within it.
+        cmds = []
+        for i in xrange(args.jobs):
+            job_cmd = cmd
+            if i == 0:
+                job_cmd = ' '.join((job_cmd, '-build-loc-index',
+                                    '-output-loc-index', loc_index))
+                job_cmd = ' '.join((job_cmd, '-loom-output-id-map',
+                                    new_id_map))
+            job_cmd = ' '.join((job_cmd, '-loom-num-partitions', str(args.jobs),
+                                '-loom-partition', str(i)))
+            job_cmd = ' '.join((job_cmd, '-break-crit-invokes',
+                                '-insert-checks', '-clone-bbs'))
+            if args.report is not None:
+                job_cmd = ' '.join((job_cmd, '-loom-report',
+                                    args.report + '.' + str(i)))
+            job_cmd = ' '.join((job_cmd, '-split-functions',
+                                '-split-dir', cache_dir,
+                                '-split-manifest', manifest + '.' + str(i)))
+            if not args.incremental:
+                job_cmd = ' '.join((job_cmd, '-split-partitions'))
+            job_cmd = ' '.join((job_cmd, '-disable-output'))
+            job_cmd = ' '.join((job_cmd, '<', args.prog + '.bc'))
+            cmds.append(job_cmd)
+        if args.jobs == 1:
+            rcs_utils.invoke(cmds[0])
+        else:
+            invoke_parallel(cmds, args.jobs)
+        # Other jobs read the old map while job 0 writes the new one.
+        os.rename(new_id_map, id_map)
+        if args.report is not None:
+            merge_reports(args.report, args.jobs)
+
+        # Only compile the modules whose object code is not cached yet.
+        # Module names are hashes of their contents, so an existing object is
+        # always up to date.
+        # Partition modules keep their debug info.
+        codegen_flags = '-O3' if args.incremental else '-O3 -g'
+        objs = []
+        cmds = []
+        for i in xrange(args.jobs):
+            for h in read_manifest(manifest + '.' + str(i)):
+                obj = os.path.join(cache_dir, h + '.o')
+                if not os.path.exists(obj):
+                    cmds.append(' '.join(('clang++', '-c',
+                                          os.path.join(cache_dir, h + '.bc'),
+                                          '-o', obj + '.tmp', codegen_flags,
+                                          '&&', 'mv', obj + '.tmp', obj)))
+                objs.append(obj)
+        invoke_parallel(cmds, args.jobs)
+        # The object list can be too long for a command line.
+        obj_list = os.path.join(cache_dir, 'objs')
+        with open(obj_list, 'w') as f:
+            f.write('\n'.join(objs) + '\n')
+        inputs = '@' + obj_list
 
-    cmd = ' '.join(('clang++', instrumented_bc,
+    cmd = ' '.join(('clang++', inputs,
                     rcs_utils.get_libdir() + '/libLoomUpdateEngine.a',
                     rcs_utils.get_libdir() + '/libLoomUtils.a',
                     '-o', instrumented_exe,
                     '-g', '-O3'))
     linking_flags = rcs_utils.get_linking_flags(args.prog)
     cmd = ' '.join((cmd, ' '.join(linking_flags), '-pthread'))
-    rcs_utils.invoke(cmd) 
+    rcs_utils.invoke(cmd)
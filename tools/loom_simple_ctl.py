@@ -4,31 +4,52 @@ import socket, sys, struct
 
 def print_usage():
     print 'Usage:'
-    print '  add <fix ID> <extension name>'
-    print '  del <fix ID>'
+    print '  add <fix ID> <extension name> [timeout=<ms>] [budget=<percent>]'
+    print '      [window=<ms>] [shadow]'
+    print '  del <fix ID> [timeout=<ms>]'
     print '  ls'
+    print '  lockstats'
+    print '  threads'
+    print '  shadowstats'
+    print '  probes'
+    print '  intervals'
+    print '  trace on|off|dump <file>'
     print '  quit or exit to exit the controller'
 
-def send_message(conn, msg):
-    buffer = struct.pack('!i', len(msg)) + msg
-    n_sent = conn.send(buffer)
-    if n_sent != len(buffer):
-        return -1
-    else:
-        return 0
-
 def recv_message(conn):
     str_pack_len = conn.recv(4)
     if len(str_pack_len) != 4:
         return -1, ''
     pack_len = struct.unpack('!i', str_pack_len)[0]
-    if pack_len >= 1024:
+    if pack_len >= 4096:
         return -1, ''
     buffer = conn.recv(pack_len)
     if pack_len != len(buffer):
         return -1, ''
     return 0, buffer
 
+# Messages after "iam loom_daemon" carry tags. A response carries the tag of
+# the command it answers, and tag 0 marks messages nobody asked for.
+def send_tagged_message(conn, tag, msg):
+    buffer = struct.pack('!iI', len(msg), tag) + msg
+    n_sent = conn.send(buffer)
+    if n_sent != len(buffer):
+        return -1
+    else:
+        return 0
+
+def recv_tagged_message(conn):
+    header = conn.recv(8)
+    if len(header) != 8:
+        return -1, 0, ''
+    pack_len, tag = struct.unpack('!iI', header)
+    if pack_len >= 4096:
+        return -1, 0, ''
+    buffer = conn.recv(pack_len)
+    if pack_len != len(buffer):
+        return -1, 0, ''
+    return 0, tag, buffer
+
 if __name__ == '__main__':
     print_usage()
     HOST = 'localhost'
@@ -56,16 +77,23 @@ if __name__ == '__main__':
         sock.close()
         sys.exit(0)
 
+    tag = 0
     while True:
         sys.stdout.write('\033[0;32mloom>\033[m ')
         cmd = sys.stdin.readline().strip()
         if cmd == 'quit' or cmd == 'exit':
             print 'exit'
             break
-        if send_message(conn, cmd) == -1:
+        tag += 1
+        if send_tagged_message(conn, tag, cmd) == -1:
             print 'disconnected'
             break
-        ret, buffer = recv_message(conn)
+        # Messages starting with '+' report progress. Keep waiting for the
+        # final response.
+        ret, resp_tag, buffer = recv_tagged_message(conn)
+        while ret == 0 and (resp_tag != tag or buffer.startswith('+')):
+            print buffer.lstrip('+')
+            ret, resp_tag, buffer = recv_tagged_message(conn)
         if ret == -1:
             print 'disconnected'
             break